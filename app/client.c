@@ -0,0 +1,474 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "timer.h"
+
+// Clients indexed by fd. The kernel hands out the lowest free fd, so this
+// stays about as large as the peak number of connections. With shards,
+// each shard's thread keeps its own table and only sees its own clients.
+static _Thread_local Client **clients = NULL;
+static _Thread_local size_t clients_capacity = 0;
+
+// Clients from least to most recently active, on this thread
+static _Thread_local Client *idle_head = NULL;
+static _Thread_local Client *idle_tail = NULL;
+
+// Connections over all shards, for maxclients
+static _Atomic size_t connected_count = 0;
+
+// Fds of clients with output queued since the last flush
+static _Thread_local int *pending_writes = NULL;
+static _Thread_local size_t pending_writes_count = 0;
+static _Thread_local size_t pending_writes_capacity = 0;
+
+// Same defaults as Redis: normal clients are never cut off, a replica that
+// falls 256MB behind, or 64MB for a minute, is.
+static ClientBufferLimit output_buffer_limits[CLIENT_CLASS_COUNT] = {
+    [CLIENT_CLASS_NORMAL] = {0, 0, 0},
+    [CLIENT_CLASS_REPLICA] = {256 * 1024 * 1024, 64 * 1024 * 1024, 60},
+};
+
+static int clients_reserve(int fd) {
+  if ((size_t)fd < clients_capacity)
+    return 0;
+
+  size_t capacity = clients_capacity ? clients_capacity : 64;
+  while (capacity <= (size_t)fd)
+    capacity *= 2;
+
+  Client **table = realloc(clients, capacity * sizeof(Client *));
+  if (table == NULL)
+    return -1;
+  memset(table + clients_capacity, 0, (capacity - clients_capacity) * sizeof(Client *));
+  clients = table;
+  clients_capacity = capacity;
+  return 0;
+}
+
+Client *client_create(int fd) {
+  if (fd < 0 || clients_reserve(fd) != 0)
+    return NULL;
+
+  Client *c = malloc(sizeof(Client));
+  if (c == NULL)
+    return NULL;
+
+  c->fd = fd;
+  c->flags = 0;
+  c->db = 0;
+  c->qb_pos = 0;
+  c->commands = NULL;
+  c->command_count = 0;
+  c->command_capacity = 0;
+  c->qb_parsed = 0;
+  c->args = (RESPArgs){NULL, 0, 0};
+  resp_parser_init(&c->parser);
+  c->shard_calls = NULL;
+  c->shard_calls_tail = NULL;
+  c->shard_calls_count = 0;
+  c->last_interaction = timer_now_ms();
+  c->idle_prev = idle_tail;
+  c->idle_next = NULL;
+  c->waiting_acks = 0;
+  c->bufpos = 0;
+  c->sentlen = 0;
+  c->obuf_soft_limit_reached_time = 0;
+  reply_init(&c->reply, c->buf, sizeof(c->buf));
+  c->querybuf = sdsnewlen(NULL, 0);
+  if (c->querybuf == NULL) {
+    free(c);
+    return NULL;
+  }
+
+  clients[fd] = c;
+  if (idle_tail != NULL)
+    idle_tail->idle_next = c;
+  else
+    idle_head = c;
+  idle_tail = c;
+  connected_count++;
+  return c;
+}
+
+static void idle_unlink(Client *c) {
+  if (c->idle_prev != NULL)
+    c->idle_prev->idle_next = c->idle_next;
+  else
+    idle_head = c->idle_next;
+  if (c->idle_next != NULL)
+    c->idle_next->idle_prev = c->idle_prev;
+  else
+    idle_tail = c->idle_prev;
+  c->idle_prev = NULL;
+  c->idle_next = NULL;
+}
+
+// The client sent or was sent something. Moving it to the tail keeps the
+// list ordered, as long as now_ms never goes back.
+void client_touch(Client *c, uint64_t now_ms) {
+  c->last_interaction = now_ms;
+  if (c == idle_tail)
+    return;
+  idle_unlink(c);
+  c->idle_prev = idle_tail;
+  idle_tail->idle_next = c;
+  idle_tail = c;
+}
+
+// The client of this thread that has been quiet the longest, NULL if none
+Client *client_most_idle() { return idle_head; }
+
+size_t client_count() { return connected_count; }
+
+Client *client_lookup(int fd) {
+  if (fd < 0 || (size_t)fd >= clients_capacity)
+    return NULL;
+  return clients[fd];
+}
+
+// Forget the client and close its connection
+void client_free(Client *c) {
+  if (c == NULL)
+    return;
+
+  if (c->fd >= 0 && (size_t)c->fd < clients_capacity && clients[c->fd] == c)
+    clients[c->fd] = NULL;
+  close(c->fd);
+  idle_unlink(c);
+  connected_count--;
+  sdsfree(c->querybuf);
+  free(c->commands);
+  free(c->args.args);
+  reply_free(&c->reply);
+  free(c);
+}
+
+// Drain the socket into the query buffer. The fd is edge triggered, so
+// reading stops only once the kernel has nothing more. Returns the number
+// of bytes read, or -1 if the connection is gone or broke the query buffer
+// limit.
+int client_read(Client *c) {
+  int total = 0;
+
+  while (1) {
+    if (sdslen(c->querybuf) - c->qb_pos >= CLIENT_MAX_QUERY_BUF) {
+      fprintf(stderr, "Client %d exceeded the query buffer limit, closing\n", c->fd);
+      return -1;
+    }
+
+    sds querybuf = sdsmakeroomfor(c->querybuf, CLIENT_READ_CHUNK);
+    if (querybuf == NULL)
+      return -1;
+    c->querybuf = querybuf;
+
+    size_t avail = sdsavail(c->querybuf);
+    ssize_t n = recv(c->fd, c->querybuf + sdslen(c->querybuf), avail, 0);
+    if (n > 0) {
+      sdsincrlen(c->querybuf, n);
+      total += n;
+      // A short read took everything the socket had. Anything arriving
+      // later raises a new edge, so the recv that would just say EAGAIN
+      // can be skipped.
+      if ((size_t)n < avail)
+        return total;
+      continue;
+    }
+    if (n == 0)
+      return -1; // Closed by the other end
+    if (errno == EINTR)
+      continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return total;
+    return -1;
+  }
+}
+
+// Append bytes the event loop already read for us. Returns -1 if they
+// would break the query buffer limit.
+int client_append_input(Client *c, const char *data, size_t len) {
+  if (sdslen(c->querybuf) - c->qb_pos + len > CLIENT_MAX_QUERY_BUF) {
+    fprintf(stderr, "Client %d exceeded the query buffer limit, closing\n", c->fd);
+    return -1;
+  }
+
+  sds querybuf = sdsmakeroomfor(c->querybuf, len);
+  if (querybuf == NULL)
+    return -1;
+  c->querybuf = querybuf;
+  memcpy(c->querybuf + sdslen(c->querybuf), data, len);
+  sdsincrlen(c->querybuf, len);
+  return 0;
+}
+
+// The command's argc arguments must already be in c->args from arg_index
+// on. Returns -1 if it can't be queued.
+int client_queue_command(Client *c, size_t arg_index, size_t argc, size_t offset, size_t len) {
+  if (c->command_count == c->command_capacity) {
+    size_t capacity = c->command_capacity ? c->command_capacity * 2 : 16;
+    ParsedCommand *commands = realloc(c->commands, capacity * sizeof(ParsedCommand));
+    if (commands == NULL)
+      return -1;
+    c->commands = commands;
+    c->command_capacity = capacity;
+  }
+  c->commands[c->command_count++] = (ParsedCommand){arg_index, argc, offset, len};
+  return 0;
+}
+
+// Drop what has been executed so a partial command sits at the front for
+// the next read, and hand back the memory a burst of large commands left.
+void client_trim_query_buffer(Client *c) {
+  if (c->qb_pos > 0) {
+    sdsconsume(c->querybuf, c->qb_pos);
+    c->qb_parsed = c->qb_parsed > c->qb_pos ? c->qb_parsed - c->qb_pos : 0;
+    c->qb_pos = 0;
+  }
+  if (sdslen(c->querybuf) == 0 && sdsalloc(c->querybuf) > CLIENT_QUERY_BUF_SHRINK_SIZE)
+    c->querybuf = sdsresize(c->querybuf, 0);
+  // Same for the arguments of a pipeline with a great many of them
+  if (c->args.count == 0 && c->args.capacity > CLIENT_ARGS_SHRINK_COUNT) {
+    free(c->args.args);
+    c->args = (RESPArgs){NULL, 0, 0};
+  }
+}
+
+// --------------------------------------------------------------------------
+// Output
+
+void client_mark_pending_write(Client *c) {
+  if (c->flags & CLIENT_PENDING_WRITE)
+    return;
+
+  if (pending_writes_count == pending_writes_capacity) {
+    size_t capacity = pending_writes_capacity ? pending_writes_capacity * 2 : 64;
+    int *fds = realloc(pending_writes, capacity * sizeof(int));
+    if (fds == NULL) {
+      // Can't be tracked, so it could never be flushed
+      c->flags |= CLIENT_CLOSE_ASAP;
+      return;
+    }
+    pending_writes = fds;
+    pending_writes_capacity = capacity;
+  }
+  pending_writes[pending_writes_count++] = c->fd;
+  c->flags |= CLIENT_PENDING_WRITE;
+}
+
+// The buffer to append output for c to
+ReplyBuffer *client_reply(Client *c) {
+  client_mark_pending_write(c);
+  return &c->reply;
+}
+
+// Queue bytes for whoever is connected on fd, e.g. a replica found through
+// the replication state. Does nothing if that connection is gone.
+void client_queue_output(int fd, const void *data, size_t len) {
+  Client *c = client_lookup(fd);
+  if (c != NULL)
+    reply_add_raw(client_reply(c), data, len);
+}
+
+// Take the next client with queued output off the pending list. An fd whose
+// client was closed, or closed and replaced, since it was queued is skipped.
+Client *client_next_pending_write() {
+  while (pending_writes_count > 0) {
+    Client *c = client_lookup(pending_writes[--pending_writes_count]);
+    if (c != NULL && (c->flags & CLIENT_PENDING_WRITE)) {
+      c->flags &= ~CLIENT_PENDING_WRITE;
+      return c;
+    }
+  }
+  return NULL;
+}
+
+// Drop n written bytes from the front of the output
+static void client_consume_output(Client *c, size_t n) {
+  c->reply.length -= n;
+
+  size_t from_buf = c->reply.used - c->bufpos;
+  if (from_buf > n)
+    from_buf = n;
+  c->bufpos += from_buf;
+  n -= from_buf;
+
+  while (c->reply.head != NULL && c->reply.head->size > 0) {
+    ReplyBlock *head = c->reply.head;
+    size_t left = head->used - c->sentlen;
+    if (n < left) {
+      c->sentlen += n;
+      return;
+    }
+    n -= left;
+    c->reply.head = head->next;
+    if (c->reply.head == NULL)
+      c->reply.tail = NULL;
+    free(head);
+    c->sentlen = 0;
+  }
+}
+
+// Gather up to max chunks of pending output for a single write. Returns how
+// many, or -1 if the output can't be sent anymore.
+int client_output_iov(Client *c, struct iovec *iov, int max) {
+  if (c->reply.oom) {
+    // Part of a reply was dropped, the stream can't be trusted anymore
+    return -1;
+  }
+
+  int iovcnt = 0;
+  if (c->bufpos < c->reply.used && iovcnt < max) {
+    iov[iovcnt].iov_base = c->reply.buf + c->bufpos;
+    iov[iovcnt].iov_len = c->reply.used - c->bufpos;
+    iovcnt++;
+  }
+  size_t skip = c->sentlen;
+  for (ReplyBlock *block = c->reply.head; block != NULL && iovcnt < max; block = block->next) {
+    if (block->size == 0)
+      break; // A deferred length never filled in, nothing after it can go
+    if (block->used > skip) {
+      iov[iovcnt].iov_base = block->buf + skip;
+      iov[iovcnt].iov_len = block->used - skip;
+      iovcnt++;
+    }
+    skip = 0;
+  }
+  return iovcnt;
+}
+
+// Account for a write of what client_output_iov gathered, result being the
+// bytes written or -errno. Returns 1 once everything is out, 0 if some is
+// left, -1 if the client has to go.
+int client_output_written(Client *c, ssize_t result) {
+  if (result < 0) {
+    if (result == -EAGAIN || result == -EWOULDBLOCK || result == -EINTR)
+      return 0;
+    return -1;
+  }
+
+  client_consume_output(c, result);
+  if (c->reply.length > 0)
+    return 0;
+
+  // All written, start over at the front of the client's own buffer
+  reply_reset(&c->reply);
+  c->bufpos = 0;
+  c->sentlen = 0;
+  return 1;
+}
+
+// Write as much queued output as the socket takes, up to CLIENT_WRITE_IOV
+// chunks per writev. Returns 1 once everything is out, 0 if the socket is
+// full and the rest has to wait for EPOLLOUT, -1 if the client has to go.
+int client_write(Client *c) {
+  if (c->reply.length == 0 && !c->reply.oom)
+    return client_output_written(c, 0);
+
+  while (1) {
+    struct iovec iov[CLIENT_WRITE_IOV];
+    int iovcnt = client_output_iov(c, iov, CLIENT_WRITE_IOV);
+    if (iovcnt <= 0)
+      return iovcnt;
+
+    ssize_t n = writev(c->fd, iov, iovcnt);
+    if (n < 0 && errno == EINTR)
+      continue;
+    int status = client_output_written(c, n < 0 ? -errno : n);
+    if (status != 0 || n < 0)
+      return status;
+  }
+}
+
+// --------------------------------------------------------------------------
+// Output buffer limits
+
+// Parses sizes like 256mb, 64k or 1048576
+static int parse_memory(const char *str, size_t *bytes) {
+  char *end;
+  errno = 0;
+  unsigned long long value = strtoull(str, &end, 10);
+  if (errno != 0 || end == str || *str == '-')
+    return -1;
+
+  unsigned long long unit = 1;
+  if (*end == '\0' || strcasecmp(end, "b") == 0)
+    unit = 1;
+  else if (strcasecmp(end, "k") == 0 || strcasecmp(end, "kb") == 0)
+    unit = 1024;
+  else if (strcasecmp(end, "m") == 0 || strcasecmp(end, "mb") == 0)
+    unit = 1024 * 1024;
+  else if (strcasecmp(end, "g") == 0 || strcasecmp(end, "gb") == 0)
+    unit = 1024 * 1024 * 1024;
+  else
+    return -1;
+
+  *bytes = value * unit;
+  return 0;
+}
+
+// Takes the Redis config format, one or more of
+// "<normal|replica> <hard limit> <soft limit> <soft seconds>"
+int client_set_output_buffer_limit(const char *spec) {
+  ClientBufferLimit limits[CLIENT_CLASS_COUNT];
+  memcpy(limits, output_buffer_limits, sizeof(limits));
+
+  char class_name[16], hard[32], soft[32];
+  unsigned long long seconds;
+  int consumed;
+  const char *p = spec;
+
+  while (sscanf(p, "%15s %31s %31s %llu%n", class_name, hard, soft, &seconds, &consumed) == 4) {
+    ClientClass class;
+    if (strcasecmp(class_name, "normal") == 0)
+      class = CLIENT_CLASS_NORMAL;
+    else if (strcasecmp(class_name, "replica") == 0 || strcasecmp(class_name, "slave") == 0)
+      class = CLIENT_CLASS_REPLICA;
+    else
+      return -1;
+
+    if (parse_memory(hard, &limits[class].hard_limit_bytes) != 0 ||
+        parse_memory(soft, &limits[class].soft_limit_bytes) != 0)
+      return -1;
+    limits[class].soft_limit_seconds = seconds;
+
+    p += consumed;
+    while (*p == ' ')
+      p++;
+  }
+  if (*p != '\0' || p == spec)
+    return -1;
+
+  memcpy(output_buffer_limits, limits, sizeof(limits));
+  return 0;
+}
+
+// Checked whenever the client's output is flushed. The master is never cut
+// off, losing it would cost a full resync.
+int client_output_buffer_limit_reached(Client *c, uint64_t now_ms) {
+  if (c->flags & CLIENT_MASTER)
+    return 0;
+
+  const ClientBufferLimit *limit =
+      &output_buffer_limits[(c->flags & CLIENT_REPLICA) ? CLIENT_CLASS_REPLICA : CLIENT_CLASS_NORMAL];
+  size_t pending = c->reply.length;
+
+  if (limit->hard_limit_bytes > 0 && pending >= limit->hard_limit_bytes)
+    return 1;
+
+  if (limit->soft_limit_bytes > 0 && pending >= limit->soft_limit_bytes) {
+    if (c->obuf_soft_limit_reached_time == 0) {
+      c->obuf_soft_limit_reached_time = now_ms;
+      return 0;
+    }
+    return now_ms - c->obuf_soft_limit_reached_time >= limit->soft_limit_seconds * 1000;
+  }
+
+  c->obuf_soft_limit_reached_time = 0;
+  return 0;
+}
@@ -0,0 +1,129 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "reply.h"
+#include "resp.h"
+#include "sds.h"
+
+// Bytes asked of the kernel per read
+#define CLIENT_READ_CHUNK (16 * 1024)
+// A query buffer this large that holds no pending bytes is given back
+#define CLIENT_QUERY_BUF_SHRINK_SIZE (64 * 1024)
+// Likewise for room for this many parsed arguments
+#define CLIENT_ARGS_SHRINK_COUNT 1024
+// Connections whose unparsed input grows past this are dropped
+#define CLIENT_MAX_QUERY_BUF (1024 * 1024 * 1024)
+
+// Replies are written to this buffer inside the client first, and only
+// spill over into heap blocks once it is full
+#define CLIENT_REPLY_CHUNK (16 * 1024)
+// Chunks handed to a single writev
+#define CLIENT_WRITE_IOV 64
+
+typedef enum {
+  CLIENT_MASTER = 1 << 0,        // The connection to our master
+  CLIENT_REPLICA = 1 << 1,       // A replica that did PSYNC with us
+  CLIENT_CLOSE_ASAP = 1 << 2,    // Close once the current event is handled
+  CLIENT_PENDING_WRITE = 1 << 3, // Has output queued for the next flush
+  CLIENT_WRITE_HANDLER = 1 << 4, // Socket was full, waiting for EPOLLOUT
+  CLIENT_SHARD_WAIT = 1 << 5,    // Too many commands out on other shards
+  CLIENT_PENDING_READ = 1 << 6,  // Queued to be read and parsed this iteration
+  CLIENT_CLOSE_AFTER_REPLY = 1 << 7, // Close once its pending output is written
+} ClientFlags;
+
+// Output buffer limits are set per class of client
+typedef enum {
+  CLIENT_CLASS_NORMAL,
+  CLIENT_CLASS_REPLICA,
+  CLIENT_CLASS_COUNT
+} ClientClass;
+
+// A client is disconnected once its pending output reaches the hard limit,
+// or has stayed above the soft limit for soft_limit_seconds. 0 disables.
+typedef struct {
+  size_t hard_limit_bytes;
+  size_t soft_limit_bytes;
+  uint64_t soft_limit_seconds;
+} ClientBufferLimit;
+
+// A complete command found in the query buffer, waiting to be executed.
+// Its arguments are args.args[arg_index] on, views into querybuf.
+typedef struct {
+  size_t arg_index;
+  size_t argc;
+  size_t offset; // Where its raw bytes start in querybuf
+  size_t len;
+} ParsedCommand;
+
+// Everything the server keeps for one connection
+typedef struct Client {
+  int fd;
+  int flags;
+  int db;        // Selected database
+  sds querybuf;  // Bytes read but not yet executed
+  size_t qb_pos; // How much of querybuf has been parsed and executed
+
+  // Commands parsed, possibly by an I/O thread, that the main thread has
+  // yet to execute. They end at qb_parsed. Their arguments point into
+  // querybuf, so none may be left queued once it can move; see
+  // execute_parsed_commands.
+  ParsedCommand *commands;
+  size_t command_count;
+  size_t command_capacity;
+  size_t qb_parsed;
+  RESPArgs args;
+  RESPParser parser; // A command cut short at qb_parsed, see resp_parse_command
+
+  // Commands out on other shards, oldest first. Their replies, and those of
+  // commands run here meanwhile, are sent in this order. See shard.c.
+  struct ShardCall *shard_calls;
+  struct ShardCall *shard_calls_tail;
+  size_t shard_calls_count;
+
+  // Clients are kept in order of last_interaction, on the timer clock, so
+  // the idle ones are found from the head. See close_idle_clients.
+  uint64_t last_interaction;
+  struct Client *idle_prev;
+  struct Client *idle_next;
+  int waiting_acks; // WAITs not answered yet, the client isn't idle meanwhile
+
+  // Output not yet written. reply.length counts the bytes still pending.
+  ReplyBuffer reply;
+  size_t bufpos;  // Bytes of reply.buf already written
+  size_t sentlen; // Bytes of the first reply block already written
+  uint64_t obuf_soft_limit_reached_time; // When the soft limit was crossed, 0 if under it
+  char buf[CLIENT_REPLY_CHUNK];
+} Client;
+
+Client *client_create(int fd);
+Client *client_lookup(int fd);
+void client_free(Client *c);
+size_t client_count();
+
+void client_touch(Client *c, uint64_t now_ms);
+Client *client_most_idle();
+
+int client_read(Client *c);
+int client_append_input(Client *c, const char *data, size_t len);
+int client_queue_command(Client *c, size_t arg_index, size_t argc, size_t offset, size_t len);
+void client_trim_query_buffer(Client *c);
+
+// Output is only queued here; it is written by the event loop once per
+// iteration through client_next_pending_write and client_write.
+ReplyBuffer *client_reply(Client *c);
+void client_queue_output(int fd, const void *data, size_t len);
+void client_mark_pending_write(Client *c);
+Client *client_next_pending_write();
+int client_write(Client *c);
+int client_output_iov(Client *c, struct iovec *iov, int max);
+int client_output_written(Client *c, ssize_t result);
+
+int client_set_output_buffer_limit(const char *spec);
+int client_output_buffer_limit_reached(Client *c, uint64_t now_ms);
+
+#endif // CLIENT_H
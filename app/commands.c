@@ -1,3 +1,6 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -9,9 +12,12 @@
 #include "helper.h"
 #include "commands.h"
 #include "dlist.h"
+#include "hash.h"
 #include "replication.h"
+#include "reply.h"
+#include "shard.h"
 
-// Command type enum
+// Command type enum, also the command's index in COMMANDS
 typedef enum {
   CMD_PING,
   CMD_ECHO,
@@ -21,152 +27,375 @@ typedef enum {
   CMD_CONFIG,
   CMD_KEYS,
   CMD_INFO,
-  CMD_UNKNOWN,
   CMD_REPLCONF,
   CMD_PSYNC,
   CMD_WAIT,
-  CMD_TYPE
+  CMD_TYPE,
+  CMD_EXPIRE,
+  CMD_PEXPIRE,
+  CMD_TTL,
+  CMD_PTTL,
+  CMD_PERSIST,
+  CMD_SELECT,
+  CMD_SWAPDB,
+  CMD_FLUSHDB,
+  CMD_FLUSHALL,
+  CMD_SCAN,
+  CMD_COUNT
 } CommandType;
 
+typedef enum {
+  CMD_FLAG_WRITE = 1 << 0,           // Changes the keyspace, propagated to replicas
+  CMD_FLAG_READONLY = 1 << 1,        // Only reads the keyspace
+  CMD_FLAG_REPLY_TO_MASTER = 1 << 2, // Answered even when our master sent it
+  CMD_FLAG_ALL_DBS = 1 << 3,         // Not about one db, no SELECT is propagated ahead of it
+} CommandFlags;
+
+// What a command runs with. c is NULL when a shard runs it for a client of
+// another shard, which only happens for commands that don't need the client.
+typedef struct {
+  Client *c;
+  int connection_fd; // -1 without a client
+  ReplyBuffer *reply;
+  RESPCommand *request;
+  int db;
+  Keyspace *keyspace;
+  RedisStats *stats;
+} CommandContext;
+
+typedef void (*CommandProc)(CommandContext *ctx);
+
 // Command specification with max and min arguments
 typedef struct {
   CommandType type;
+  const char *name;
+  CommandProc proc;
   int min_args;
   int max_args;
-  const char *name;
-  bool should_send_to_slave;
-  bool should_respond_to_master;
+  int flags;
+  ShardRoute shard_route;
 } CommandInfo;
 
-// Command specification with max and min arguments
-static const CommandInfo COMMANDS[] = {
-    {CMD_PING, 1, 1, "PING", 0, 0},
-    {CMD_ECHO, 2, 2, "ECHO", 0, 0},
-    {CMD_SET, 3, 5, "SET", 1, 0},
-    {CMD_GET, 2, 2, "GET", 0, 0},
-    {CMD_DEL, 2, 2, "DEL", 1, 0},
-    {CMD_KEYS, 2, 2, "KEYS", 0, 0},
-    {CMD_CONFIG, 3, 3, "CONFIG", 0, 0},
-    {CMD_INFO, 2, 2, "INFO", 0, 1},
-    {CMD_REPLCONF, 3, 10, "REPLCONF", 0, 1},
-    {CMD_PSYNC, 3, 3, "PSYNC", 0, 0},
-    {CMD_WAIT, 3, 3, "WAIT", 0, 0},
-    {CMD_TYPE, 2, 2, "TYPE", 0, 0},
-};
+// Counted by the thread the client is on, once however many shards run
+// the command. Every thread has its own row, so shards never write to the
+// same cache line.
+typedef struct {
+  _Atomic uint64_t calls;
+  _Atomic uint64_t rejected_calls; // Turned down before running, e.g. for their arity
+} CommandStats;
 
-// Command validation and parsing
-static CommandType get_command_type(const char *cmd_str) {
-  for (size_t i = 0; i < sizeof(COMMANDS) / sizeof(COMMANDS[0]); i++) {
-    if (strcasecmp(cmd_str, COMMANDS[i].name) == 0)
-      return COMMANDS[i].type;
-  }
-  return CMD_UNKNOWN;
-}
+typedef struct {
+  _Alignas(64) CommandStats commands[CMD_COUNT];
+} CommandStatsRow;
+
+static CommandStatsRow command_stats[SHARDS_MAX];
+
+static size_t command_stats_info(char *buf, size_t size);
 
-static CommandInfo get_command_info(const char *cmd_str) {
-  for (size_t i = 0; i < sizeof(COMMANDS) / sizeof(COMMANDS[0]); i++) {
-    if (strcasecmp(cmd_str, COMMANDS[i].name) == 0)
-      return COMMANDS[i];
+// A KEYS or SCAN MATCH pattern, with what can be worked out up front so
+// most keys are turned down without running the full glob match
+typedef struct {
+  const char *pattern; // NULL matches everything
+  size_t len;
+  size_t prefix_len; // Bytes before the first special character
+  bool literal;      // No special characters at all
+} KeyPattern;
+
+static void key_pattern_init(KeyPattern *kp, const RESPArg *pattern) {
+  kp->pattern = NULL;
+  kp->len = 0;
+  kp->prefix_len = 0;
+  kp->literal = false;
+
+  if (pattern == NULL || (pattern->len == 1 && pattern->ptr[0] == '*')) {
+    return;
   }
-  CommandInfo unknown_cmd = {CMD_UNKNOWN, -1, -1, "UNKNOWN", 0};
-  return unknown_cmd;
+  kp->pattern = pattern->ptr;
+  kp->len = pattern->len;
+  while (kp->prefix_len < kp->len && memchr("*?[\\", kp->pattern[kp->prefix_len], 4) == NULL) {
+    kp->prefix_len++;
+  }
+  kp->literal = kp->prefix_len == kp->len;
 }
 
-static bool validate_command_args(CommandType cmd, size_t arg_count) {
-  for (size_t i = 0; i < sizeof(COMMANDS) / sizeof(COMMANDS[0]); i++) {
-    if (COMMANDS[i].type == cmd)
-      return COMMANDS[i].max_args == -1 ||
-             (arg_count >= COMMANDS[i].min_args &&
-              (arg_count <= COMMANDS[i].max_args));
+static bool key_pattern_match(const KeyPattern *kp, const sds key) {
+  if (kp->pattern == NULL) {
+    return true;
+  }
+  if (sdslen(key) < kp->prefix_len || memcmp(key, kp->pattern, kp->prefix_len) != 0) {
+    return false;
   }
-  return false;
+  return glob_match(kp->pattern + kp->prefix_len, kp->len - kp->prefix_len,
+                    key + kp->prefix_len, sdslen(key) - kp->prefix_len);
 }
 
 // Command handlers
-size_t handle_ping(char* write_buf, size_t buf_size) { 
-  return snprintf(write_buf, buf_size, "+PONG\r\n");
+void handle_ping(ReplyBuffer *reply) { 
+  reply_add_shared(reply, &shared.pong);
 }
 
-size_t handle_echo(char* write_buf, size_t buf_size, RESPData *request) {
-  return snprintf(write_buf, buf_size, "+%s\r\n", request->data.array.elements[1]->data.str);
+void handle_echo(ReplyBuffer *reply, RESPCommand *request) {
+  RESPArg *message = &request->argv[1];
+  reply_add_bulk_string(reply, message->ptr, message->len);
 }
 
-size_t handle_set(char* write_buf, size_t buf_size, RESPData *request, ht_table *ht) {
-  const char *key = request->data.array.elements[1]->data.str;
-  void *value = request->data.array.elements[2]->data.str;
+void handle_set(ReplyBuffer *reply, RESPCommand *request, ht_table *ht) {
+  RESPArg *key = &request->argv[1];
+  RESPArg *value = &request->argv[2];
 
   uint64_t expiry = 0;
-  if (request->data.array.count > 3 &&
-      strcasecmp(request->data.array.elements[3]->data.str, "px") == 0)
-    expiry =
-        (uint64_t)strtol(request->data.array.elements[4]->data.str, NULL, 10);
+  if (request->argc > 3) {
+    long long ms;
+    if (request->argc != 5 || !resp_arg_equals(&request->argv[3], "px")) {
+      reply_add_shared(reply, &shared.syntaxerr);
+      return;
+    }
+    if (resp_arg_to_ll(&request->argv[4], &ms) != 0 || ms <= 0) {
+      reply_add_format(reply, "-ERR invalid expire time in 'set' command\r\n");
+      return;
+    }
+    expiry = (uint64_t)ms;
+  }
 
-  if (ht_set_with_relative_expiry(ht, key, value, expiry) == NULL) {
-    return snprintf(write_buf, buf_size, "-ERR failed to set key\r\n");
+  if (ht_set_with_relative_expiry(ht, key->ptr, key->len, value->ptr, value->len,
+                                  expiry) == NULL) {
+    reply_add_format(reply, "-ERR failed to set key\r\n");
+    return;
   }
 
-  return snprintf(write_buf, buf_size, "+OK\r\n");
+  reply_add_shared(reply, &shared.ok);
 }
 
-size_t handle_get(char* write_buf, size_t buf_size, RESPData *request, ht_table *ht) {
-  const char *key = request->data.array.elements[1]->data.str;
-  char *value = ht_get(ht, key);
+void handle_get(ReplyBuffer *reply, RESPCommand *request, ht_table *ht) {
+  RESPArg *key = &request->argv[1];
+  sds value = ht_get(ht, key->ptr, key->len);
 
   if (value == NULL) {
-    return snprintf(write_buf, buf_size, "$-1\r\n");
-  } else {
-    return snprintf(write_buf, buf_size, "$%ld\r\n%s\r\n", strlen(value), value);
+    reply_add_shared(reply, &shared.nullbulk);
+    return;
   }
+
+  reply_add_bulk_string(reply, value, sdslen(value));
 }
 
-size_t handle_del(char* write_buf, size_t buf_size, RESPData *request, ht_table *ht) {
-  ht_del(ht, request->data.array.elements[1]->data.str);
-  return snprintf(write_buf, buf_size, ":1\r\n");
+void handle_del(ReplyBuffer *reply, RESPCommand *request, ht_table *ht) {
+  int deleted = ht_del(ht, request->argv[1].ptr, request->argv[1].len);
+  reply_add_shared(reply, deleted ? &shared.cone : &shared.czero);
 }
 
-size_t handle_config(char* write_buf, size_t buf_size, RESPData *request, RedisStats *stats) {
-  if (request->data.array.count < 2) {
-    return snprintf(write_buf, buf_size, "-ERR CONFIG requires at least one argument\r\n");
+void handle_config(ReplyBuffer *reply, RESPCommand *request, RedisStats *stats) {
+  if (request->argc < 2) {
+    reply_add_format(reply, "-ERR CONFIG requires at least one argument\r\n");
+    return;
   }
 
-  if (strcmp(request->data.array.elements[1]->data.str, "GET") == 0) {
-    if (strcmp(request->data.array.elements[2]->data.str, "dir") == 0) {
-      return snprintf(write_buf, buf_size, "*2\r\n$3\r\ndir\r\n$%zu\r\n%s\r\n", 
+  if (resp_arg_equals(&request->argv[1], "GET")) {
+    if (resp_arg_equals(&request->argv[2], "dir")) {
+      reply_add_format(reply, "*2\r\n$3\r\ndir\r\n$%zu\r\n%s\r\n", 
                      strlen(stats->others.rdb_dir), stats->others.rdb_dir);
-    } else if (strcmp(request->data.array.elements[2]->data.str, "dbfilename") == 0) {
-      return snprintf(write_buf, buf_size, "*2\r\n$10\r\ndbfilename\r\n$%zu\r\n%s\r\n", 
+    } else if (resp_arg_equals(&request->argv[2], "dbfilename")) {
+      reply_add_format(reply, "*2\r\n$10\r\ndbfilename\r\n$%zu\r\n%s\r\n", 
                      strlen(stats->others.rdb_filename), stats->others.rdb_filename);
     } else {
-      return snprintf(write_buf, buf_size, "-ERR Unknown CONFIG parameter\r\n");
+      reply_add_format(reply, "-ERR Unknown CONFIG parameter\r\n");
     }
   } else {
-    return snprintf(write_buf, buf_size, "-ERR Unknown CONFIG command\r\n");
+    reply_add_format(reply, "-ERR Unknown CONFIG command\r\n");
   }
 }
 
-size_t handle_keys(char* write_buf, size_t buf_size, RESPData *request, ht_table *ht) {
-  const char *pattern = request->data.array.elements[1]->data.str;
-  // For now, return all keys without pattern matching
-  size_t count = 0;
-  const char **keys = ht_get_keys(ht, &count);
-  
-  // Write array header
-  size_t cursor = snprintf(write_buf, buf_size, "*%zu\r\n", count);
-  
-  // Write each key as a bulk string
-  for (size_t i = 0; i < count && cursor < buf_size; i++) {
-    cursor += snprintf(write_buf + cursor, buf_size - cursor, "$%zu\r\n%s\r\n", 
-                      strlen(keys[i]), keys[i]);
+// Keys matched by KEYS go straight into the reply
+typedef struct {
+  KeyPattern *pattern;
+  ReplyBuffer *reply;
+  size_t count;
+} KeysResult;
+
+static void keys_add_key(void *privdata, const sds key, const sds value) {
+  (void)value;
+  KeysResult *result = privdata;
+
+  if (key_pattern_match(result->pattern, key)) {
+    reply_add_bulk_string(result->reply, key, sdslen(key));
+    result->count++;
   }
-  
-  free(keys);
-  return cursor;
 }
 
-size_t handle_info(char* write_buf, size_t buf_size, RESPData *request, RedisStats *stats) {
-  const char *info_type = request->data.array.elements[1]->data.str;
+void handle_keys(ReplyBuffer *reply, RESPCommand *request, ht_table *ht) {
+  KeyPattern pattern;
+  key_pattern_init(&pattern, &request->argv[1]);
+
+  // Without any wildcards there is at most one key to find
+  if (pattern.literal) {
+    if (ht_get(ht, pattern.pattern, pattern.len) != NULL) {
+      reply_add_array_len(reply, 1);
+      reply_add_bulk_string(reply, pattern.pattern, pattern.len);
+    } else {
+      reply_add_shared(reply, &shared.emptyarray);
+    }
+    return;
+  }
+
+  // The count is only known once the whole table was walked
+  ReplyBlock *deferred_len = reply_add_deferred_len(reply);
+  KeysResult result = {&pattern, reply, 0};
+  unsigned long cursor = 0;
+  do {
+    cursor = ht_scan(ht, cursor, keys_add_key, &result);
+  } while (cursor != 0);
+  reply_set_deferred_array_len(reply, deferred_len, result.count);
+}
+
+void handle_info(ReplyBuffer *reply, RESPCommand *request, Keyspace *keyspace, RedisStats *stats) {
+  RESPArg *info_type = &request->argv[1];
+
+  if (resp_arg_equals(info_type, "keyspace")) {
+    char info_content[2048];
+    size_t info_len = 0;
+
+    info_len += snprintf(info_content + info_len, sizeof(info_content) - info_len,
+                         "# Keyspace\r\n");
+    info_len += snprintf(info_content + info_len, sizeof(info_content) - info_len,
+                         "rehashing:%d\r\n", keyspace_is_rehashing(keyspace));
+    // Like Redis, only databases that hold keys are listed, db0 always is
+    for (int i = 0; i < KEYSPACE_DB_COUNT; i++) {
+      ht_table *ht = keyspace->db[i];
+      if (i > 0 && ht->length == 0) {
+        continue;
+      }
+      info_len += snprintf(info_content + info_len, sizeof(info_content) - info_len,
+                           "db%d:keys=%zu,expires=%zu,slots=%zu", i, ht->length,
+                           ht->expires_count,
+                           ht->arrays[0].capacity + ht->arrays[1].capacity);
+      if (ht_is_rehashing(ht)) {
+        info_len += snprintf(info_content + info_len, sizeof(info_content) - info_len,
+                             ",rehash_from_slots=%zu,rehash_to_slots=%zu,"
+                             "rehash_progress=%ld/%zu",
+                             ht->arrays[0].capacity, ht->arrays[1].capacity,
+                             ht->rehash_idx, ht->arrays[0].capacity);
+      }
+      info_len += snprintf(info_content + info_len, sizeof(info_content) - info_len, "\r\n");
+    }
+
+    reply_add_bulk_string(reply, info_content, info_len);
+    return;
+  }
+
+  if (resp_arg_equals(info_type, "clients")) {
+    char info_content[256];
+    size_t info_len = 0;
+
+    // Every connection of every shard, replicas aside as in Redis
+    info_len += snprintf(info_content + info_len, sizeof(info_content) - info_len,
+                         "# Clients\r\n"
+                         "connected_clients:%zu\r\nmaxclients:%lu\r\nblocked_clients:%lu\r\n",
+                         client_count() - stats->others.connected_slaves->len,
+                         stats->clients.maxclients, stats->clients.blocked_clients);
+
+    reply_add_bulk_string(reply, info_content, info_len);
+    return;
+  }
+
+  if (resp_arg_equals(info_type, "stats")) {
+    char info_content[512];
+    size_t info_len = 0;
+    uint64_t expired_keys = 0;
+    for (int i = 0; i < KEYSPACE_DB_COUNT; i++) {
+      expired_keys += keyspace->db[i]->stat_expired_keys;
+    }
+
+    info_len += snprintf(info_content + info_len, sizeof(info_content) - info_len,
+                         "# Stats\r\n");
+    info_len += snprintf(info_content + info_len, sizeof(info_content) - info_len,
+                         "expired_keys:%lu\r\nexpired_time_cap_reached_count:%lu\r\n"
+                         "expire_cycle_cpu_milliseconds:%lu\r\n"
+                         "client_output_buffer_limit_disconnections:%lu\r\n",
+                         expired_keys, stats->stats.expired_time_cap_reached_count,
+                         stats->stats.expire_cycle_cpu_usec / 1000,
+                         stats->stats.client_output_buffer_limit_disconnections);
+
+    // Accepts during the last full second
+    uint64_t second = get_current_epoch_ms() / 1000;
+    uint64_t accepts_per_sec = 0;
+    if (second == stats->stats.accept_second)
+      accepts_per_sec = stats->stats.accepts_last_second;
+    else if (second == stats->stats.accept_second + 1)
+      accepts_per_sec = stats->stats.accepts_this_second;
+    info_len += snprintf(info_content + info_len, sizeof(info_content) - info_len,
+                         "total_connections_received:%lu\r\nrejected_connections:%lu\r\n"
+                         "instantaneous_accepts_per_sec:%lu\r\nmax_accepts_per_event:%lu\r\n",
+                         stats->clients.total_connections_received,
+                         stats->stats.rejected_connections, accepts_per_sec,
+                         stats->stats.max_accepts_per_event);
+
+    reply_add_bulk_string(reply, info_content, info_len);
+    return;
+  }
+
+  if (resp_arg_equals(info_type, "hashtable")) {
+    // Walks every slot, so keep it out of the sections polled routinely
+    static const char *bucket_names[HT_PROBE_HIST_BUCKETS] = {
+        "0", "1", "2-3", "4-7", "8-15", "16-31", "32-63", "64+"};
+    uint64_t lookups = 0, probes = 0, key_compares = 0;
+    size_t entries = 0;
+    double total_displacement = 0;
+    ht_probe_stats probe_stats = {0};
 
-  if (strcmp(info_type, "replication") == 0) {
+    // Summed over all databases
+    for (int i = 0; i < KEYSPACE_DB_COUNT; i++) {
+      ht_table *ht = keyspace->db[i];
+      ht_probe_stats db_stats;
+      ht_get_probe_stats(ht, &db_stats);
+
+      lookups += ht->stat_lookups;
+      probes += ht->stat_probes;
+      key_compares += ht->stat_key_compares;
+      entries += ht->length;
+      total_displacement += db_stats.avg_displacement * ht->length;
+      if (db_stats.max_displacement > probe_stats.max_displacement) {
+        probe_stats.max_displacement = db_stats.max_displacement;
+      }
+      for (int b = 0; b < HT_PROBE_HIST_BUCKETS; b++) {
+        probe_stats.histogram[b] += db_stats.histogram[b];
+      }
+    }
+    probe_stats.avg_displacement = entries ? total_displacement / entries : 0.0;
+
+    char info_content[512];
+    size_t info_len = 0;
+
+    info_len += snprintf(info_content + info_len, sizeof(info_content) - info_len,
+                         "# Hashtable\r\n");
+    info_len += snprintf(info_content + info_len, sizeof(info_content) - info_len,
+                         "hash_function:%s\r\n", hash_function_name());
+    info_len += snprintf(info_content + info_len, sizeof(info_content) - info_len,
+                         "lookups:%lu\r\nlookup_probes:%lu\r\navg_lookup_probes:%.2f\r\n"
+                         "key_compares:%lu\r\n",
+                         lookups, probes, lookups ? (double)probes / lookups : 0.0,
+                         key_compares);
+    info_len += snprintf(info_content + info_len, sizeof(info_content) - info_len,
+                         "avg_displacement:%.2f\r\nmax_displacement:%zu\r\n",
+                         probe_stats.avg_displacement, probe_stats.max_displacement);
+    info_len += snprintf(info_content + info_len, sizeof(info_content) - info_len,
+                         "displacement_histogram:");
+    for (int i = 0; i < HT_PROBE_HIST_BUCKETS; i++) {
+      info_len += snprintf(info_content + info_len, sizeof(info_content) - info_len,
+                           "%s%s=%zu", i ? "," : "", bucket_names[i], probe_stats.histogram[i]);
+    }
+    info_len += snprintf(info_content + info_len, sizeof(info_content) - info_len, "\r\n");
+
+    reply_add_bulk_string(reply, info_content, info_len);
+    return;
+  }
+
+  if (resp_arg_equals(info_type, "commandstats")) {
+    char info_content[4096];
+    size_t info_len = command_stats_info(info_content, sizeof(info_content));
+    reply_add_bulk_string(reply, info_content, info_len);
+    return;
+  }
+
+  if (resp_arg_equals(info_type, "replication")) {
     // Create a temporary buffer for the info content
     char info_content[512];
     size_t info_len = 0;
@@ -181,21 +410,24 @@ size_t handle_info(char* write_buf, size_t buf_size, RESPData *request, RedisSta
                          "master_repl_offset:%lu\r\n", stats->replication.master_repl_offset);
 
     // Format as RESP bulk string
-    return snprintf(write_buf, buf_size, "$%zu\r\n%s\r\n", info_len, info_content);
+    reply_add_bulk_string(reply, info_content, info_len);
   } else {
-    return snprintf(write_buf, buf_size, "-ERR Unknown INFO type\r\n");
+    reply_add_format(reply, "-ERR Unknown INFO type\r\n");
   }
 }
 
-size_t handle_replconf(int connection_fd, char* write_buf, size_t buf_size, RESPData *request, RedisStats *stats) {
-  if (strcmp(request->data.array.elements[1]->data.str, "listening-port") == 0) {
+void handle_replconf(int connection_fd, ReplyBuffer *reply, RESPCommand *request, RedisStats *stats) {
+  RESPArg *subcommand = &request->argv[1];
+  if (resp_arg_equals(subcommand, "listening-port")) {
     // TODO: Handle listening-port later
-    return snprintf(write_buf, buf_size, "+OK\r\n");
-  } else if (strcmp(request->data.array.elements[1]->data.str, "capa") == 0) {
+    reply_add_shared(reply, &shared.ok);
+    return;
+  } else if (resp_arg_equals(subcommand, "capa")) {
     // TODO: Handle capa later
-    return snprintf(write_buf, buf_size, "+OK\r\n");
-  } else if (strcmp(request->data.array.elements[1]->data.str, "GETACK") == 0) {
-    if (strcmp(request->data.array.elements[2]->data.str, "*") == 0) {
+    reply_add_shared(reply, &shared.ok);
+    return;
+  } else if (resp_arg_equals(subcommand, "GETACK")) {
+    if (resp_arg_equals(&request->argv[2], "*")) {
       // Create a string array with REPLCONF ACK and the bytes read
       char bytes_read_str[20]; // Buffer to hold the string representation
       snprintf(bytes_read_str, sizeof(bytes_read_str), "%zu", stats->replication.bytes_read->bytes_read);
@@ -206,18 +438,23 @@ size_t handle_replconf(int connection_fd, char* write_buf, size_t buf_size, RESP
         bytes_read_str
       };
 
-      // Convert to RESP array and write to write_buffer
-      size_t resp_length = convert_to_resp_array(write_buf, buf_size, 3, ack_array);
+      // Convert to RESP array and add it to the reply
+      char ack_buf[128];
+      size_t resp_length = convert_to_resp_array(ack_buf, sizeof(ack_buf), 3, ack_array);
+      reply_add_raw(reply, ack_buf, resp_length);
       printf("Slave offset when recieving ACK: %lu", stats->replication.bytes_read->bytes_read);
       
       if (stats->replication.bytes_read->is_reading == 0) {
         stats->replication.bytes_read->is_reading = 1;
       }
       
-      return resp_length;
+      return;
     } 
-  } else if (strcmp(request->data.array.elements[1]->data.str, "ACK") == 0) {
-    uint64_t ack_offset = strtoul(request->data.array.elements[2]->data.str, NULL, 10);
+  } else if (resp_arg_equals(subcommand, "ACK")) {
+    unsigned long ack_offset;
+    if (resp_arg_to_ul(&request->argv[2], &ack_offset) != 0) {
+      return;
+    }
 
     // Update the last acknowledged offset for the replica
     Node *current_node = stats->others.connected_slaves->head;
@@ -225,75 +462,81 @@ size_t handle_replconf(int connection_fd, char* write_buf, size_t buf_size, RESP
       ReplicaInfo *replica = (ReplicaInfo *)(current_node->data);
       if (replica->connection_fd == connection_fd) {
         replica->last_ack_offset = ack_offset;
+        stats->others.replicas_acked = 1;
         break;
       }
       current_node = current_node->next;
     }
 
-    return 0;
+    return;
     }
   
-  return snprintf(write_buf, buf_size, "-ERR Unknown REPLCONF command\r\n");
+  reply_add_format(reply, "-ERR Unknown REPLCONF command\r\n");
 }
 
-size_t handle_wait(int connection_fd, char* write_buf, size_t buf_size, RESPData *request, RedisStats *stats) {
+void handle_wait(int connection_fd, ReplyBuffer *reply, RESPCommand *request, RedisStats *stats) {
   if (stats->replication.role == ROLE_SLAVE) {
-    return snprintf(write_buf, buf_size, "-ERR WAIT not supported in slave mode\r\n");
+    reply_add_format(reply, "-ERR WAIT not supported in slave mode\r\n");
+    return;
   }
 
   if (stats->others.connected_slaves->len == 0) {
-    return snprintf(write_buf, buf_size, ":0\r\n");
+    reply_add_shared(reply, &shared.czero);
+    return;
   }
 
-  uint64_t num_slaves = atol(request->data.array.elements[1]->data.str);
-  uint64_t expiry = atol(request->data.array.elements[2]->data.str) + get_current_epoch_ms();
+  long long num_slaves, timeout_ms;
+  if (resp_arg_to_ll(&request->argv[1], &num_slaves) != 0 ||
+      resp_arg_to_ll(&request->argv[2], &timeout_ms) != 0) {
+    reply_add_shared(reply, &shared.notinteger);
+    return;
+  }
+  if (timeout_ms < 0) {
+    reply_add_format(reply, "-ERR timeout is negative\r\n");
+    return;
+  }
 
   if (stats->replication.role == ROLE_MASTER) {
     Node *current_node = stats->others.connected_slaves->head;
     // Check if enough replicas have already acknowledged the offset
     uint64_t replica_ok_count = check_replica_acknowledgments(stats, stats->server.offset);
     
-    if (replica_ok_count >= num_slaves) {
-      respond_to_waiting_client(connection_fd, replica_ok_count);
-      return 0;
+    if ((long long)replica_ok_count >= num_slaves) {
+      reply_add_integer(reply, replica_ok_count);
+      return;
     }
 
+    static const char getack[] = "*3\r\n$8\r\nREPLCONF\r\n$6\r\nGETACK\r\n$1\r\n*\r\n";
     while (current_node != NULL) {
       ReplicaInfo *replica = (ReplicaInfo *)(current_node->data);
-      say(replica->connection_fd, "*3\r\n$8\r\nREPLCONF\r\n$6\r\nGETACK\r\n$1\r\n*\r\n");
+      client_queue_output(replica->connection_fd, getack, sizeof(getack) - 1);
       current_node = current_node->next;
     }
 
-    // Add the client as waiting
-    WaitingClientInfo *waiting_client = create_waiting_client_info(connection_fd, stats->replication.master_repl_offset, num_slaves, expiry);
-    if (waiting_client == NULL) {
-      exit_with_error("Failed to allocate memory for WaitingClientInfo");
-    }
-    if (add_to_list_tail(stats->others.waiting_clients, waiting_client) == NULL) {
-      free(waiting_client);
-      exit_with_error("Failed to add waiting client to list");
+    // Answered by the ACKs, or by the timer once the timeout runs out
+    if (replication_add_waiting_client(stats, connection_fd, stats->server.offset, num_slaves,
+                                       timeout_ms) != 0) {
+      exit_with_error("Failed to add waiting client");
     }
-
-    return 0;
   }
 }
 
 
-size_t handle_type(char* write_buf, size_t buf_size, RESPData *request, ht_table *ht) {
-  const char *key = request->data.array.elements[1]->data.str;
-  const char *value = ht_get(ht, key);
+void handle_type(ReplyBuffer *reply, RESPCommand *request, ht_table *ht) {
+  RESPArg *key = &request->argv[1];
+  sds value = ht_get(ht, key->ptr, key->len);
 
   if (value == NULL) {
-    return snprintf(write_buf, buf_size, "+none\r\n");
+    reply_add_shared(reply, &shared.none);
   } else {
     // Assuming all values are strings for now
-    return snprintf(write_buf, buf_size, "+string\r\n");
+    reply_add_shared(reply, &shared.string);
   }
 }
 
-void handle_psync(int connection_fd, RESPData *request, RedisStats *stats) {
+void handle_psync(int connection_fd, ReplyBuffer *reply, RESPCommand *request, RedisStats *stats) {
   if (stats->replication.role == ROLE_SLAVE) {
-    say(connection_fd, "-ERR PSYNC not supported in slave mode\r\n");
+    reply_add_format(reply, "-ERR PSYNC not supported in slave mode\r\n");
     return;
   }
 
@@ -304,10 +547,13 @@ void handle_psync(int connection_fd, RESPData *request, RedisStats *stats) {
 
   // Send the response to the client
   char *resp = convert_to_resp_string(buffer);
-  say(connection_fd, resp);
+  reply_add_raw(reply, resp, strlen(resp));
   free(resp);
 
-  send_rdb_file_to_slave(connection_fd, stats);
+  send_rdb_file_to_slave(reply, stats);
+
+  // The new replica starts out on db 0, make sure the next write says where it goes
+  stats->replication.replicas_selected_db = -1;
 
   // Create a ReplicaInfo struct to store the connection fd and last acknowledged offset
   ReplicaInfo* replica = create_replica_info(connection_fd);
@@ -326,174 +572,630 @@ void handle_psync(int connection_fd, RESPData *request, RedisStats *stats) {
 
 // ----------------- Command processing functions ----------------------------
 // ---------------------------------------------------------------------
-void process_commands_in_buffer(int connection_fd, ht_table *ht, RedisStats *stats, 
-                              char *buf, int bytes_read) {
-  char *current_pos = buf;
-  char *end_pos = buf + bytes_read;
-  
+// For errors found before the command runs. They too have to wait for the
+// replies of commands still out on other shards.
+static void add_command_error(Client *c, const char *err) {
+  if (c->shard_calls == NULL) {
+    reply_add_raw(client_reply(c), err, strlen(err));
+    return;
+  }
+  char buf[128];
+  ReplyBuffer reply;
+  reply_init(&reply, buf, sizeof(buf));
+  reply_add_raw(&reply, err, strlen(err));
+  shard_queue_reply(c, &reply);
+  reply_free(&reply);
+}
+
+// Answer input that broke the protocol, after the replies to the commands
+// before it, and hang up. Our master is just dropped.
+static void reject_protocol_error(Client *c) {
+  if (c->flags & CLIENT_MASTER) {
+    c->flags |= CLIENT_CLOSE_ASAP;
+    return;
+  }
+  char err[128];
+  snprintf(err, sizeof(err), "-ERR Protocol error: %s\r\n", c->parser.error);
+  add_command_error(c, err);
+  c->flags |= CLIENT_CLOSE_AFTER_REPLY;
+}
+
+// Split the unparsed part of c's query buffer into complete commands and
+// queue them on c. A command cut short by the end of the buffer is left
+// for when more bytes arrive. Touches nothing but the client, so it is
+// safe to run on an I/O thread. A client held back by its shard calls is
+// parsed once it is let go, see execute_parsed_commands.
+void parse_commands_in_buffer(Client *c) {
+  if ((c->flags & CLIENT_SHARD_WAIT) || c->parser.error != NULL)
+    return;
+  if (c->qb_parsed < c->qb_pos)
+    c->qb_parsed = c->qb_pos;
+
+  char *current_pos = c->querybuf + c->qb_parsed;
+  char *end_pos = c->querybuf + sdslen(c->querybuf);
+
   while (current_pos < end_pos) {
-    // Check if we have enough data to determine command type
-    if (current_pos >= end_pos - 1) {
-      printf("Reached end of buffer\n");
+    // Picks up where the previous read left the command, if it did
+    size_t arg_index = c->args.count - c->parser.argc;
+    long consumed = resp_parse_command(&c->parser, current_pos, end_pos, &c->args);
+    if (consumed == RESP_PARSE_INCOMPLETE || consumed == RESP_PARSE_ERROR) {
+      // Either the rest is yet to come, or the error is answered once the
+      // commands before it have run
       break;
     }
-
-    // Check command type marker ($ or *)
-    char cmd_type = *current_pos;
-    if (cmd_type != '$' && cmd_type != '*') {
+    if (consumed > 0 && c->args.count == arg_index && *current_pos != '*') {
+      // A blank inline line, there's nothing to run
+      current_pos += consumed;
+      continue;
+    }
+    if (consumed == RESP_PARSE_OOM ||
+        client_queue_command(c, arg_index, c->args.count - arg_index,
+                             current_pos - c->querybuf, consumed) != 0) {
+      c->flags |= CLIENT_CLOSE_ASAP;
       break;
     }
+    current_pos += consumed;
+  }
 
-    // Try to find the end of this command
-    char *command_end = NULL;
-    if (cmd_type == '$') {
-      // For bulk string, first find length
-      char *length_end = strstr(current_pos, "\r\n");
-      if (!length_end) {
-        printf("Incomplete bulk string command\n");
-        break;
-      }
-      
-      long length = strtol(current_pos + 1, NULL, 10);
-      if (length < 0) {
-        // Skip null bulk string
-        current_pos = length_end + 2;
-        continue;
-      }
-      
-      if (length_end + 2 + length + 2 > end_pos) {
-        printf("Incomplete bulk string data\n");
-        break;
-      }
-      
-      command_end = length_end + 2 + length + 2; // Skip length, \r\n, data, and final \r\n
-    } else {
-      // For arrays, we need to parse the entire structure
-      char *raw_buffer = current_pos;
-      RESPData *parsed_buffer = parse_resp_buffer(&raw_buffer);
-      
-      if (parsed_buffer != NULL) {
-        if (stats->replication.role == ROLE_SLAVE && stats->replication.bytes_read->is_reading == 1) {
-          stats->replication.bytes_read->bytes_read += (raw_buffer - current_pos);
-        }
-
-        process_command(connection_fd, parsed_buffer, current_pos, ht, stats);
-        free_resp_data(parsed_buffer);
-        free(parsed_buffer);
-        
-        command_end = raw_buffer;
-      } else {
-        // Failed to parse array, try to find next command
-        printf("Failed to parse array command\n");
-        break;
-      }
+  c->qb_parsed = current_pos - c->querybuf;
+}
+
+// Run the commands parse_commands_in_buffer queued on c, in order. Main
+// thread only. A client with too many commands out on other shards is held
+// back until some of their replies are in. The commands it still had are
+// dropped, to be parsed again from the query buffer once it is let go:
+// their arguments point into a buffer that more reads may move meanwhile.
+// A protocol error is answered once everything before it has run.
+void execute_parsed_commands(Client *c, Keyspace *keyspace, RedisStats *stats) {
+  size_t i = 0;
+  while (i < c->command_count && !(c->flags & CLIENT_SHARD_WAIT)) {
+    ParsedCommand *command = &c->commands[i++];
+    if (stats->replication.role == ROLE_SLAVE && stats->replication.bytes_read->is_reading == 1) {
+      stats->replication.bytes_read->bytes_read += command->len;
     }
 
-    // Move to the next command
-    if (command_end) {
-      current_pos = command_end;
-    } else {
-      break;
+    RESPCommand request = {c->args.args + command->arg_index, command->argc};
+    process_command(c, &request, c->querybuf + command->offset, command->len, keyspace,
+                    stats);
+  }
+
+  if (i < c->command_count) {
+    // Whatever was parsed past them goes too
+    c->qb_parsed = c->commands[i].offset;
+    resp_parser_init(&c->parser);
+    c->args.count = 0;
+  } else {
+    // Only the arguments of a command cut short are left, at the front
+    size_t partial = c->parser.argc;
+    if (c->args.count > partial) {
+      memmove(c->args.args, c->args.args + c->args.count - partial, partial * sizeof(RESPArg));
+      c->args.count = partial;
     }
+    if (c->parser.error != NULL && !(c->flags & CLIENT_CLOSE_AFTER_REPLY))
+      reject_protocol_error(c);
+  }
+  c->qb_pos = c->qb_parsed;
+  c->command_count = 0;
+}
+
+// Execute every complete command past qb_pos
+void process_commands_in_buffer(Client *c, Keyspace *keyspace, RedisStats *stats) {
+  parse_commands_in_buffer(c);
+  execute_parsed_commands(c, keyspace, stats);
+}
+
+// Tell the replicas to switch to db_index before the next propagated write
+static void propagate_select(RedisStats *stats, int db_index) {
+  char select_cmd[64];
+  char index_str[16];
+  int index_len = snprintf(index_str, sizeof(index_str), "%d", db_index);
+  int select_len = snprintf(select_cmd, sizeof(select_cmd),
+                            "*2\r\n$6\r\nSELECT\r\n$%d\r\n%s\r\n", index_len, index_str);
+
+  stats->server.offset += select_len;
+  Node *current_node = stats->others.connected_slaves->head;
+  while (current_node != NULL) {
+    ReplicaInfo *replica = (ReplicaInfo *)(current_node->data);
+    client_queue_output(replica->connection_fd, select_cmd, select_len);
+    stats->replication.master_repl_offset += select_len;
+    current_node = current_node->next;
   }
+  stats->replication.replicas_selected_db = db_index;
 }
 
 // ----------------- Main command processor ----------------------------
 // ---------------------------------------------------------------------
-void process_command(int connection_fd, RESPData *parsed_request,
-                     char *raw_buffer, ht_table *ht, RedisStats *stats) {
-  if (parsed_request == NULL || parsed_request->type != RESP_ARRAY ||
-      parsed_request->data.array.count == 0) {
-    say(connection_fd, "-ERR Invalid request\r\n");
-    return;
-  }
-
-  const char *cmd_str = parsed_request->data.array.elements[0]->data.str;
-  CommandInfo cmd = get_command_info(cmd_str);
-  CommandType cmd_type = cmd.type;
-
-  if (cmd_type == CMD_UNKNOWN) {
-    say(connection_fd, "-ERR unknown command\r\n");
-    return;
-  }
-
-  if (!validate_command_args(cmd_type, parsed_request->data.array.count)) {
-    say(connection_fd, "-ERR wrong number of arguments\r\n");
-    return;
-  }
-
-  // Use a single pre-allocated buffer for all handlers
-  char write_buf[4096];  // Increased size to handle larger responses
-  size_t response_len = 0;
-  // Call the appropriate command handler and get the response in the buffer
-  switch (cmd_type) {
-  case CMD_PING:
-    response_len = handle_ping(write_buf, sizeof(write_buf));
-    break;
-  case CMD_ECHO:
-    response_len = handle_echo(write_buf, sizeof(write_buf), parsed_request);
-    break;
-  case CMD_SET:
-    response_len = handle_set(write_buf, sizeof(write_buf), parsed_request, ht);
-    break;
-  case CMD_GET:
-    response_len = handle_get(write_buf, sizeof(write_buf), parsed_request, ht);
-    break;
-  case CMD_DEL:
-    response_len = handle_del(write_buf, sizeof(write_buf), parsed_request, ht);
-    break;
-  case CMD_CONFIG:
-    response_len = handle_config(write_buf, sizeof(write_buf), parsed_request, stats);
-    break;
-  case CMD_KEYS:
-    response_len = handle_keys(write_buf, sizeof(write_buf), parsed_request, ht);
-    break;
-  case CMD_INFO:
-    response_len = handle_info(write_buf, sizeof(write_buf), parsed_request, stats);
-    break;
-  case CMD_REPLCONF:
-    response_len = handle_replconf(connection_fd, write_buf, sizeof(write_buf), parsed_request, stats);
-    break;
-  case CMD_PSYNC:
-    handle_psync(connection_fd, parsed_request, stats);
-    break;
-  case CMD_WAIT:
-    response_len = handle_wait(connection_fd, write_buf, sizeof(write_buf), parsed_request, stats);
-    break;
-  case CMD_TYPE:
-    response_len = handle_type(write_buf, sizeof(write_buf), parsed_request, ht);
-    break;
-  default:
-    snprintf(write_buf, sizeof(write_buf), "-ERR unknown command\r\n");
-    response_len = strlen(write_buf);
-  }
-
-  if (response_len > 0) {
-    if (stats->replication.role == ROLE_SLAVE) {
-      // If the command is not a replication command,
-      if (connection_fd != stats->replication.master_fd) {
-        say(connection_fd, write_buf);
-      } else if (connection_fd == stats->replication.master_fd && cmd.should_respond_to_master) {
-        say(connection_fd, write_buf);
+// EXPIRE and PEXPIRE, unit_ms is how many milliseconds one unit of the
+// argument is worth
+void handle_expire(ReplyBuffer *reply, RESPCommand *request, ht_table *ht, long long unit_ms) {
+  RESPArg *key = &request->argv[1];
+  long long ttl;
+
+  if (resp_arg_to_ll(&request->argv[2], &ttl) != 0 ||
+      ttl > LLONG_MAX / unit_ms || ttl < LLONG_MIN / unit_ms) {
+    reply_add_shared(reply, &shared.notinteger);
+    return;
+  }
+
+  // A TTL that is already in the past deletes the key right away
+  ttl *= unit_ms;
+  int found = ttl <= 0 ? ht_del(ht, key->ptr, key->len)
+                       : ht_set_expiry(ht, key->ptr, key->len, get_current_epoch_ms() + ttl, NULL);
+  reply_add_shared(reply, found ? &shared.cone : &shared.czero);
+}
+
+// TTL and PTTL, -2 if the key doesn't exist and -1 if it has no expiry
+void handle_ttl(ReplyBuffer *reply, RESPCommand *request, ht_table *ht, bool in_ms) {
+  uint64_t expiry;
+  if (!ht_get_expiry(ht, request->argv[1].ptr, request->argv[1].len, &expiry)) {
+    reply_add_shared(reply, &shared.cnegtwo);
+    return;
+  }
+  if (expiry == 0) {
+    reply_add_shared(reply, &shared.cnegone);
+    return;
+  }
+
+  uint64_t now = get_current_epoch_ms();
+  uint64_t remaining = expiry > now ? expiry - now : 0;
+  if (!in_ms) {
+    remaining = (remaining + 500) / 1000;
+  }
+  reply_add_integer(reply, remaining);
+}
+
+void handle_persist(ReplyBuffer *reply, RESPCommand *request, ht_table *ht) {
+  RESPArg *key = &request->argv[1];
+  uint64_t previous;
+
+  if (!ht_set_expiry(ht, key->ptr, key->len, 0, &previous) || previous == 0) {
+    reply_add_shared(reply, &shared.czero);
+    return;
+  }
+  reply_add_shared(reply, &shared.cone);
+}
+
+// Parse a database index argument, returns -1 if it isn't a valid one
+static int parse_db_index(const RESPArg *arg) {
+  long long index;
+  if (resp_arg_to_ll(arg, &index) != 0 || index < 0 || index >= KEYSPACE_DB_COUNT) {
+    return -1;
+  }
+  return (int)index;
+}
+
+void handle_select(Client *c, ReplyBuffer *reply, RESPCommand *request) {
+  int index = parse_db_index(&request->argv[1]);
+  if (index < 0) {
+    reply_add_shared(reply, &shared.outofrangedb);
+    return;
+  }
+  c->db = index;
+  reply_add_shared(reply, &shared.ok);
+}
+
+void handle_swapdb(ReplyBuffer *reply, RESPCommand *request, Keyspace *keyspace) {
+  int a = parse_db_index(&request->argv[1]);
+  int b = parse_db_index(&request->argv[2]);
+  if (a < 0 || b < 0) {
+    reply_add_shared(reply, &shared.outofrangedb);
+    return;
+  }
+  keyspace_swap_db(keyspace, a, b);
+  reply_add_shared(reply, &shared.ok);
+}
+
+// FLUSHDB on db_index, or FLUSHALL when db_index is -1. ASYNC and SYNC are
+// accepted for compatibility, the tables are always freed right away.
+void handle_flush(ReplyBuffer *reply, RESPCommand *request, Keyspace *keyspace, int db_index) {
+  if (request->argc > 2 ||
+      (request->argc == 2 && !resp_arg_equals(&request->argv[1], "ASYNC") &&
+       !resp_arg_equals(&request->argv[1], "SYNC"))) {
+    reply_add_shared(reply, &shared.syntaxerr);
+    return;
+  }
+
+  int result = db_index < 0 ? keyspace_flush_all(keyspace)
+                            : keyspace_flush_db(keyspace, db_index);
+  if (result != 0) {
+    reply_add_format(reply, "-ERR failed to flush\r\n");
+    return;
+  }
+  reply_add_shared(reply, &shared.ok);
+}
+
+// Keys collected by a SCAN call, after the MATCH and TYPE filters
+typedef struct {
+  KeyPattern *pattern;
+  bool type_matches;
+  sds *keys;
+  size_t count;
+  size_t capacity;
+} ScanResult;
+
+static void scan_collect_key(void *privdata, const sds key, const sds value) {
+  (void)value;
+  ScanResult *result = privdata;
+
+  if (!result->type_matches || !key_pattern_match(result->pattern, key)) {
+    return;
+  }
+
+  if (result->count == result->capacity) {
+    size_t capacity = result->capacity ? result->capacity * 2 : 16;
+    sds *keys = realloc(result->keys, capacity * sizeof(sds));
+    if (keys == NULL) {
+      return;
+    }
+    result->keys = keys;
+    result->capacity = capacity;
+  }
+  result->keys[result->count++] = key;
+}
+
+// SCAN cursor [MATCH pattern] [COUNT count] [TYPE type]
+void handle_scan(ReplyBuffer *reply, RESPCommand *request, ht_table *ht) {
+  RESPArg *args = request->argv;
+  size_t argc = request->argc;
+  KeyPattern pattern;
+  long long count = 10;
+  bool type_matches = true;
+
+  unsigned long cursor;
+  if (resp_arg_to_ul(&args[1], &cursor) != 0) {
+    reply_add_format(reply, "-ERR invalid cursor\r\n");
+    return;
+  }
+
+  key_pattern_init(&pattern, NULL);
+  for (size_t i = 2; i < argc; i += 2) {
+    if (i + 1 >= argc) {
+      reply_add_shared(reply, &shared.syntaxerr);
+      return;
+    }
+    RESPArg *option = &args[i];
+    if (resp_arg_equals(option, "MATCH")) {
+      key_pattern_init(&pattern, &args[i + 1]);
+    } else if (resp_arg_equals(option, "COUNT")) {
+      if (resp_arg_to_ll(&args[i + 1], &count) != 0) {
+        reply_add_shared(reply, &shared.notinteger);
+        return;
+      }
+      if (count < 1) {
+        reply_add_shared(reply, &shared.syntaxerr);
+        return;
       }
+    } else if (resp_arg_equals(option, "TYPE")) {
+      // Strings are the only type there is so far
+      type_matches = resp_arg_equals(&args[i + 1], "string");
     } else {
-      // If the command is not a replication command, send the response to the client
-      say(connection_fd, write_buf);
+      reply_add_shared(reply, &shared.syntaxerr);
+      return;
     }
   }
 
+  // COUNT is only a hint of how much work to do. Keep going until that
+  // many keys were found, giving up after 10 groups per key asked for so a
+  // sparse table or a picky filter can't stall the loop.
+  ScanResult result = {&pattern, type_matches, NULL, 0, 0};
+  long long max_steps = count > LLONG_MAX / 10 ? LLONG_MAX : count * 10;
+  do {
+    cursor = ht_scan(ht, cursor, scan_collect_key, &result);
+  } while (cursor != 0 && --max_steps > 0 && result.count < (size_t)count);
+
+  char cursor_str[32];
+  int cursor_len = snprintf(cursor_str, sizeof(cursor_str), "%lu", cursor);
+  reply_add_array_len(reply, 2);
+  reply_add_bulk_string(reply, cursor_str, cursor_len);
+  reply_add_array_len(reply, result.count);
+  for (size_t i = 0; i < result.count; i++) {
+    reply_add_bulk_string(reply, result.keys[i], sdslen(result.keys[i]));
+  }
+  free(result.keys);
+}
+
+// ----------------- Command table -------------------------------------
+// ---------------------------------------------------------------------
+// Adapters from the table's one signature to the handlers
+static void ping_command(CommandContext *ctx) { handle_ping(ctx->reply); }
+static void echo_command(CommandContext *ctx) { handle_echo(ctx->reply, ctx->request); }
+
+static void set_command(CommandContext *ctx) {
+  handle_set(ctx->reply, ctx->request, ctx->keyspace->db[ctx->db]);
+}
+
+static void get_command(CommandContext *ctx) {
+  handle_get(ctx->reply, ctx->request, ctx->keyspace->db[ctx->db]);
+}
+
+static void del_command(CommandContext *ctx) {
+  handle_del(ctx->reply, ctx->request, ctx->keyspace->db[ctx->db]);
+}
+
+static void config_command(CommandContext *ctx) {
+  handle_config(ctx->reply, ctx->request, ctx->stats);
+}
+
+static void keys_command(CommandContext *ctx) {
+  handle_keys(ctx->reply, ctx->request, ctx->keyspace->db[ctx->db]);
+}
+
+static void info_command(CommandContext *ctx) {
+  handle_info(ctx->reply, ctx->request, ctx->keyspace, ctx->stats);
+}
+
+static void replconf_command(CommandContext *ctx) {
+  handle_replconf(ctx->connection_fd, ctx->reply, ctx->request, ctx->stats);
+}
+
+static void psync_command(CommandContext *ctx) {
+  handle_psync(ctx->connection_fd, ctx->reply, ctx->request, ctx->stats);
+  if (ctx->stats->replication.role == ROLE_MASTER)
+    ctx->c->flags |= CLIENT_REPLICA;
+}
+
+static void wait_command(CommandContext *ctx) {
+  handle_wait(ctx->connection_fd, ctx->reply, ctx->request, ctx->stats);
+}
+
+static void type_command(CommandContext *ctx) {
+  handle_type(ctx->reply, ctx->request, ctx->keyspace->db[ctx->db]);
+}
+
+static void expire_command(CommandContext *ctx) {
+  handle_expire(ctx->reply, ctx->request, ctx->keyspace->db[ctx->db], 1000);
+}
+
+static void pexpire_command(CommandContext *ctx) {
+  handle_expire(ctx->reply, ctx->request, ctx->keyspace->db[ctx->db], 1);
+}
+
+static void ttl_command(CommandContext *ctx) {
+  handle_ttl(ctx->reply, ctx->request, ctx->keyspace->db[ctx->db], false);
+}
+
+static void pttl_command(CommandContext *ctx) {
+  handle_ttl(ctx->reply, ctx->request, ctx->keyspace->db[ctx->db], true);
+}
+
+static void persist_command(CommandContext *ctx) {
+  handle_persist(ctx->reply, ctx->request, ctx->keyspace->db[ctx->db]);
+}
+
+static void select_command(CommandContext *ctx) {
+  handle_select(ctx->c, ctx->reply, ctx->request);
+}
+
+static void swapdb_command(CommandContext *ctx) {
+  handle_swapdb(ctx->reply, ctx->request, ctx->keyspace);
+}
+
+static void flushdb_command(CommandContext *ctx) {
+  handle_flush(ctx->reply, ctx->request, ctx->keyspace, ctx->db);
+}
+
+static void flushall_command(CommandContext *ctx) {
+  handle_flush(ctx->reply, ctx->request, ctx->keyspace, -1);
+}
+
+static void scan_command(CommandContext *ctx) {
+  handle_scan(ctx->reply, ctx->request, ctx->keyspace->db[ctx->db]);
+}
+
+static const CommandInfo COMMANDS[CMD_COUNT] = {
+    [CMD_PING] = {CMD_PING, "PING", ping_command, 1, 1, 0, SHARD_ROUTE_LOCAL},
+    [CMD_ECHO] = {CMD_ECHO, "ECHO", echo_command, 2, 2, 0, SHARD_ROUTE_LOCAL},
+    [CMD_SET] = {CMD_SET, "SET", set_command, 3, 5, CMD_FLAG_WRITE, SHARD_ROUTE_KEY},
+    [CMD_GET] = {CMD_GET, "GET", get_command, 2, 2, CMD_FLAG_READONLY, SHARD_ROUTE_KEY},
+    [CMD_DEL] = {CMD_DEL, "DEL", del_command, 2, 2, CMD_FLAG_WRITE, SHARD_ROUTE_KEY},
+    [CMD_CONFIG] = {CMD_CONFIG, "CONFIG", config_command, 3, 3, 0, SHARD_ROUTE_LOCAL},
+    [CMD_KEYS] = {CMD_KEYS, "KEYS", keys_command, 2, 2, CMD_FLAG_READONLY, SHARD_ROUTE_GATHER},
+    [CMD_INFO] = {CMD_INFO, "INFO", info_command, 2, 2, CMD_FLAG_REPLY_TO_MASTER,
+                  SHARD_ROUTE_LOCAL},
+    [CMD_REPLCONF] = {CMD_REPLCONF, "REPLCONF", replconf_command, 3, 10,
+                      CMD_FLAG_REPLY_TO_MASTER, SHARD_ROUTE_NONE},
+    [CMD_PSYNC] = {CMD_PSYNC, "PSYNC", psync_command, 3, 3, 0, SHARD_ROUTE_NONE},
+    [CMD_WAIT] = {CMD_WAIT, "WAIT", wait_command, 3, 3, 0, SHARD_ROUTE_NONE},
+    [CMD_TYPE] = {CMD_TYPE, "TYPE", type_command, 2, 2, CMD_FLAG_READONLY, SHARD_ROUTE_KEY},
+    [CMD_EXPIRE] = {CMD_EXPIRE, "EXPIRE", expire_command, 3, 3, CMD_FLAG_WRITE,
+                    SHARD_ROUTE_KEY},
+    [CMD_PEXPIRE] = {CMD_PEXPIRE, "PEXPIRE", pexpire_command, 3, 3, CMD_FLAG_WRITE,
+                     SHARD_ROUTE_KEY},
+    [CMD_TTL] = {CMD_TTL, "TTL", ttl_command, 2, 2, CMD_FLAG_READONLY, SHARD_ROUTE_KEY},
+    [CMD_PTTL] = {CMD_PTTL, "PTTL", pttl_command, 2, 2, CMD_FLAG_READONLY, SHARD_ROUTE_KEY},
+    [CMD_PERSIST] = {CMD_PERSIST, "PERSIST", persist_command, 2, 2, CMD_FLAG_WRITE,
+                     SHARD_ROUTE_KEY},
+    // SELECT is propagated on its own, ahead of the first write to a new db
+    [CMD_SELECT] = {CMD_SELECT, "SELECT", select_command, 2, 2, 0, SHARD_ROUTE_LOCAL},
+    [CMD_SWAPDB] = {CMD_SWAPDB, "SWAPDB", swapdb_command, 3, 3,
+                    CMD_FLAG_WRITE | CMD_FLAG_ALL_DBS, SHARD_ROUTE_ALL},
+    [CMD_FLUSHDB] = {CMD_FLUSHDB, "FLUSHDB", flushdb_command, 1, 2, CMD_FLAG_WRITE,
+                     SHARD_ROUTE_ALL},
+    [CMD_FLUSHALL] = {CMD_FLUSHALL, "FLUSHALL", flushall_command, 1, 2,
+                      CMD_FLAG_WRITE | CMD_FLAG_ALL_DBS, SHARD_ROUTE_ALL},
+    [CMD_SCAN] = {CMD_SCAN, "SCAN", scan_command, 2, 8, CMD_FLAG_READONLY, SHARD_ROUTE_SCAN},
+};
+
+// Names are looked up in a table where each has a slot of its own, so a
+// lookup is one hash and one compare however many commands there are.
+// commands_init picks a seed that spreads the names that way.
+#define COMMAND_TABLE_SIZE 128
+#define COMMAND_SEED_TRIES (1 << 20)
+
+static const CommandInfo *command_table[COMMAND_TABLE_SIZE];
+static uint32_t command_seed;
+
+// FNV-1a over the name with ASCII letters folded to lower case, which is
+// all case-insensitive matching needs; the compare after it does the rest
+static uint32_t command_hash(const char *name, size_t len, uint32_t seed) {
+  uint32_t h = 2166136261u ^ seed;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)name[i] | 0x20;
+    h *= 16777619u;
+  }
+  return h ^ (h >> 16);
+}
+
+// Returns -1 if no seed gives every command its own slot, time for a
+// bigger table
+int commands_init() {
+  _Static_assert((COMMAND_TABLE_SIZE & (COMMAND_TABLE_SIZE - 1)) == 0,
+                 "COMMAND_TABLE_SIZE must be a power of two");
+  for (uint32_t seed = 0; seed < COMMAND_SEED_TRIES; seed++) {
+    memset(command_table, 0, sizeof(command_table));
+    int collided = 0;
+    for (int i = 0; i < CMD_COUNT && !collided; i++) {
+      const CommandInfo *cmd = &COMMANDS[i];
+      uint32_t slot = command_hash(cmd->name, strlen(cmd->name), seed) & (COMMAND_TABLE_SIZE - 1);
+      if (command_table[slot] != NULL)
+        collided = 1;
+      command_table[slot] = cmd;
+    }
+    if (!collided) {
+      command_seed = seed;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static const CommandInfo *lookup_command(const RESPArg *name) {
+  uint32_t slot = command_hash(name->ptr, name->len, command_seed) & (COMMAND_TABLE_SIZE - 1);
+  const CommandInfo *cmd = command_table[slot];
+  if (cmd == NULL || !resp_arg_equals(name, cmd->name))
+    return NULL;
+  return cmd;
+}
+
+// Only the thread the row belongs to writes it, so a plain load and store
+// do, and other threads reading it for INFO still see whole values
+static void command_stat_incr(_Atomic uint64_t *counter) {
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1,
+                        memory_order_relaxed);
+}
+
+// The INFO commandstats section, summed over every thread. Like Redis,
+// only commands that were seen at all are listed.
+static size_t command_stats_info(char *buf, size_t size) {
+  size_t len = snprintf(buf, size, "# Commandstats\r\n");
+  for (int i = 0; i < CMD_COUNT && len < size; i++) {
+    uint64_t calls = 0, rejected_calls = 0;
+    for (int shard = 0; shard < SHARDS_MAX; shard++) {
+      CommandStats *stat = &command_stats[shard].commands[i];
+      calls += atomic_load_explicit(&stat->calls, memory_order_relaxed);
+      rejected_calls += atomic_load_explicit(&stat->rejected_calls, memory_order_relaxed);
+    }
+    if (calls == 0 && rejected_calls == 0)
+      continue;
+
+    char name[16];
+    size_t name_len = 0;
+    for (; COMMANDS[i].name[name_len] != '\0' && name_len < sizeof(name) - 1; name_len++)
+      name[name_len] = COMMANDS[i].name[name_len] | 0x20;
+    name[name_len] = '\0';
+    len += snprintf(buf + len, size - len, "cmdstat_%s:calls=%lu,rejected_calls=%lu\r\n", name,
+                    calls, rejected_calls);
+  }
+  return len < size ? len : size - 1;
+}
+
+void call_command(ReplyBuffer *reply, RESPCommand *request, int db_index, Keyspace *keyspace,
+                  RedisStats *stats) {
+  const CommandInfo *cmd = lookup_command(&request->argv[0]);
+  if (cmd == NULL) {
+    reply_add_shared(reply, &shared.unknowncmd);
+    return;
+  }
+  CommandContext ctx = {NULL, -1, reply, request, db_index, keyspace, stats};
+  cmd->proc(&ctx);
+}
+
+// The request's arguments are views of raw_buffer, they are only good
+// until this returns. A shard that needs them any longer copies them.
+void process_command(Client *c, RESPCommand *parsed_request,
+                     char *raw_buffer, size_t raw_len, Keyspace *keyspace, RedisStats *stats) {
+  if (parsed_request->argc == 0) {
+    add_command_error(c, "-ERR Invalid request\r\n");
+    return;
+  }
+
+  const CommandInfo *cmd = lookup_command(&parsed_request->argv[0]);
+  if (cmd == NULL) {
+    add_command_error(c, "-ERR unknown command\r\n");
+    return;
+  }
+
+  CommandStats *cmd_stats = &command_stats[shard_self()].commands[cmd->type];
+  if (parsed_request->argc < (size_t)cmd->min_args ||
+      parsed_request->argc > (size_t)cmd->max_args) {
+    command_stat_incr(&cmd_stats->rejected_calls);
+    add_command_error(c, "-ERR wrong number of arguments\r\n");
+    return;
+  }
+
+  // With shards, a command may have to run where its keys live
+  if (shard_count() > 1 && cmd->shard_route != SHARD_ROUTE_LOCAL) {
+    if (cmd->shard_route == SHARD_ROUTE_NONE) {
+      command_stat_incr(&cmd_stats->rejected_calls);
+      char err[64];
+      snprintf(err, sizeof(err), "-ERR %s is not available with shards\r\n", cmd->name);
+      add_command_error(c, err);
+      return;
+    }
+    if (cmd->shard_route != SHARD_ROUTE_KEY ||
+        shard_for_key(parsed_request->argv[1].ptr, parsed_request->argv[1].len) !=
+            shard_self()) {
+      command_stat_incr(&cmd_stats->calls);
+      shard_dispatch(c, cmd->shard_route, parsed_request, keyspace, stats);
+      return;
+    }
+  }
+
+  int db_index = c->db;
+
+  // Replies go straight to the client's output buffer. Our master only
+  // hears back for the few commands it expects an answer to.
+  // A reply that has to wait for those of commands out on other shards is
+  // kept aside.
+  char discard_buf[256];
+  ReplyBuffer discard;
+  ReplyBuffer *reply;
+  if (((c->flags & CLIENT_MASTER) && !(cmd->flags & CMD_FLAG_REPLY_TO_MASTER)) ||
+      c->shard_calls != NULL) {
+    reply_init(&discard, discard_buf, sizeof(discard_buf));
+    reply = &discard;
+  } else {
+    reply = client_reply(c);
+  }
+
+  command_stat_incr(&cmd_stats->calls);
+  CommandContext ctx = {c, c->fd, reply, parsed_request, db_index, keyspace, stats};
+  cmd->proc(&ctx);
+
+  if (reply == &discard) {
+    if (c->shard_calls != NULL)
+      shard_queue_reply(c, &discard);
+    reply_free(&discard);
+  }
+
   // Propagate commands to slaves if needed
-  if (cmd.should_send_to_slave && stats->replication.role == ROLE_MASTER) {
+  if ((cmd->flags & CMD_FLAG_WRITE) && stats->replication.role == ROLE_MASTER) {
+    // Replicas apply the stream to whatever db was last selected in it
+    if (!(cmd->flags & CMD_FLAG_ALL_DBS) &&
+        stats->replication.replicas_selected_db != db_index) {
+      propagate_select(stats, db_index);
+    }
+
     // Update the server offset
-    stats->server.offset += strlen(raw_buffer);
+    stats->server.offset += raw_len;
     Node *current_node = stats->others.connected_slaves->head;
 
     while (current_node != NULL) {
       ReplicaInfo *replica = (ReplicaInfo *)(current_node->data);
-      say(replica->connection_fd, raw_buffer);
+      client_queue_output(replica->connection_fd, raw_buffer, raw_len);
       
       // Update the master's replication offset after sending command to replica
-      stats->replication.master_repl_offset += strlen(raw_buffer);
+      stats->replication.master_repl_offset += raw_len;
       
       current_node = current_node->next;
     }
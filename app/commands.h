@@ -1,7 +1,10 @@
 #ifndef COMMANDS_H
 #define COMMANDS_H
 
+#include "client.h"
 #include "hashtable.h"
+#include "keyspace.h"
+#include "reply.h"
 #include "resp.h"
 #include "state.h"
 
@@ -14,9 +17,12 @@ typedef struct {
 
 
 // Command functions
-void process_command(int connection_fd, RESPData* parsed_request, char* raw_buffer, ht_table* ht, RedisStats* stats);
-void process_commands_in_buffer(int connection_fd, ht_table *ht, RedisStats *stats, 
-                              char *buf, int bytes_read);
-void handle_psync(int connection_fd, RESPData *request, RedisStats *stats);
+int commands_init();
+void process_command(Client* c, RESPCommand* parsed_request, char* raw_buffer, size_t raw_len, Keyspace* keyspace, RedisStats* stats);
+void call_command(ReplyBuffer *reply, RESPCommand *request, int db_index, Keyspace *keyspace, RedisStats *stats);
+void parse_commands_in_buffer(Client *c);
+void execute_parsed_commands(Client *c, Keyspace *keyspace, RedisStats *stats);
+void process_commands_in_buffer(Client *c, Keyspace *keyspace, RedisStats *stats);
+void handle_psync(int connection_fd, ReplyBuffer *reply, RESPCommand *request, RedisStats *stats);
 
 #endif // COMMANDS_H
\ No newline at end of file
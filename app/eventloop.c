@@ -0,0 +1,672 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "eventloop.h"
+
+// Submission queue slots, completions get four times as many since every
+// multishot request can post many of them
+#define URING_ENTRIES 4096
+#define URING_BUFFER_GROUP 0
+
+// What a request was for, kept in the low byte of its user_data. The fd is
+// stored above it, and the fd's generation in the top half so completions
+// for a closed fd aren't mistaken for those of the next connection to get
+// the same number.
+typedef enum {
+  URING_ACCEPT = 1,
+  URING_RECV,
+  URING_POLL_IN,
+  URING_POLL_OUT,
+  URING_SEND, // The fd bits hold the index in the write batch instead
+  URING_CANCEL,
+} UringOp;
+
+typedef struct {
+  uint32_t generation;
+  int mask; // As registered, 0 if the fd isn't
+} UringFd;
+
+typedef struct {
+  int fd;
+  unsigned sq_entries;
+  unsigned *sq_head, *sq_tail, *sq_mask;
+  struct io_uring_sqe *sqes;
+  unsigned sq_local_tail; // Filled up to here, the kernel sees it on submit
+  unsigned sq_unsubmitted;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *ring_mem;
+  size_t ring_size;
+  size_t sqes_size;
+
+  // Receive buffers the kernel picks from
+  struct io_uring_buf_ring *buf_ring;
+  char *bufs;
+  uint16_t buf_tail;
+  uint16_t held[EVENT_LOOP_RECV_BUFFERS]; // Handed out until the next wait
+  size_t held_count;
+
+  UringFd *fds;
+  size_t fds_capacity;
+
+  // Completions reaped while waiting for a write batch, for the next wait
+  struct io_uring_cqe *stash;
+  size_t stash_count;
+  size_t stash_head;
+  size_t stash_capacity;
+
+  struct msghdr *msgs;
+  size_t msgs_capacity;
+} Uring;
+
+struct EventLoop {
+  EventLoopBackend backend;
+  int epoll_fd;
+  struct epoll_event *epoll_events;
+  int epoll_events_size;
+  Uring ring;
+};
+
+static EventLoopBackend event_loop_default = EVENT_LOOP_EPOLL;
+
+static const char *event_loop_backend_names[] = {"epoll", "io_uring"};
+
+// --------------------------------------------------------------------------
+// epoll
+
+static uint32_t epoll_mask(int mask) {
+  uint32_t events = EPOLLET;
+  if (mask & EVENT_READABLE)
+    events |= EPOLLIN | EPOLLRDHUP;
+  if (mask & EVENT_WRITABLE)
+    events |= EPOLLOUT;
+  return events;
+}
+
+static int epoll_wait_events(EventLoop *loop, FiredEvent *events, int max, int timeout_ms) {
+  if (max > loop->epoll_events_size) {
+    struct epoll_event *grown = realloc(loop->epoll_events, max * sizeof(struct epoll_event));
+    if (grown == NULL)
+      return -1;
+    loop->epoll_events = grown;
+    loop->epoll_events_size = max;
+  }
+
+  int n = epoll_wait(loop->epoll_fd, loop->epoll_events, max, timeout_ms);
+  if (n < 0)
+    return errno == EINTR ? 0 : -1;
+
+  for (int i = 0; i < n; i++) {
+    uint32_t fired = loop->epoll_events[i].events;
+    events[i] = (FiredEvent){.fd = loop->epoll_events[i].data.fd, .accepted = -1};
+    if (fired & EPOLLIN)
+      events[i].mask |= EVENT_READABLE;
+    if (fired & EPOLLOUT)
+      events[i].mask |= EVENT_WRITABLE;
+    if (fired & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+      events[i].mask |= EVENT_HANGUP;
+  }
+  return n;
+}
+
+// --------------------------------------------------------------------------
+// io_uring, straight on the system calls
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                       void *arg, size_t argsz) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static uint64_t uring_user_data(Uring *ring, UringOp op, int fd) {
+  uint32_t generation = op == URING_SEND ? 0 : ring->fds[fd].generation;
+  return ((uint64_t)generation << 32) | ((uint64_t)fd << 8) | op;
+}
+
+static void uring_recycle_buffer(Uring *ring, uint16_t bid) {
+  struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (EVENT_LOOP_RECV_BUFFERS - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)bid * EVENT_LOOP_RECV_BUFFER_SIZE);
+  buf->len = EVENT_LOOP_RECV_BUFFER_SIZE;
+  buf->bid = bid;
+  ring->buf_tail++;
+}
+
+static void uring_publish_buffers(Uring *ring) {
+  __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+// Hand what was queued to the kernel, and optionally wait for completions.
+// Returns -1 only for errors other than an expired or interrupted wait.
+static int uring_submit(Uring *ring, unsigned min_complete, int timeout_ms) {
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+  struct __kernel_timespec ts = {timeout_ms / 1000, (long long)(timeout_ms % 1000) * 1000000};
+  struct io_uring_getevents_arg arg = {
+      .sigmask = 0,
+      .sigmask_sz = _NSIG / 8,
+      .ts = timeout_ms >= 0 ? (uint64_t)(uintptr_t)&ts : 0,
+  };
+  // Completions are only posted while we are in here, the ring is set up
+  // with deferred task work
+  unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+
+  int submitted = uring_enter(ring->fd, ring->sq_unsubmitted, min_complete, flags, &arg, sizeof(arg));
+  if (submitted < 0) {
+    // A full completion queue can push back, reaping it lets us go on
+    if (errno == ETIME || errno == EINTR || errno == EBUSY || errno == EAGAIN)
+      return 0;
+    return -1;
+  }
+  ring->sq_unsubmitted -= (unsigned)submitted < ring->sq_unsubmitted ? (unsigned)submitted
+                                                                     : ring->sq_unsubmitted;
+  return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->sq_local_tail - head >= ring->sq_entries) {
+    uring_submit(ring, 0, 0);
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries)
+      return NULL;
+  }
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & *ring->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_local_tail++;
+  ring->sq_unsubmitted++;
+  return sqe;
+}
+
+static int uring_arm(Uring *ring, UringOp op, int fd) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (sqe == NULL)
+    return -1;
+
+  sqe->fd = fd;
+  sqe->user_data = uring_user_data(ring, op, fd);
+  switch (op) {
+  case URING_ACCEPT:
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    break;
+  case URING_RECV:
+    sqe->opcode = IORING_OP_RECV;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    break;
+  case URING_POLL_IN:
+  case URING_POLL_OUT:
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = op == URING_POLL_IN ? POLLIN : POLLOUT;
+    break;
+  default:
+    return -1;
+  }
+  return 0;
+}
+
+static void uring_cancel(Uring *ring, UringOp op, int fd) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (sqe == NULL)
+    return;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = uring_user_data(ring, op, fd);
+  sqe->user_data = URING_CANCEL;
+}
+
+// The request that keeps an fd readable
+static UringOp uring_read_op(int mask) {
+  if (mask & EVENT_ACCEPT)
+    return URING_ACCEPT;
+  if (mask & EVENT_DATA)
+    return URING_RECV;
+  return URING_POLL_IN;
+}
+
+static void uring_destroy(Uring *ring) {
+  if (ring->buf_ring != NULL)
+    munmap(ring->buf_ring, EVENT_LOOP_RECV_BUFFERS * sizeof(struct io_uring_buf));
+  free(ring->bufs);
+  if (ring->sqes != NULL)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->ring_mem != NULL)
+    munmap(ring->ring_mem, ring->ring_size);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  free(ring->fds);
+  free(ring->stash);
+  free(ring->msgs);
+}
+
+// Needs 6.1 or later: a single issuer with deferred task work, multishot
+// receive into a provided buffer ring and multishot accept
+static int uring_create(Uring *ring) {
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+                 IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+  params.cq_entries = URING_ENTRIES * 4;
+  ring->fd = uring_setup(URING_ENTRIES, &params);
+  if (ring->fd < 0)
+    return -1;
+
+  unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP;
+  if ((params.features & required) != required) {
+    uring_destroy(ring);
+    return -1;
+  }
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+  ring->ring_mem = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+  if (ring->ring_mem == MAP_FAILED) {
+    ring->ring_mem = NULL;
+    uring_destroy(ring);
+    return -1;
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    uring_destroy(ring);
+    return -1;
+  }
+
+  char *mem = ring->ring_mem;
+  ring->sq_entries = params.sq_entries;
+  ring->sq_head = (unsigned *)(mem + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(mem + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(mem + params.sq_off.ring_mask);
+  unsigned *sq_array = (unsigned *)(mem + params.sq_off.array);
+  for (unsigned i = 0; i < params.sq_entries; i++)
+    sq_array[i] = i;
+  ring->sq_local_tail = *ring->sq_tail;
+  ring->cq_head = (unsigned *)(mem + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(mem + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(mem + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(mem + params.cq_off.cqes);
+
+  ring->buf_ring = mmap(NULL, EVENT_LOOP_RECV_BUFFERS * sizeof(struct io_uring_buf),
+                        PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (ring->buf_ring == MAP_FAILED) {
+    ring->buf_ring = NULL;
+    uring_destroy(ring);
+    return -1;
+  }
+  ring->bufs = malloc((size_t)EVENT_LOOP_RECV_BUFFERS * EVENT_LOOP_RECV_BUFFER_SIZE);
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+  reg.ring_entries = EVENT_LOOP_RECV_BUFFERS;
+  reg.bgid = URING_BUFFER_GROUP;
+  if (ring->bufs == NULL || uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    uring_destroy(ring);
+    return -1;
+  }
+  for (uint16_t bid = 0; bid < EVENT_LOOP_RECV_BUFFERS; bid++)
+    uring_recycle_buffer(ring, bid);
+  uring_publish_buffers(ring);
+  return 0;
+}
+
+static int uring_reserve_fd(Uring *ring, int fd) {
+  if ((size_t)fd < ring->fds_capacity)
+    return 0;
+
+  size_t capacity = ring->fds_capacity ? ring->fds_capacity : 64;
+  while (capacity <= (size_t)fd)
+    capacity *= 2;
+  UringFd *fds = realloc(ring->fds, capacity * sizeof(UringFd));
+  if (fds == NULL)
+    return -1;
+  memset(fds + ring->fds_capacity, 0, (capacity - ring->fds_capacity) * sizeof(UringFd));
+  ring->fds = fds;
+  ring->fds_capacity = capacity;
+  return 0;
+}
+
+static int uring_add(Uring *ring, int fd, int mask) {
+  if (fd < 0 || fd >= (1 << 24) || uring_reserve_fd(ring, fd) != 0)
+    return -1;
+
+  ring->fds[fd].mask = mask;
+  if ((mask & EVENT_READABLE) && uring_arm(ring, uring_read_op(mask), fd) != 0)
+    return -1;
+  if ((mask & EVENT_WRITABLE) && uring_arm(ring, URING_POLL_OUT, fd) != 0)
+    return -1;
+  return 0;
+}
+
+static int uring_modify(Uring *ring, int fd, int mask) {
+  if (fd < 0 || (size_t)fd >= ring->fds_capacity || ring->fds[fd].mask == 0)
+    return -1;
+
+  int old = ring->fds[fd].mask;
+  ring->fds[fd].mask = mask;
+  if ((mask & EVENT_WRITABLE) && !(old & EVENT_WRITABLE))
+    return uring_arm(ring, URING_POLL_OUT, fd);
+  if (!(mask & EVENT_WRITABLE) && (old & EVENT_WRITABLE))
+    uring_cancel(ring, URING_POLL_OUT, fd);
+  return 0;
+}
+
+// Whatever is still armed for the fd goes with the next submit. A
+// completion that slips in before that has an old generation and is dropped.
+static void uring_delete(Uring *ring, int fd) {
+  if (fd < 0 || (size_t)fd >= ring->fds_capacity || ring->fds[fd].mask == 0)
+    return;
+
+  int mask = ring->fds[fd].mask;
+  if (mask & EVENT_READABLE)
+    uring_cancel(ring, uring_read_op(mask), fd);
+  if (mask & EVENT_WRITABLE)
+    uring_cancel(ring, URING_POLL_OUT, fd);
+  ring->fds[fd].mask = 0;
+  ring->fds[fd].generation++;
+}
+
+// Turn one completion into an event. Returns 1 if it made one.
+static int uring_fire(Uring *ring, const struct io_uring_cqe *cqe, FiredEvent *event) {
+  UringOp op = cqe->user_data & 0xff;
+  int fd = (cqe->user_data >> 8) & 0xffffff;
+  uint32_t generation = cqe->user_data >> 32;
+  int more = cqe->flags & IORING_CQE_F_MORE;
+
+  if (op == URING_CANCEL || op == URING_SEND)
+    return 0;
+
+  int current = (size_t)fd < ring->fds_capacity && ring->fds[fd].mask != 0 &&
+                ring->fds[fd].generation == generation;
+  if (!current) {
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+      uring_recycle_buffer(ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    return 0;
+  }
+  int mask = ring->fds[fd].mask;
+  *event = (FiredEvent){.fd = fd, .accepted = -1};
+
+  switch (op) {
+  case URING_ACCEPT:
+    if (!more)
+      uring_arm(ring, URING_ACCEPT, fd);
+    if (cqe->res < 0)
+      return 0;
+    event->mask = EVENT_READABLE | EVENT_ACCEPT;
+    event->accepted = cqe->res;
+    return 1;
+
+  case URING_RECV:
+    if (cqe->res == -ENOBUFS) {
+      // Every buffer is out, they come back at the start of the next wait
+      uring_arm(ring, URING_RECV, fd);
+      return 0;
+    }
+    event->mask = EVENT_READABLE | EVENT_DATA;
+    if (cqe->res <= 0) {
+      // The end of the stream, or an error
+      event->mask |= EVENT_HANGUP;
+      return 1;
+    }
+    if (!more)
+      uring_arm(ring, URING_RECV, fd);
+    uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    ring->held[ring->held_count++] = bid;
+    event->data = ring->bufs + (size_t)bid * EVENT_LOOP_RECV_BUFFER_SIZE;
+    event->len = cqe->res;
+    return 1;
+
+  case URING_POLL_IN:
+  case URING_POLL_OUT: {
+    int wanted = op == URING_POLL_IN ? EVENT_READABLE : EVENT_WRITABLE;
+    if (!more && (mask & wanted))
+      uring_arm(ring, op, fd);
+    if (cqe->res < 0)
+      return 0;
+    if (cqe->res & (POLLIN | POLLOUT))
+      event->mask |= wanted;
+    if (cqe->res & (POLLHUP | POLLERR))
+      event->mask |= EVENT_HANGUP;
+    return event->mask != 0;
+  }
+
+  default:
+    return 0;
+  }
+}
+
+static int uring_reap(Uring *ring, FiredEvent *events, int max) {
+  int n = 0;
+
+  while (n < max && ring->stash_head < ring->stash_count) {
+    n += uring_fire(ring, &ring->stash[ring->stash_head++], &events[n]);
+  }
+  if (ring->stash_head == ring->stash_count)
+    ring->stash_head = ring->stash_count = 0;
+
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  while (n < max && head != tail) {
+    n += uring_fire(ring, &ring->cqes[head & *ring->cq_mask], &events[n]);
+    head++;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+static int uring_wait(Uring *ring, FiredEvent *events, int max, int timeout_ms) {
+  // The caller is done with what the last batch read
+  for (size_t i = 0; i < ring->held_count; i++)
+    uring_recycle_buffer(ring, ring->held[i]);
+  ring->held_count = 0;
+  uring_publish_buffers(ring);
+
+  // Never hand out more reads than there are buffers to hold them
+  if (max > EVENT_LOOP_RECV_BUFFERS)
+    max = EVENT_LOOP_RECV_BUFFERS;
+
+  int n = uring_reap(ring, events, max);
+  if (n > 0) {
+    if (ring->sq_unsubmitted > 0 && uring_submit(ring, 0, 0) != 0)
+      return -1;
+    return n;
+  }
+
+  if (uring_submit(ring, timeout_ms == 0 ? 0 : 1, timeout_ms) != 0)
+    return -1;
+  return uring_reap(ring, events, max);
+}
+
+static int uring_stash(Uring *ring, const struct io_uring_cqe *cqe) {
+  if (ring->stash_count == ring->stash_capacity) {
+    size_t capacity = ring->stash_capacity ? ring->stash_capacity * 2 : 256;
+    struct io_uring_cqe *stash = realloc(ring->stash, capacity * sizeof(struct io_uring_cqe));
+    if (stash == NULL)
+      return -1;
+    ring->stash = stash;
+    ring->stash_capacity = capacity;
+  }
+  ring->stash[ring->stash_count++] = *cqe;
+  return 0;
+}
+
+// One sendmsg per entry, all submitted and waited for with a single call.
+// The sockets are non-blocking, so each one completes right away.
+static void uring_writev(Uring *ring, EventWrite *writes, size_t count) {
+  if (count > ring->msgs_capacity) {
+    struct msghdr *msgs = realloc(ring->msgs, count * sizeof(struct msghdr));
+    if (msgs == NULL) {
+      for (size_t i = 0; i < count; i++)
+        writes[i].result = -ENOMEM;
+      return;
+    }
+    ring->msgs = msgs;
+    ring->msgs_capacity = count;
+  }
+
+  size_t queued = 0;
+  for (size_t i = 0; i < count; i++) {
+    writes[i].result = -EAGAIN;
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL)
+      break; // Left for the next flush
+    memset(&ring->msgs[i], 0, sizeof(struct msghdr));
+    ring->msgs[i].msg_iov = (struct iovec *)writes[i].iov;
+    ring->msgs[i].msg_iovlen = writes[i].iovcnt;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = writes[i].fd;
+    sqe->addr = (uint64_t)(uintptr_t)&ring->msgs[i];
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+    sqe->user_data = ((uint64_t)i << 8) | URING_SEND;
+    queued++;
+  }
+
+  while (queued > 0) {
+    if (uring_submit(ring, queued, -1) != 0)
+      break;
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      if ((cqe->user_data & 0xff) == URING_SEND) {
+        writes[cqe->user_data >> 8].result = cqe->res;
+        queued--;
+      } else if (uring_stash(ring, cqe) != 0) {
+        fprintf(stderr, "Out of memory keeping io_uring completions\n");
+        abort();
+      }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+}
+
+// --------------------------------------------------------------------------
+// Interface
+
+// Falls back to epoll, and returns -1, when the kernel can't run the
+// io_uring backend
+int event_loop_init(EventLoopBackend backend) {
+  event_loop_default = backend;
+  if (backend == EVENT_LOOP_IO_URING) {
+    Uring probe;
+    if (uring_create(&probe) != 0) {
+      event_loop_default = EVENT_LOOP_EPOLL;
+      return -1;
+    }
+    uring_destroy(&probe);
+  }
+  return 0;
+}
+
+int event_loop_backend_from_name(const char *name, EventLoopBackend *backend) {
+  for (size_t i = 0; i < sizeof(event_loop_backend_names) / sizeof(event_loop_backend_names[0]); i++) {
+    if (strcasecmp(name, event_loop_backend_names[i]) == 0) {
+      *backend = (EventLoopBackend)i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+const char *event_loop_backend_name() { return event_loop_backend_names[event_loop_default]; }
+
+// io_uring rings belong to the thread that creates them
+EventLoop *event_loop_create() {
+  EventLoop *loop = calloc(1, sizeof(EventLoop));
+  if (loop == NULL)
+    return NULL;
+
+  loop->backend = event_loop_default;
+  loop->epoll_fd = -1;
+  if (loop->backend == EVENT_LOOP_IO_URING) {
+    if (uring_create(&loop->ring) != 0) {
+      free(loop);
+      return NULL;
+    }
+    return loop;
+  }
+
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epoll_fd < 0) {
+    free(loop);
+    return NULL;
+  }
+  return loop;
+}
+
+EventLoopBackend event_loop_backend(EventLoop *loop) { return loop->backend; }
+
+int event_loop_add(EventLoop *loop, int fd, int mask) {
+  if (loop->backend == EVENT_LOOP_IO_URING)
+    return uring_add(&loop->ring, fd, mask);
+
+  struct epoll_event ev = {.events = epoll_mask(mask), .data.fd = fd};
+  return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int event_loop_modify(EventLoop *loop, int fd, int mask) {
+  if (loop->backend == EVENT_LOOP_IO_URING)
+    return uring_modify(&loop->ring, fd, mask);
+
+  struct epoll_event ev = {.events = epoll_mask(mask), .data.fd = fd};
+  return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+// Has to be called before the fd is closed
+void event_loop_delete(EventLoop *loop, int fd) {
+  if (loop->backend == EVENT_LOOP_IO_URING)
+    uring_delete(&loop->ring, fd);
+  else
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+// Returns the number of events, 0 on timeout, -1 if the loop broke
+int event_loop_wait(EventLoop *loop, FiredEvent *events, int max, int timeout_ms) {
+  if (loop->backend == EVENT_LOOP_IO_URING)
+    return uring_wait(&loop->ring, events, max, timeout_ms);
+  return epoll_wait_events(loop, events, max, timeout_ms);
+}
+
+void event_loop_writev(EventLoop *loop, EventWrite *writes, size_t count) {
+  if (loop->backend == EVENT_LOOP_IO_URING) {
+    uring_writev(&loop->ring, writes, count);
+    return;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    ssize_t n;
+    do {
+      n = writev(writes[i].fd, writes[i].iov, writes[i].iovcnt);
+    } while (n < 0 && errno == EINTR);
+    writes[i].result = n < 0 ? -errno : n;
+  }
+}
@@ -0,0 +1,66 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// How the server waits for its sockets. The choice is made once at startup
+// and every thread creates its own loop with it.
+typedef enum {
+  EVENT_LOOP_EPOLL = 0,    // Readiness, the caller does the reads and writes
+  EVENT_LOOP_IO_URING = 1, // Completions, reads and accepts done for the caller
+} EventLoopBackend;
+
+// Receive buffers io_uring reads into, per loop
+#define EVENT_LOOP_RECV_BUFFERS 256
+#define EVENT_LOOP_RECV_BUFFER_SIZE (16 * 1024)
+
+typedef enum {
+  EVENT_READABLE = 1 << 0,
+  EVENT_WRITABLE = 1 << 1,
+  EVENT_HANGUP = 1 << 2, // Closed by the other end, or broken
+  // When registering a stream socket: read it for the caller if the backend
+  // can. On an event: data and len hold what was read.
+  EVENT_DATA = 1 << 3,
+  // When registering a listening socket: accept for the caller if the
+  // backend can. On an event: accepted holds the new connection.
+  EVENT_ACCEPT = 1 << 4,
+} EventMask;
+
+typedef struct {
+  int fd;
+  int mask;
+  int accepted;     // With EVENT_ACCEPT
+  const char *data; // With EVENT_DATA, valid until the next event_loop_wait
+  size_t len;
+} FiredEvent;
+
+// One writev worth of output for event_loop_writev
+typedef struct {
+  int fd;
+  const struct iovec *iov;
+  int iovcnt;
+  ssize_t result; // Bytes written, or -errno
+} EventWrite;
+
+typedef struct EventLoop EventLoop;
+
+int event_loop_init(EventLoopBackend backend);
+int event_loop_backend_from_name(const char *name, EventLoopBackend *backend);
+const char *event_loop_backend_name();
+
+EventLoop *event_loop_create();
+EventLoopBackend event_loop_backend(EventLoop *loop);
+
+// Sockets are edge triggered: a readable fd has to be read until EAGAIN,
+// unless the backend did the reading (EVENT_DATA).
+int event_loop_add(EventLoop *loop, int fd, int mask);
+int event_loop_modify(EventLoop *loop, int fd, int mask);
+void event_loop_delete(EventLoop *loop, int fd);
+int event_loop_wait(EventLoop *loop, FiredEvent *events, int max, int timeout_ms);
+
+// Write every entry once, filling in its result. Never blocks.
+void event_loop_writev(EventLoop *loop, EventWrite *writes, size_t count);
+
+#endif // EVENTLOOP_H
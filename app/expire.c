@@ -0,0 +1,51 @@
+#include <stdint.h>
+
+#include "expire.h"
+#include "helper.h"
+
+// Keys sampled from the expires index per round.
+#define ACTIVE_EXPIRE_CYCLE_KEYS_PER_LOOP 20
+// Keep sampling while more than this percentage of a round was expired.
+#define ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_STALE 10
+// Share of each period the cycle may spend, in percent.
+#define ACTIVE_EXPIRE_CYCLE_TIME_PERC 25
+
+// Lazy expiry only frees keys that get read again, so keys written once
+// with a TTL would otherwise stay around forever. Each call samples the
+// expires index of every database in rounds and keeps going on a database
+// while a good share of the sampled keys turned out to be expired. All
+// databases share one slice of the period's time; a cycle that runs out
+// picks up with the next database the following time.
+void active_expire_cycle(Keyspace* keyspace, RedisStats* stats, uint64_t period_ms) {
+    static _Thread_local int next_db = 0; // Every shard expires its own keyspace
+
+    uint64_t start = get_monotonic_us();
+    uint64_t time_limit = period_ms * 1000 * ACTIVE_EXPIRE_CYCLE_TIME_PERC / 100;
+    uint64_t now = get_current_epoch_ms();
+    int iteration = 0;
+    int timed_out = 0;
+
+    for (int i = 0; i < KEYSPACE_DB_COUNT && !timed_out; i++) {
+        ht_table* ht = keyspace->db[next_db];
+        next_db = (next_db + 1) % KEYSPACE_DB_COUNT;
+        size_t sampled, expired;
+
+        if (ht->expires_count == 0) {
+            continue;
+        }
+
+        do {
+            expired = ht_expire_random(ht, ACTIVE_EXPIRE_CYCLE_KEYS_PER_LOOP, now, &sampled);
+
+            // Reading the clock isn't free, only check it every 16 rounds
+            if ((++iteration & 0xf) == 0 && get_monotonic_us() - start > time_limit) {
+                stats->stats.expired_time_cap_reached_count++;
+                timed_out = 1;
+                break;
+            }
+        } while (sampled > 0 &&
+                 expired * 100 > sampled * ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_STALE);
+    }
+
+    stats->stats.expire_cycle_cpu_usec += get_monotonic_us() - start;
+}
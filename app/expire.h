@@ -0,0 +1,11 @@
+#ifndef EXPIRE_H
+#define EXPIRE_H
+
+#include <stdint.h>
+
+#include "keyspace.h"
+#include "state.h"
+
+void active_expire_cycle(Keyspace* keyspace, RedisStats* stats, uint64_t period_ms);
+
+#endif // EXPIRE_H
@@ -0,0 +1,216 @@
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+static HashFunction hash_function = HASH_WYHASH;
+
+// Random per process, so which keys collide can't be worked out up front
+static uint8_t hash_seed[16];
+
+static const char *hash_function_names[] = {"wyhash", "siphash", "fnv1a"};
+
+// Pick the hash function and draw a fresh seed for it. Returns -1 if the
+// kernel couldn't provide random bytes, the seed is then derived from the
+// clock and pid which is still per process but guessable.
+int hash_init(HashFunction function) {
+    hash_function = function;
+
+    if (getrandom(hash_seed, sizeof(hash_seed), 0) == sizeof(hash_seed)) {
+        return 0;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t fallback[2] = {(uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec,
+                            (uint64_t)getpid()};
+    memcpy(hash_seed, fallback, sizeof(hash_seed));
+    return -1;
+}
+
+int hash_function_from_name(const char *name, HashFunction *function) {
+    for (size_t i = 0; i < sizeof(hash_function_names) / sizeof(hash_function_names[0]); i++) {
+        if (strcasecmp(name, hash_function_names[i]) == 0) {
+            *function = (HashFunction)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *hash_function_name() {
+    return hash_function_names[hash_function];
+}
+
+uint64_t hash_bytes(const void *data, size_t len) {
+    switch (hash_function) {
+    case HASH_SIPHASH:
+        return hash_siphash(data, len, hash_seed);
+    case HASH_FNV1A:
+        return hash_fnv1a(data, len);
+    case HASH_WYHASH:
+    default: {
+        uint64_t seed;
+        memcpy(&seed, hash_seed, sizeof(seed));
+        return hash_wyhash(data, len, seed);
+    }
+    }
+}
+
+// --------------------------------------------------------------------------
+// Unaligned little-endian loads
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// --------------------------------------------------------------------------
+// wyhash, final version 4.2. See https://github.com/wangyi-fudan/wyhash
+
+static const uint64_t wyp[4] = {0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL,
+                                0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL};
+
+// 64x64 -> 128 bit multiply, low half in *a and high half in *b
+static inline void wymum(uint64_t *a, uint64_t *b) {
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t wymix(uint64_t a, uint64_t b) {
+    wymum(&a, &b);
+    return a ^ b;
+}
+
+// 1 to 3 bytes, read without branching on the length
+static inline uint64_t wyr3(const uint8_t *p, size_t k) {
+    return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+uint64_t hash_wyhash(const void *data, size_t len, uint64_t seed) {
+    const uint8_t *p = data;
+    uint64_t a, b;
+
+    seed ^= wymix(seed ^ wyp[0], wyp[1]);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            // Two possibly overlapping pairs of 4 byte reads cover 4..16
+            a = (read32(p) << 32) | read32(p + ((len >> 3) << 2));
+            b = (read32(p + len - 4) << 32) | read32(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = wyr3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            // Three independent lanes keep the multipliers busy
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wymix(read64(p) ^ wyp[1], read64(p + 8) ^ seed);
+                see1 = wymix(read64(p + 16) ^ wyp[2], read64(p + 24) ^ see1);
+                see2 = wymix(read64(p + 32) ^ wyp[3], read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wymix(read64(p) ^ wyp[1], read64(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+
+    a ^= wyp[1];
+    b ^= seed;
+    wymum(&a, &b);
+    return wymix(a ^ wyp[0] ^ len, b ^ wyp[1]);
+}
+
+// --------------------------------------------------------------------------
+// SipHash-1-3, the reduced round variant Redis uses for its dictionaries.
+// Slower than wyhash but built to withstand an attacker who can pick keys.
+// See https://www.aumasson.jp/siphash/siphash.pdf
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND                                                               \
+    do {                                                                       \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32);              \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;                                 \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;                                 \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32);              \
+    } while (0)
+
+uint64_t hash_siphash(const void *data, size_t len, const uint8_t key[16]) {
+    const uint8_t *p = data;
+    const uint8_t *end = p + (len & ~(size_t)7);
+    uint64_t k0 = read64(key);
+    uint64_t k1 = read64(key + 8);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+    uint64_t b = (uint64_t)len << 56;
+
+    for (; p != end; p += 8) {
+        uint64_t m = read64(p);
+        v3 ^= m;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    switch (len & 7) {
+    case 7: b |= (uint64_t)p[6] << 48; // fallthrough
+    case 6: b |= (uint64_t)p[5] << 40; // fallthrough
+    case 5: b |= (uint64_t)p[4] << 32; // fallthrough
+    case 4: b |= (uint64_t)p[3] << 24; // fallthrough
+    case 3: b |= (uint64_t)p[2] << 16; // fallthrough
+    case 2: b |= (uint64_t)p[1] << 8;  // fallthrough
+    case 1: b |= (uint64_t)p[0];
+    }
+
+    v3 ^= b;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// --------------------------------------------------------------------------
+// FNV-1a, see https://en.wikipedia.org/wiki/Fowler–Noll–Vo_hash_function
+
+#define FNV_OFFSET 14695981039346656037UL
+#define FNV_PRIME 1099511628211UL
+
+uint64_t hash_fnv1a(const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint64_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
@@ -0,0 +1,24 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Hash functions the key space can be built on. The choice is made once at
+// startup, before any table is populated, and holds for the whole process.
+typedef enum {
+    HASH_WYHASH = 0,  // Fast, word at a time, seeded
+    HASH_SIPHASH = 1, // SipHash-1-3, for when keys come from untrusted clients
+    HASH_FNV1A = 2    // The old unseeded byte at a time hash
+} HashFunction;
+
+int hash_init(HashFunction function);
+int hash_function_from_name(const char *name, HashFunction *function);
+const char *hash_function_name();
+uint64_t hash_bytes(const void *data, size_t len);
+
+uint64_t hash_wyhash(const void *data, size_t len, uint64_t seed);
+uint64_t hash_siphash(const void *data, size_t len, const uint8_t key[16]);
+uint64_t hash_fnv1a(const void *data, size_t len);
+
+#endif // HASH_H
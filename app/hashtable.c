@@ -2,11 +2,231 @@
 #include <string.h>
 #include <stdlib.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "hash.h"
 #include "hashtable.h"
 #include "helper.h"
 
 #define INITIAL_CAPACITY 32
 
+// Grow once an array is 7/8 full (tombstones included), shrink once the
+// table drops below 1/8.
+#define HT_MAX_LOAD_NUM 7
+#define HT_MAX_LOAD_DEN 8
+#define HT_SHRINK_RATIO 8
+
+// Number of entries migrated by every get/set/del while rehashing.
+#define HT_REHASH_STEP 4
+
+// Values up to this size share the entry's allocation.
+#define HT_EMBED_VALUE_MAX 64
+
+#define HT_EXPIRES_INITIAL_CAPACITY 16
+
+// Control byte values. Full slots hold the 7-bit hash fingerprint (0..127),
+// so the top bit alone tells free slots from full ones.
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+
+#define HASH_GROUP(hash) ((hash) >> 7)
+#define HASH_FINGERPRINT(hash) ((int8_t)((hash) & 0x7F))
+
+// ----------------------------- Group matching -----------------------------
+// Each returns a bitmask with bit i set when slot i of the group matches.
+
+#if defined(__SSE2__)
+static inline uint32_t group_match(const int8_t* ctrl, int8_t fingerprint) {
+	__m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+	return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(fingerprint)));
+}
+
+static inline uint32_t group_match_empty(const int8_t* ctrl) {
+	return group_match(ctrl, CTRL_EMPTY);
+}
+
+// EMPTY or DELETED, i.e. every slot with the top bit set.
+static inline uint32_t group_match_free(const int8_t* ctrl) {
+	return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+}
+#else
+static inline uint32_t group_match(const int8_t* ctrl, int8_t fingerprint) {
+	uint32_t mask = 0;
+	for (int i = 0; i < HT_GROUP_WIDTH; i++) {
+		if (ctrl[i] == fingerprint)
+			mask |= 1u << i;
+	}
+	return mask;
+}
+
+static inline uint32_t group_match_empty(const int8_t* ctrl) {
+	return group_match(ctrl, CTRL_EMPTY);
+}
+
+static inline uint32_t group_match_free(const int8_t* ctrl) {
+	uint32_t mask = 0;
+	for (int i = 0; i < HT_GROUP_WIDTH; i++) {
+		if (ctrl[i] < 0)
+			mask |= 1u << i;
+	}
+	return mask;
+}
+#endif
+
+// Groups are visited in triangular order (home, +1, +3, +6, ...), which
+// reaches every group exactly once when the group count is a power of two.
+typedef struct {
+	size_t mask;
+	size_t group;
+	size_t step;
+} probe_seq;
+
+static inline probe_seq probe_start(ht_array* array, uint64_t hash) {
+	probe_seq seq = {array->capacity / HT_GROUP_WIDTH - 1, 0, 0};
+	seq.group = (size_t)HASH_GROUP(hash) & seq.mask;
+	return seq;
+}
+
+static inline void probe_next(probe_seq* seq) {
+	seq->step++;
+	seq->group = (seq->group + seq->step) & seq->mask;
+}
+
+// --------------------------------------------------------------------------
+// Entries
+
+static inline sds entry_key(const ht_entry* entry) {
+	return (sds)(entry->data + sizeof(struct sdshdr));
+}
+
+// Offset of an embedded value in data[], kept 8-byte aligned.
+static inline size_t entry_value_offset(size_t key_len) {
+	return (sdsmemsize(key_len) + 7) & ~(size_t)7;
+}
+
+static inline int entry_value_embedded(const ht_entry* entry) {
+	size_t offset = entry_value_offset(sdslen(entry_key(entry)));
+	return entry->value == (sds)(entry->data + offset + sizeof(struct sdshdr));
+}
+
+static ht_entry* ht_entry_create(const char* key, size_t key_len, const char* value,
+                                 size_t value_len, uint64_t expiry) {
+	int embed = value_len <= HT_EMBED_VALUE_MAX;
+	size_t value_offset = entry_value_offset(key_len);
+	size_t size = sizeof(ht_entry) +
+	              (embed ? value_offset + sdsmemsize(value_len) : sdsmemsize(key_len));
+
+	ht_entry* entry = malloc(size);
+	if (entry == NULL)
+		return NULL;
+
+	sdsinitlen(entry->data, key, key_len);
+	if (embed) {
+		entry->value = sdsinitlen(entry->data + value_offset, value, value_len);
+	} else if ((entry->value = sdsnewlen(value, value_len)) == NULL) {
+		free(entry);
+		return NULL;
+	}
+	entry->expiry = expiry;
+	return entry;
+}
+
+static void ht_entry_free(ht_entry* entry) {
+	if (!entry_value_embedded(entry))
+		sdsfree(entry->value);
+	free(entry);
+}
+
+static int entry_is_expired(const ht_entry* entry, uint64_t now) {
+	return entry->expiry != 0 && entry->expiry < now;
+}
+
+// For a single lookup: the clock is only read for entries that can expire
+static int entry_has_expired(const ht_entry* entry) {
+	return entry->expiry != 0 && entry->expiry < get_current_epoch_ms();
+}
+
+// --------------------------------------------------------------------------
+// Expires index
+
+static int expires_add(ht_table* table, ht_entry* entry) {
+	if (table->expires_count == table->expires_capacity) {
+		size_t capacity = table->expires_capacity ? table->expires_capacity * 2
+		                                          : HT_EXPIRES_INITIAL_CAPACITY;
+		ht_entry** expires = realloc(table->expires, capacity * sizeof(ht_entry*));
+		if (expires == NULL)
+			return -1;
+		table->expires = expires;
+		table->expires_capacity = capacity;
+	}
+
+	entry->expires_idx = (uint32_t)table->expires_count;
+	table->expires[table->expires_count++] = entry;
+	return 0;
+}
+
+// Move the last element into the hole so the index stays dense.
+static void expires_remove(ht_table* table, ht_entry* entry) {
+	ht_entry* last = table->expires[--table->expires_count];
+	table->expires[entry->expires_idx] = last;
+	last->expires_idx = entry->expires_idx;
+
+	if (table->expires_capacity > HT_EXPIRES_INITIAL_CAPACITY &&
+	    table->expires_count < table->expires_capacity / 4) {
+		size_t capacity = table->expires_capacity / 2;
+		ht_entry** expires = realloc(table->expires, capacity * sizeof(ht_entry*));
+		if (expires != NULL) {
+			table->expires = expires;
+			table->expires_capacity = capacity;
+		}
+	}
+}
+
+// Keep the index pointing at the right entry when an entry is swapped for
+// a new one, e.g. when a key is overwritten.
+static int expires_replace(ht_table* table, ht_entry* old_entry, ht_entry* new_entry) {
+	if (old_entry->expiry != 0 && new_entry->expiry != 0) {
+		new_entry->expires_idx = old_entry->expires_idx;
+		table->expires[new_entry->expires_idx] = new_entry;
+		return 0;
+	}
+	if (new_entry->expiry != 0)
+		return expires_add(table, new_entry);
+	if (old_entry->expiry != 0)
+		expires_remove(table, old_entry);
+	return 0;
+}
+
+// --------------------------------------------------------------------------
+
+static int ht_array_init(ht_array* array, size_t capacity) {
+	array->ctrl = malloc(capacity);
+	array->slots = malloc(capacity * sizeof(ht_slot));
+	if (array->ctrl == NULL || array->slots == NULL) {
+		free(array->ctrl);
+		free(array->slots);
+		return -1;
+	}
+	memset(array->ctrl, CTRL_EMPTY, capacity);
+	array->capacity = capacity;
+	array->used = 0;
+	array->deleted = 0;
+	return 0;
+}
+
+static void ht_array_free(ht_array* array) {
+	for (size_t i = 0; i < array->capacity; i++) {
+		if (array->ctrl[i] >= 0) {
+			ht_entry_free(array->slots[i].entry);
+		}
+	}
+
+	free(array->ctrl);
+	free(array->slots);
+	memset(array, 0, sizeof(ht_array));
+}
 
 ht_table* ht_create() {
     // Allocate space for hash table struct.
@@ -15,11 +235,18 @@ ht_table* ht_create() {
 		return NULL;
 
 	table->length = 0;
-	table->capacity = INITIAL_CAPACITY;
+	table->rehash_idx = -1;
+	table->stat_lookups = 0;
+	table->stat_probes = 0;
+	table->stat_key_compares = 0;
+	table->expires = NULL;
+	table->expires_count = 0;
+	table->expires_capacity = 0;
+	table->stat_expired_keys = 0;
+	memset(&table->arrays[1], 0, sizeof(ht_array));
 
-	// Allocate (zero'd) space for entry buckets.
-	table->entries = calloc(table->capacity, sizeof(ht_entry));
-	if (table->entries == NULL) {
+	// Allocate space for the control bytes and entry buckets.
+	if (ht_array_init(&table->arrays[0], INITIAL_CAPACITY) != 0) {
 		free(table); // error, free table before we return!
 		return NULL;
 	}
@@ -27,149 +254,492 @@ ht_table* ht_create() {
 }
 
 void ht_destroy(ht_table* table) {
-	for (size_t i = 0; i < table->capacity; i++) {
-		if (table->entries[i].key != NULL) {
-			free((void*)table->entries[i].key);
-			free(table->entries[i].value);  // Free the allocated value
+	ht_array_free(&table->arrays[0]);
+	ht_array_free(&table->arrays[1]);
+	free(table->expires);
+	free(table);
+}
+
+// The hash function is picked at startup, see hash_init.
+static inline uint64_t hash_key(const char* key, size_t len) {
+	return hash_bytes(key, len);
+}
+
+int ht_is_rehashing(ht_table* table) {
+	return table->rehash_idx != -1;
+}
+
+// Return the slot index holding key in array, or -1 if it is not there.
+static long ht_array_find(ht_table* table, ht_array* array, const char* key, size_t key_len,
+                          uint64_t hash) {
+	if (array->used == 0)
+		return -1;
+
+	int8_t fingerprint = HASH_FINGERPRINT(hash);
+	probe_seq seq = probe_start(array, hash);
+
+	while (1) {
+		const int8_t* ctrl = array->ctrl + seq.group * HT_GROUP_WIDTH;
+		table->stat_probes++;
+
+		for (uint32_t match = group_match(ctrl, fingerprint); match; match &= match - 1) {
+			size_t index = seq.group * HT_GROUP_WIDTH + __builtin_ctz(match);
+			ht_slot* slot = &array->slots[index];
+			if (slot->hash != hash)
+				continue;
+			table->stat_key_compares++;
+			sds entry_k = entry_key(slot->entry);
+			if (sdslen(entry_k) == key_len && memcmp(key, entry_k, key_len) == 0)
+				return (long)index;
 		}
+
+		// An insert would have used the empty slot, so the key can't be
+		// further down the probe sequence.
+		if (group_match_empty(ctrl))
+			return -1;
+		if (seq.step == seq.mask)
+			return -1;
+		probe_next(&seq);
 	}
+}
 
-	free(table->entries);
-	free(table);
+// Place an entry whose key is known to be absent into the first free slot
+// of its probe sequence. The array must have room for it.
+static ht_slot* ht_array_insert(ht_array* array, uint64_t hash) {
+	probe_seq seq = probe_start(array, hash);
+	uint32_t match;
+
+	while ((match = group_match_free(array->ctrl + seq.group * HT_GROUP_WIDTH)) == 0)
+		probe_next(&seq);
+
+	size_t index = seq.group * HT_GROUP_WIDTH + __builtin_ctz(match);
+	if (array->ctrl[index] == CTRL_DELETED)
+		array->deleted--;
+	array->ctrl[index] = HASH_FINGERPRINT(hash);
+	array->used++;
+
+	array->slots[index].hash = hash;
+	return &array->slots[index];
 }
 
-#define FNV_OFFSET 14695981039346656037UL
-#define FNV_PRIME 1099511628211UL
-// Return 64-bit FNV-1a hash for key (NUL-terminated). See description:
-// https://en.wikipedia.org/wiki/Fowler–Noll–Vo_hash_function
-static uint64_t hash_key(const char* key) {
-	uint64_t hash = FNV_OFFSET;
-	for (const char* p = key; *p; p++) {
-		hash ^= (uint64_t)(unsigned char)(*p);
-		hash *= FNV_PRIME;
+// Free up a slot. If its group still has an EMPTY slot no probe ever went
+// past the group, so the slot can become EMPTY too instead of a tombstone.
+static void ht_array_remove(ht_array* array, size_t index) {
+	const int8_t* group = array->ctrl + (index & ~(size_t)(HT_GROUP_WIDTH - 1));
+	if (group_match_empty(group)) {
+		array->ctrl[index] = CTRL_EMPTY;
+	} else {
+		array->ctrl[index] = CTRL_DELETED;
+		array->deleted++;
 	}
-	return hash;
+	array->used--;
 }
 
-void* ht_get(ht_table* table, const char* key) {
-	uint64_t hash = hash_key(key);
-	size_t index = (size_t)(hash & (uint64_t)(table->capacity - 1));
-
-	while (table->entries[index].key != NULL) {
-		if (strcmp(key, table->entries[index].key) == 0){
-			if (table->entries[index].expiry != 0 && table->entries[index].expiry < get_current_epoch_ms()){
-				ht_del(table, key);
-				return NULL;
-			}
-			return table->entries[index].value;
+// Look the key up in both arrays. The array it was found in is stored in
+// *array_out so callers can keep the per-array counters right.
+static ht_slot* ht_find(ht_table* table, const char* key, size_t key_len, uint64_t hash,
+                        ht_array** array_out) {
+	table->stat_lookups++;
+	for (int i = 0; i <= (ht_is_rehashing(table) ? 1 : 0); i++) {
+		long index = ht_array_find(table, &table->arrays[i], key, key_len, hash);
+		if (index >= 0) {
+			if (array_out != NULL)
+				*array_out = &table->arrays[i];
+			return &table->arrays[i].slots[index];
 		}
-		index++;
-		if (index >= table->capacity)
-			index = 0;
 	}
 	return NULL;
 }
 
-const char* ht_set(ht_table* table, const char* key, void* value, uint64_t expiry) {
-	if (table == NULL || key == NULL || value == NULL) {
+// Migrate up to n live entries from arrays[0] into arrays[1]. At most n*10
+// free slots are visited so a sparse region can't stall the caller.
+// Returns 1 if there is still work left, 0 once the rehash is finished.
+int ht_rehash(ht_table* table, size_t n) {
+	if (!ht_is_rehashing(table))
+		return 0;
+
+	ht_array* from = &table->arrays[0];
+	ht_array* to = &table->arrays[1];
+	size_t empty_visits = n * 10;
+
+	while (n > 0 && from->used > 0 && (size_t)table->rehash_idx < from->capacity) {
+		size_t index = (size_t)table->rehash_idx++;
+
+		if (from->ctrl[index] < 0) {
+			if (--empty_visits == 0)
+				break;
+			continue;
+		}
+
+		// The cached hash saves rehashing the key.
+		ht_slot* slot = &from->slots[index];
+		*ht_array_insert(to, slot->hash) = *slot;
+		ht_array_remove(from, index);
+		n--;
+	}
+
+	if (from->used > 0 && (size_t)table->rehash_idx < from->capacity)
+		return 1;
+
+	// Everything moved over, the new array takes the place of the old one.
+	free(from->ctrl);
+	free(from->slots);
+	*from = *to;
+	memset(to, 0, sizeof(ht_array));
+	table->rehash_idx = -1;
+	return 0;
+}
+
+// Rehash in batches of 100 entries for roughly ms milliseconds.
+// Returns the number of batches done.
+int ht_rehash_milliseconds(ht_table* table, uint64_t ms) {
+	uint64_t start = get_monotonic_us();
+	int batches = 0;
+
+	while (ht_rehash(table, 100)) {
+		batches++;
+		if (get_monotonic_us() - start >= ms * 1000)
+			break;
+	}
+	return batches;
+}
+
+// Start migrating into a fresh array of the given capacity.
+static int ht_resize(ht_table* table, size_t capacity) {
+	if (ht_is_rehashing(table))
+		return -1;
+	if (ht_array_init(&table->arrays[1], capacity) != 0)
+		return -1;
+	table->rehash_idx = 0;
+	return 0;
+}
+
+static int ht_array_has_room(ht_array* array) {
+	return (array->used + array->deleted + 1) * HT_MAX_LOAD_DEN <=
+	       array->capacity * HT_MAX_LOAD_NUM;
+}
+
+// Make room for one more entry. Returns -1 only when the entry can't fit.
+static int ht_expand_if_needed(ht_table* table) {
+	if (ht_is_rehashing(table)) {
+		if (ht_array_has_room(&table->arrays[1]))
+			return 0;
+		// Writes outpaced the migration, finish it before growing again.
+		while (ht_rehash(table, 1000))
+			;
+	}
+
+	ht_array* array = &table->arrays[0];
+	if (ht_array_has_room(array))
+		return 0;
+
+	// Mostly tombstones: migrating into an array of the same size is
+	// enough to clean them up.
+	size_t capacity = array->capacity;
+	if (array->used * 2 * HT_MAX_LOAD_DEN > array->capacity * HT_MAX_LOAD_NUM)
+		capacity *= 2;
+
+	if (ht_resize(table, capacity) != 0 && array->used + array->deleted + 1 >= array->capacity)
+		return -1;
+	return 0;
+}
+
+static void ht_shrink_if_needed(ht_table* table) {
+	ht_array* array = &table->arrays[0];
+	if (ht_is_rehashing(table) || array->capacity <= INITIAL_CAPACITY)
+		return;
+	if (table->length * HT_SHRINK_RATIO >= array->capacity)
+		return;
+
+	// Leave the smaller array at most 1/4 full so writes during the
+	// migration don't immediately trigger another resize.
+	size_t capacity = INITIAL_CAPACITY;
+	while (capacity < table->length * 4)
+		capacity <<= 1;
+	ht_resize(table, capacity);
+}
+
+// Take the entry in slot out of array and free it
+static void ht_remove_slot(ht_table* table, ht_array* array, ht_slot* slot) {
+	if (slot->entry->expiry != 0)
+		expires_remove(table, slot->entry);
+	ht_entry_free(slot->entry);  // Frees the value along with it
+	slot->entry = NULL;
+	ht_array_remove(array, (size_t)(slot - array->slots));
+	table->length--;
+
+	ht_shrink_if_needed(table);
+}
+
+// Find a key that hasn't expired. One that has is deleted on the spot, so
+// callers never see it.
+static ht_slot* ht_find_live(ht_table* table, const char* key, size_t key_len) {
+	if (ht_is_rehashing(table))
+		ht_rehash(table, HT_REHASH_STEP);
+
+	ht_array* array = NULL;
+	ht_slot* slot = ht_find(table, key, key_len, hash_key(key, key_len), &array);
+	if (slot == NULL)
+		return NULL;
+
+	if (entry_has_expired(slot->entry)) {
+		ht_remove_slot(table, array, slot);
+		table->stat_expired_keys++;
 		return NULL;
 	}
+	return slot;
+}
+
+sds ht_get(ht_table* table, const char* key, size_t key_len) {
+	ht_slot* slot = ht_find_live(table, key, key_len);
+	return slot != NULL ? slot->entry->value : NULL;
+}
 
-	// TODO LATER: If we're at 75% capacity, resize the table.
-	if (table->length >= table->capacity)
+sds ht_set(ht_table* table, const char* key, size_t key_len, const char* value, size_t value_len,
+           uint64_t expiry) {
+	if (table == NULL || key == NULL || value == NULL) {
 		return NULL;
+	}
 
-	uint64_t hash = hash_key(key);
-	size_t index = (size_t)(hash & (uint64_t)(table->capacity - 1));
+	if (ht_is_rehashing(table))
+		ht_rehash(table, HT_REHASH_STEP);
 
-	// Make a deep copy of the value string
-	char* value_copy = strdup((const char*)value);
-	if (value_copy == NULL) {
+	uint64_t hash = hash_key(key, key_len);
+
+	// Key, value and expiry all go into one fresh allocation
+	ht_entry* entry = ht_entry_create(key, key_len, value, value_len, expiry);
+	if (entry == NULL) {
 		return NULL;  // Memory allocation failed
 	}
 
-	while (table->entries[index].key != NULL) {
-		if (strcmp(key, table->entries[index].key) == 0) {
-			// Free the old value before replacing it
-			free(table->entries[index].value);
-			table->entries[index].value = value_copy;
-			table->entries[index].expiry = expiry;
-			return key;
+	ht_slot* slot = ht_find(table, key, key_len, hash, NULL);
+	if (slot != NULL) {
+		if (expires_replace(table, slot->entry, entry) != 0) {
+			ht_entry_free(entry);
+			return NULL;
 		}
-		index++;
-		if (index >= table->capacity)
-			index = 0;
+		// Free the old entry before replacing it
+		ht_entry_free(slot->entry);
+		slot->entry = entry;
+		return entry_key(entry);
 	}
 
-	table->entries[index].key = strdup(key);
-	if (table->entries[index].key == NULL) {
-		free(value_copy);  // Free allocated value if key allocation fails
+	if (ht_expand_if_needed(table) != 0 ||
+	    (expiry != 0 && expires_add(table, entry) != 0)) {
+		ht_entry_free(entry);
 		return NULL;
 	}
-	
-	table->entries[index].value = value_copy;
-	table->entries[index].expiry = expiry;
+
+	// New keys always go into the array we are rehashing into.
+	ht_array* array = &table->arrays[ht_is_rehashing(table) ? 1 : 0];
+	slot = ht_array_insert(array, hash);
+	slot->entry = entry;
 	table->length++;
-	
-	return table->entries[index].key;
+
+	return entry_key(entry);
 }
 
-const char * ht_set_with_relative_expiry(ht_table* table, const char* key, void* value, uint64_t expiry) {
+sds ht_set_with_relative_expiry(ht_table* table, const char* key, size_t key_len, const char* value,
+                                size_t value_len, uint64_t expiry) {
 	// get absolute time for expiry
 	uint64_t expiry_abs = 0;
 	if (expiry > 0)
 		expiry_abs = expiry + get_current_epoch_ms();
-	ht_set(table, key, value, expiry_abs);
+	return ht_set(table, key, key_len, value, value_len, expiry_abs);
 }
 
-void ht_del(ht_table* table, const char* key) {
+// Returns 1 if the key was there, 0 if it wasn't or had already expired
+int ht_del(ht_table* table, const char* key, size_t key_len) {
 	if (table == NULL || key == NULL) {
-		return;
+		return 0;
 	}
 
 	if (table->length == 0) {
-		return;
+		return 0;
 	}
 
-	uint64_t hash = hash_key(key);
-	size_t index = (size_t)(hash & (uint64_t)(table->capacity - 1));
+	if (ht_is_rehashing(table))
+		ht_rehash(table, HT_REHASH_STEP);
 
-	while (table->entries[index].key != NULL) {
-		if (strcmp(key, table->entries[index].key) == 0) {
-			free((void*)table->entries[index].key);
-			free(table->entries[index].value);  // Free the value we allocated
-			table->entries[index].key = NULL;
-			table->entries[index].value = NULL;
-			table->entries[index].expiry = 0;
-			table->length--;
-			return;
+	ht_array* array = NULL;
+	ht_slot* slot = ht_find(table, key, key_len, hash_key(key, key_len), &array);
+	if (slot == NULL)
+		return 0;
+
+	int expired = entry_has_expired(slot->entry);
+	ht_remove_slot(table, array, slot);
+	if (expired)
+		table->stat_expired_keys++;
+	return !expired;
+}
+
+// Look up the expiry of a key. Returns 0 if the key doesn't exist.
+int ht_get_expiry(ht_table* table, const char* key, size_t key_len, uint64_t* expiry) {
+	ht_slot* slot = ht_find_live(table, key, key_len);
+	if (slot == NULL)
+		return 0;
+
+	*expiry = slot->entry->expiry;
+	return 1;
+}
+
+// Set or, with expiry 0, clear the expiry of a key. The one it had is
+// stored in *previous unless that is NULL. Returns 0 if the key doesn't
+// exist, or if there was no memory to index the new expiry.
+int ht_set_expiry(ht_table* table, const char* key, size_t key_len, uint64_t expiry,
+                  uint64_t* previous) {
+	ht_slot* slot = ht_find_live(table, key, key_len);
+	if (slot == NULL)
+		return 0;
+
+	ht_entry* entry = slot->entry;
+	if (previous != NULL)
+		*previous = entry->expiry;
+	if (entry->expiry == 0 && expiry != 0) {
+		if (expires_add(table, entry) != 0)
+			return 0;
+	} else if (entry->expiry != 0 && expiry == 0) {
+		expires_remove(table, entry);
+	}
+	entry->expiry = expiry;
+	return 1;
+}
+
+// Check up to samples random entries of the expires index and delete the
+// ones that are past their expiry. The number of entries looked at is
+// stored in *sampled. Returns how many were deleted.
+size_t ht_expire_random(ht_table* table, size_t samples, uint64_t now, size_t* sampled) {
+	size_t expired = 0;
+	*sampled = 0;
+
+	while (*sampled < samples && table->expires_count > 0) {
+		ht_entry* entry = table->expires[(size_t)random() % table->expires_count];
+		(*sampled)++;
+
+		if (entry_is_expired(entry, now)) {
+			sds key = entry_key(entry);
+			ht_del(table, key, sdslen(key));  // Counts it in stat_expired_keys
+			expired++;
 		}
-		index++;
-		if (index >= table->capacity)
-			index = 0;
 	}
+	return expired;
+}
+
+// --------------------------------------------------------------------------
+// Scanning
 
-	return;
+// Reverse the bits of v, so the cursor can be incremented from the top bit.
+static unsigned long rev(unsigned long v) {
+	unsigned long s = 8 * sizeof(v);
+	unsigned long mask = ~0UL;
+	while ((s >>= 1) > 0) {
+		mask ^= (mask << s);
+		v = ((v >> s) & mask) | ((v << s) & ~mask);
+	}
+	return v;
 }
 
+// Visit every entry whose home is the given group. Those sit somewhere along
+// the group's probe sequence, no further than the first group with an EMPTY
+// slot, which is where lookups stop too.
+static void ht_array_scan_group(ht_array* array, size_t home, uint64_t now,
+                                ht_scan_fn fn, void* privdata) {
+	probe_seq seq = {array->capacity / HT_GROUP_WIDTH - 1, home, 0};
 
-const char** ht_get_keys(ht_table* table, size_t* count) {
-	if (table == NULL || count == NULL) {
-		return NULL;
+	while (1) {
+		const int8_t* ctrl = array->ctrl + seq.group * HT_GROUP_WIDTH;
+		uint32_t full = ~group_match_free(ctrl) & ((1u << HT_GROUP_WIDTH) - 1);
+
+		while (full) {
+			ht_slot* slot = &array->slots[seq.group * HT_GROUP_WIDTH + __builtin_ctz(full)];
+			full &= full - 1;
+			if ((HASH_GROUP(slot->hash) & seq.mask) == home &&
+			    !entry_is_expired(slot->entry, now))
+				fn(privdata, entry_key(slot->entry), slot->entry->value);
+		}
+
+		if (group_match_empty(ctrl) || seq.step == seq.mask)
+			return;
+		probe_next(&seq);
 	}
+}
 
-	*count = table->length;
-	const char** keys = malloc(table->length * sizeof(const char*));
-	if (keys == NULL) {
-		return NULL;
+// Visit the entries of one home group and return the cursor to continue
+// from, 0 once the whole table has been covered. Like Redis' dictScan the
+// cursor counts up from the top bit of the group index, so the bits a
+// resize adds or drops only ever refer to groups still to come: a key that
+// exists for the whole iteration is returned at least once, even while the
+// table grows, shrinks or rehashes between calls.
+unsigned long ht_scan(ht_table* table, unsigned long cursor, ht_scan_fn fn, void* privdata) {
+	if (table->length == 0)
+		return 0;
+
+	uint64_t now = get_current_epoch_ms();
+
+	if (!ht_is_rehashing(table)) {
+		ht_array* array = &table->arrays[0];
+		unsigned long mask = array->capacity / HT_GROUP_WIDTH - 1;
+
+		ht_array_scan_group(array, cursor & mask, now, fn, privdata);
+
+		cursor |= ~mask;
+		cursor = rev(cursor);
+		cursor++;
+		return rev(cursor);
+	}
+
+	ht_array* small = &table->arrays[0];
+	ht_array* large = &table->arrays[1];
+	if (small->capacity > large->capacity) {
+		ht_array* tmp = small;
+		small = large;
+		large = tmp;
 	}
+	unsigned long small_mask = small->capacity / HT_GROUP_WIDTH - 1;
+	unsigned long large_mask = large->capacity / HT_GROUP_WIDTH - 1;
 
-	size_t key_index = 0;
-	for (size_t i = 0; i < table->capacity; i++) {
-		if (table->entries[i].key != NULL) {
-			keys[key_index++] = table->entries[i].key;
+	ht_array_scan_group(small, cursor & small_mask, now, fn, privdata);
+
+	// Then every group of the larger array that folds onto that one
+	do {
+		ht_array_scan_group(large, cursor & large_mask, now, fn, privdata);
+
+		cursor |= ~large_mask;
+		cursor = rev(cursor);
+		cursor++;
+		cursor = rev(cursor);
+	} while (cursor & (small_mask ^ large_mask));
+
+	return cursor;
+}
+
+void ht_get_probe_stats(ht_table* table, ht_probe_stats* stats) {
+	memset(stats, 0, sizeof(ht_probe_stats));
+	uint64_t total = 0;
+
+	for (int a = 0; a < 2; a++) {
+		ht_array* array = &table->arrays[a];
+		for (size_t i = 0; i < array->capacity; i++) {
+			if (array->ctrl[i] < 0)
+				continue;
+
+			// Replay the probe sequence until it reaches the entry's group.
+			probe_seq seq = probe_start(array, array->slots[i].hash);
+			while (seq.group != i / HT_GROUP_WIDTH)
+				probe_next(&seq);
+
+			size_t displacement = seq.step;
+			size_t bucket = 0;
+			while (bucket < HT_PROBE_HIST_BUCKETS - 1 && (displacement >> bucket) != 0)
+				bucket++;
+
+			stats->histogram[bucket]++;
+			if (displacement > stats->max_displacement)
+				stats->max_displacement = displacement;
+			total += displacement;
 		}
 	}
 
-	return keys;
-}
\ No newline at end of file
+	if (table->length > 0)
+		stats->avg_displacement = (double)total / (double)table->length;
+}
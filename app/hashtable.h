@@ -1,24 +1,93 @@
 #ifndef HASHTABLE_H
 #define HASHTABLE_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sds.h"
+
+// Slots are probed a group at a time, one SSE2 compare per group.
+#define HT_GROUP_WIDTH 16
+
+// A key and its value in a single allocation. The key is an sds embedded in
+// data[]; values up to HT_EMBED_VALUE_MAX bytes are embedded right after it,
+// larger ones get their own allocation.
 typedef struct {
-	const char* key;
-	void* value;
 	uint64_t expiry;
+	sds value;
+	uint32_t expires_idx; // Position in the table's expires index
+	char data[];
 } ht_entry;
 
+typedef struct {
+	uint64_t hash; // Full hash, so fingerprint hits rarely need a key compare
+	ht_entry* entry;
+} ht_slot;
+
+// A single swiss-table style array. Every slot has a control byte that is
+// either EMPTY, DELETED or the low 7 bits of the hash of the key stored in
+// it. While the table is rehashing, entries move from arrays[0] into
+// arrays[1] a few slots at a time.
+typedef struct {
+	int8_t* ctrl;
+	ht_slot* slots;
+	size_t capacity; // Power of two, at least HT_GROUP_WIDTH
+	size_t used;
+	size_t deleted;  // DELETED control bytes, they count towards the load
+} ht_array;
+
 typedef struct ht_table {
-	size_t capacity;
+	ht_array arrays[2];
 	size_t length;
-	ht_entry* entries;
+	long rehash_idx; // Next slot of arrays[0] to migrate, -1 if not rehashing
+	uint64_t stat_lookups;
+	uint64_t stat_probes;       // Groups inspected by those lookups
+	uint64_t stat_key_compares; // Fingerprint hits that needed a strcmp
+
+	// Dense array of every entry that has an expiry, so the active expire
+	// cycle can sample them at random in O(1).
+	ht_entry** expires;
+	size_t expires_count;
+	size_t expires_capacity;
+	uint64_t stat_expired_keys;
 } ht_table;
 
+// Number of extra groups every live entry sits away from its home group,
+// bucketed by powers of two: 0, 1, 2-3, 4-7, ... with the last bucket
+// catching everything above.
+#define HT_PROBE_HIST_BUCKETS 8
+
+typedef struct {
+	size_t max_displacement;
+	double avg_displacement;
+	size_t histogram[HT_PROBE_HIST_BUCKETS];
+} ht_probe_stats;
+
 ht_table* ht_create();
 void ht_destroy(ht_table* table);
-void* ht_get(ht_table* table, const char* key);
-const char* ht_set(ht_table* table, const char* key, void* value, uint64_t expiry);
-const char * ht_set_with_relative_expiry(ht_table* table, const char* key, void* value, uint64_t expiry);
-void ht_del(ht_table* table, const char* key);
-const char** ht_get_keys(ht_table* table, size_t* count);
+// Keys and values are taken as bytes and lengths, so they can come straight
+// from a client's query buffer. Only ht_set copies them, into the entry.
+sds ht_get(ht_table* table, const char* key, size_t key_len);
+sds ht_set(ht_table* table, const char* key, size_t key_len, const char* value, size_t value_len,
+           uint64_t expiry);
+sds ht_set_with_relative_expiry(ht_table* table, const char* key, size_t key_len, const char* value,
+                                size_t value_len, uint64_t expiry);
+int ht_del(ht_table* table, const char* key, size_t key_len);
+void ht_get_probe_stats(ht_table* table, ht_probe_stats* stats);
+
+// Expiry, as absolute unix time in milliseconds with 0 meaning none
+int ht_get_expiry(ht_table* table, const char* key, size_t key_len, uint64_t* expiry);
+int ht_set_expiry(ht_table* table, const char* key, size_t key_len, uint64_t expiry,
+                  uint64_t* previous);
+size_t ht_expire_random(ht_table* table, size_t samples, uint64_t now, size_t* sampled);
+
+// Called for every key a scan step visits
+typedef void (*ht_scan_fn)(void* privdata, const sds key, const sds value);
+unsigned long ht_scan(ht_table* table, unsigned long cursor, ht_scan_fn fn, void* privdata);
+
+// Incremental rehashing
+int ht_is_rehashing(ht_table* table);
+int ht_rehash(ht_table* table, size_t n);
+int ht_rehash_milliseconds(ht_table* table, uint64_t ms);
 
 #endif // HASHTABLE_H
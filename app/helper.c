@@ -4,11 +4,12 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <time.h>
 
@@ -74,6 +75,29 @@ void bind_to_port(int socket, uint32_t host, int port, int reuse) {
     exit_with_error("Bind failed");
 }
 
+int create_unix_server_socket() {
+  int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server_fd == -1)
+    error("Unix socket creation failed");
+
+  return server_fd;
+}
+
+// A socket file left behind by an earlier run would make bind fail, so it
+// is removed first, as Redis does
+void bind_to_unix_path(int socket, const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    exit_with_error("Unix socket path too long");
+  }
+  strcpy(addr.sun_path, path);
+
+  unlink(path);
+  if (bind(socket, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    exit_with_error("Unix socket bind failed");
+}
+
 int set_non_blocking(int fd, int block) {
   if (fd < 0) {
     return -1; // Invalid file descriptor
@@ -87,24 +111,40 @@ int set_non_blocking(int fd, int block) {
   return (fcntl(fd, F_SETFL, flags) == 0);
 }
 
-void epoll_ctl_add(int epoll_fd, int fd, uint32_t events) {
-  struct epoll_event ev;
-  ev.events = events;
-  ev.data.fd = fd;
+int set_tcp_nodelay(int fd) {
+  int yes = 1;
+  return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+}
+
+// Like Redis: the first probe after interval seconds of silence, then
+// every interval / 3, and the peer is dropped after three missed probes.
+int set_tcp_keepalive(int fd, int interval) {
+  int yes = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes)) != 0)
+    return -1;
 
-  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
-    exit_with_error("Epoll control failed");
-  }
+  int idle = interval;
+  int probe_interval = interval / 3 > 0 ? interval / 3 : 1;
+  int probes = 3;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) != 0 ||
+      setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &probe_interval, sizeof(probe_interval)) != 0 ||
+      setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes)) != 0)
+    return -1;
+  return 0;
 }
 
-void say(int socket, char *msg) {
-  if (send(socket, msg, strlen(msg), 0) == -1)
-    exit_with_error("Send failed");
+// A failed send only concerns that one connection, the caller decides what
+// to do about it
+int say(int socket, char *msg) {
+  return say_with_size(socket, msg, strlen(msg));
 }
 
-void say_with_size(int socket, void *msg, size_t size) {
-  if (send(socket, msg, size, 0) == -1)
-    exit_with_error("Send failed");
+int say_with_size(int socket, void *msg, size_t size) {
+  if (send(socket, msg, size, MSG_NOSIGNAL) == -1) {
+    error("Send failed");
+    return -1;
+  }
+  return 0;
 }
 
 int read_in(int socket, char *buf, int len) {
@@ -247,4 +287,99 @@ uint64_t get_current_epoch_ms() {
     struct timespec ts;
     clock_gettime(CLOCK_REALTIME, &ts);
     return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
-}
\ No newline at end of file
+}
+
+uint64_t get_monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Match a single character of str against the pattern element at the start
+// of pattern, storing how many pattern bytes that element took in *consumed.
+static int glob_match_char(const char *pattern, size_t pattern_len, unsigned char c,
+                           size_t *consumed) {
+  switch (pattern[0]) {
+  case '?':
+    *consumed = 1;
+    return 1;
+  case '\\':
+    if (pattern_len >= 2) {
+      *consumed = 2;
+      return (unsigned char)pattern[1] == c;
+    }
+    *consumed = 1;
+    return c == '\\';
+  case '[': {
+    size_t i = 1;
+    int negate = 0, match = 0;
+    if (i < pattern_len && pattern[i] == '^') {
+      negate = 1;
+      i++;
+    }
+    while (i < pattern_len && pattern[i] != ']') {
+      if (pattern[i] == '\\' && i + 1 < pattern_len) {
+        match |= (unsigned char)pattern[i + 1] == c;
+        i += 2;
+      } else if (i + 2 < pattern_len && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+        unsigned char lo = pattern[i], hi = pattern[i + 2];
+        if (lo > hi) {
+          unsigned char tmp = lo;
+          lo = hi;
+          hi = tmp;
+        }
+        match |= c >= lo && c <= hi;
+        i += 3;
+      } else {
+        match |= (unsigned char)pattern[i] == c;
+        i++;
+      }
+    }
+    // An unterminated class runs to the end of the pattern
+    *consumed = i < pattern_len ? i + 1 : i;
+    return negate ? !match : match;
+  }
+  default:
+    *consumed = 1;
+    return (unsigned char)pattern[0] == c;
+  }
+}
+
+// Glob-style matching with the same syntax as Redis: *, ?, [abc], [^a-z]
+// and backslash escapes. Only the most recent * is ever backtracked to, so
+// a pattern can't blow up into exponential work.
+int glob_match(const char *pattern, size_t pattern_len, const char *str, size_t str_len) {
+  size_t p = 0, s = 0;
+  size_t star_p = SIZE_MAX, star_s = 0;
+
+  while (s < str_len) {
+    if (p < pattern_len) {
+      if (pattern[p] == '*') {
+        while (p < pattern_len && pattern[p] == '*')
+          p++;
+        if (p == pattern_len)
+          return 1;
+        star_p = p;
+        star_s = s;
+        continue;
+      }
+
+      size_t consumed;
+      if (glob_match_char(pattern + p, pattern_len - p, str[s], &consumed)) {
+        p += consumed;
+        s++;
+        continue;
+      }
+    }
+
+    // Mismatch, let the last * swallow one more character
+    if (star_p == SIZE_MAX)
+      return 0;
+    p = star_p;
+    s = ++star_s;
+  }
+
+  while (p < pattern_len && pattern[p] == '*')
+    p++;
+  return p == pattern_len;
+}
@@ -1,10 +1,18 @@
 #ifndef HELPER_H
 #define HELPER_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define DEFAULT_REDIS_PORT 6379
 #define MAX_BUFFER_SIZE 1024
+// Same defaults as Redis
+#define DEFAULT_TCP_BACKLOG 511
+#define DEFAULT_TCP_KEEPALIVE 300
+#define DEFAULT_MAXCLIENTS 10000
+// Fds kept for listeners, event loops, shard wakeups and files, on top of
+// one per client
+#define RESERVED_FDS 32
 
 void exit_with_error(char *msg);
 void error(char *msg);
@@ -13,14 +21,19 @@ void get_os_info(char *buffer, size_t buffer_size);
 // Server socket helper functions
 int create_server_socket();
 void bind_to_port(int socket, uint32_t host, int port, int reuse);
-void say(int socket, char *msg);
-void say_with_size(int socket, void *msg, size_t size);
+int create_unix_server_socket();
+void bind_to_unix_path(int socket, const char *path);
+int say(int socket, char *msg);
+int say_with_size(int socket, void *msg, size_t size);
 int read_in(int socket, char *buf, int len);
 int read_in_non_blocking(int socket, char *buf, int len);
 uint32_t resolve_host(const char *hostname);
 size_t read_file_to_buffer(int fd, char *buffer, size_t buffer_size);
 int set_non_blocking(int fd, int block);
+int set_tcp_nodelay(int fd);
+int set_tcp_keepalive(int fd, int interval);
 uint64_t get_current_epoch_ms();
-void epoll_ctl_add(int epoll_fd, int fd, uint32_t events);
+uint64_t get_monotonic_us();
+int glob_match(const char *pattern, size_t pattern_len, const char *str, size_t str_len);
 
 #endif // HELPER_H
@@ -0,0 +1,157 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "commands.h"
+#include "iothreads.h"
+
+// Iterations a worker busy-waits for its next batch before checking
+// whether it has been parked
+#define IO_THREAD_SPIN 1000000
+// While spinning, give the CPU up every this many iterations so a thread we
+// wait on can run even when there are fewer cores than threads
+#define IO_THREAD_YIELD_EVERY 1024
+
+typedef enum { IO_OP_READ, IO_OP_WRITE } IoOp;
+
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t parked; // Held by the main thread while the worker is parked
+  Client **jobs;
+  size_t job_count;
+  size_t job_capacity;
+  atomic_size_t pending; // Set to job_count to hand the jobs over, 0 once done
+} IoThread;
+
+// io_threads[0] stands for the main thread and is never started
+static IoThread io_threads[IO_THREADS_MAX];
+static int io_threads_num = 1;
+static int io_threads_active = 0;
+static _Atomic IoOp io_op = IO_OP_READ;
+
+static void io_run_job(Client *c, IoOp op) {
+  if (op == IO_OP_READ) {
+    if (client_read(c) < 0)
+      c->flags |= CLIENT_CLOSE_ASAP;
+    parse_commands_in_buffer(c);
+  } else {
+    if (client_write(c) < 0)
+      c->flags |= CLIENT_CLOSE_ASAP;
+  }
+}
+
+static void io_thread_relax(int i) {
+  if (i % IO_THREAD_YIELD_EVERY == IO_THREAD_YIELD_EVERY - 1)
+    sched_yield();
+}
+
+static void *io_thread_main(void *arg) {
+  IoThread *t = arg;
+
+  while (1) {
+    // Under load the next batch is usually microseconds away, so spin for
+    // it rather than sleep
+    for (int i = 0; i < IO_THREAD_SPIN; i++) {
+      if (atomic_load(&t->pending) != 0)
+        break;
+      io_thread_relax(i);
+    }
+    if (atomic_load(&t->pending) == 0) {
+      // Blocks here while the main thread keeps us parked
+      pthread_mutex_lock(&t->parked);
+      pthread_mutex_unlock(&t->parked);
+      continue;
+    }
+
+    IoOp op = atomic_load(&io_op);
+    for (size_t i = 0; i < t->job_count; i++)
+      io_run_job(t->jobs[i], op);
+    atomic_store(&t->pending, 0);
+  }
+  return NULL;
+}
+
+// count includes the main thread, 1 keeps all I/O on it
+int io_threads_init(int count) {
+  if (count < 1 || count > IO_THREADS_MAX)
+    return -1;
+
+  io_threads_num = count;
+  for (int i = 1; i < count; i++) {
+    IoThread *t = &io_threads[i];
+    atomic_init(&t->pending, 0);
+    pthread_mutex_init(&t->parked, NULL);
+    // Workers start out parked
+    pthread_mutex_lock(&t->parked);
+    if (pthread_create(&t->thread, NULL, io_thread_main, t) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Wake the workers up for big batches and park them again once batches
+// get small, so an idle server doesn't keep them spinning
+static int io_threads_wanted(size_t count) {
+  if (io_threads_num == 1)
+    return 0;
+
+  int wanted = count >= (size_t)io_threads_num * IO_THREADS_MIN_CLIENTS_PER_THREAD;
+  if (wanted && !io_threads_active) {
+    for (int i = 1; i < io_threads_num; i++)
+      pthread_mutex_unlock(&io_threads[i].parked);
+    io_threads_active = 1;
+  } else if (!wanted && io_threads_active) {
+    for (int i = 1; i < io_threads_num; i++)
+      pthread_mutex_lock(&io_threads[i].parked);
+    io_threads_active = 0;
+  }
+  return wanted;
+}
+
+static int io_thread_add_job(IoThread *t, Client *c) {
+  if (t->job_count == t->job_capacity) {
+    size_t capacity = t->job_capacity ? t->job_capacity * 2 : 64;
+    Client **jobs = realloc(t->jobs, capacity * sizeof(Client *));
+    if (jobs == NULL)
+      return -1;
+    t->jobs = jobs;
+    t->job_capacity = capacity;
+  }
+  t->jobs[t->job_count++] = c;
+  return 0;
+}
+
+static void io_threads_run(Client **clients, size_t count, IoOp op) {
+  if (!io_threads_wanted(count)) {
+    for (size_t i = 0; i < count; i++)
+      io_run_job(clients[i], op);
+    return;
+  }
+
+  // Round robin over the threads, the main thread's share is done below.
+  // A client whose list can't grow is handled right away on the main thread.
+  atomic_store(&io_op, op);
+  for (size_t i = 0; i < count; i++) {
+    if (io_thread_add_job(&io_threads[i % io_threads_num], clients[i]) != 0)
+      io_run_job(clients[i], op);
+  }
+  for (int id = 1; id < io_threads_num; id++)
+    atomic_store(&io_threads[id].pending, io_threads[id].job_count);
+
+  IoThread *main_thread = &io_threads[0];
+  for (size_t i = 0; i < main_thread->job_count; i++)
+    io_run_job(main_thread->jobs[i], op);
+  main_thread->job_count = 0;
+
+  for (int id = 1; id < io_threads_num; id++) {
+    for (int i = 0; atomic_load(&io_threads[id].pending) != 0; i++)
+      io_thread_relax(i);
+    io_threads[id].job_count = 0;
+  }
+}
+
+void io_threads_read(Client **clients, size_t count) { io_threads_run(clients, count, IO_OP_READ); }
+
+void io_threads_write(Client **clients, size_t count) { io_threads_run(clients, count, IO_OP_WRITE); }
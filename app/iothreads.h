@@ -0,0 +1,22 @@
+#ifndef IOTHREADS_H
+#define IOTHREADS_H
+
+#include <stddef.h>
+
+#include "client.h"
+
+// Including the main thread, which always takes a share of the work
+#define IO_THREADS_MAX 64
+
+// Batches smaller than this many clients per thread are handled on the
+// main thread alone, handing them over would cost more than it saves
+#define IO_THREADS_MIN_CLIENTS_PER_THREAD 2
+
+int io_threads_init(int count);
+
+// Read and parse, or write, every client in the batch and return once all
+// of them are done. Commands are never executed here.
+void io_threads_read(Client **clients, size_t count);
+void io_threads_write(Client **clients, size_t count);
+
+#endif // IOTHREADS_H
@@ -0,0 +1,74 @@
+#include <stdlib.h>
+
+#include "keyspace.h"
+
+Keyspace *keyspace_create() {
+  Keyspace *keyspace = calloc(1, sizeof(Keyspace));
+  if (keyspace == NULL)
+    return NULL;
+
+  for (int i = 0; i < KEYSPACE_DB_COUNT; i++) {
+    keyspace->db[i] = ht_create();
+    if (keyspace->db[i] == NULL) {
+      keyspace_destroy(keyspace);
+      return NULL;
+    }
+  }
+  return keyspace;
+}
+
+void keyspace_destroy(Keyspace *keyspace) {
+  for (int i = 0; i < KEYSPACE_DB_COUNT; i++) {
+    if (keyspace->db[i] != NULL)
+      ht_destroy(keyspace->db[i]);
+  }
+  free(keyspace);
+}
+
+int keyspace_flush_db(Keyspace *keyspace, int index) {
+  ht_table *empty = ht_create();
+  if (empty == NULL)
+    return -1;
+
+  ht_destroy(keyspace->db[index]);
+  keyspace->db[index] = empty;
+  return 0;
+}
+
+int keyspace_flush_all(Keyspace *keyspace) {
+  for (int i = 0; i < KEYSPACE_DB_COUNT; i++) {
+    if (keyspace_flush_db(keyspace, i) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Only the table pointers move, so this is O(1) however big either side is
+void keyspace_swap_db(Keyspace *keyspace, int a, int b) {
+  ht_table *tmp = keyspace->db[a];
+  keyspace->db[a] = keyspace->db[b];
+  keyspace->db[b] = tmp;
+}
+
+size_t keyspace_expires_count(Keyspace *keyspace) {
+  size_t count = 0;
+  for (int i = 0; i < KEYSPACE_DB_COUNT; i++)
+    count += keyspace->db[i]->expires_count;
+  return count;
+}
+
+int keyspace_is_rehashing(Keyspace *keyspace) {
+  for (int i = 0; i < KEYSPACE_DB_COUNT; i++) {
+    if (ht_is_rehashing(keyspace->db[i]))
+      return 1;
+  }
+  return 0;
+}
+
+// Give each rehashing table a turn of up to ms milliseconds
+void keyspace_rehash_milliseconds(Keyspace *keyspace, uint64_t ms) {
+  for (int i = 0; i < KEYSPACE_DB_COUNT; i++) {
+    if (ht_is_rehashing(keyspace->db[i]))
+      ht_rehash_milliseconds(keyspace->db[i], ms);
+  }
+}
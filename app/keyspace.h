@@ -0,0 +1,28 @@
+#ifndef KEYSPACE_H
+#define KEYSPACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hashtable.h"
+
+#define KEYSPACE_DB_COUNT 16
+
+// The numbered logical databases. Clients address them by index, so
+// swapping two tables swaps what every client on those indexes sees.
+typedef struct {
+  ht_table *db[KEYSPACE_DB_COUNT];
+} Keyspace;
+
+Keyspace *keyspace_create();
+void keyspace_destroy(Keyspace *keyspace);
+
+int keyspace_flush_db(Keyspace *keyspace, int index);
+int keyspace_flush_all(Keyspace *keyspace);
+void keyspace_swap_db(Keyspace *keyspace, int a, int b);
+
+size_t keyspace_expires_count(Keyspace *keyspace);
+int keyspace_is_rehashing(Keyspace *keyspace);
+void keyspace_rehash_milliseconds(Keyspace *keyspace, uint64_t ms);
+
+#endif // KEYSPACE_H
@@ -93,8 +93,8 @@ void parse_metadata_section(rdb_buffer_context* context) {
     // 09 72 65 64 69 73 2D 76 65 72  // The name of the metadata attribute (string encoded): "redis-ver".
     // 06 36 2E 30 2E 31 36           // The value of the metadata attribute (string encoded): "6.0.16".
 
-    unsigned char* key = NULL;
-    unsigned char* value = NULL;
+    sds key = NULL;
+    sds value = NULL;
 
     key = parse_string_encoding(context, NULL);
     if (key == NULL) {
@@ -113,15 +113,33 @@ void parse_metadata_section(rdb_buffer_context* context) {
 
 cleanup:
     if (key != NULL) {
-        free(key);
+        sdsfree(key);
     }
     if (value != NULL) {
-        free(value);
+        sdsfree(value);
     }
 }
 
 
-void parse_database_section(ht_table* ht, rdb_buffer_context* context) {
+// Read the index that follows a 0xFE selector and return its table
+static ht_table* select_database(Keyspace* keyspace, rdb_buffer_context* context) {
+    uint64_t db_index = parse_size_encoding(context);
+    if (db_index >= KEYSPACE_DB_COUNT) {
+        error("Database index out of range.");
+        return NULL;
+    }
+    printf("DB Index: %lu\n", db_index);
+    return keyspace->db[db_index];
+}
+
+// Sizes hint after a 0xFB marker, only logged since tables grow as needed
+static void parse_resizedb(rdb_buffer_context* context) {
+    uint64_t hash_table_size = parse_size_encoding(context);
+    uint64_t expires_size = parse_size_encoding(context);
+    printf("Hash Table Size: %lu, Expires Size: %lu\n", hash_table_size, expires_size);
+}
+
+void parse_database_section(Keyspace* keyspace, rdb_buffer_context* context) {
     // FE  // Indicates the start of a database subsection.
     // 00  /* The index of the database (size encoded).
     //     Here, the index is 0. */
@@ -131,44 +149,17 @@ void parse_database_section(ht_table* ht, rdb_buffer_context* context) {
     //     Here, the total key-value hash table size is 3. */
     // 02/* The size of the hash table that stores the expires of the keys (size encoded).
     //     Here, the number of keys with an expiry is 2. */
-    unsigned char *key = NULL;
-    unsigned char *value = NULL;
+    sds key = NULL;
+    sds value = NULL;
     int key_type;
     unsigned char value_type;
     uint64_t expire_time;
     
-    uint64_t db_index = parse_size_encoding(context);
-    if (db_index < 0) {
-        error("Failed to parse database index.");
-        return;
-    }
-
-    int hash_table_type = read_byte_from_buffer(context);
-    if (hash_table_type < 0) {
-        error("Failed to read hash table type.");
-        return;
-    }
-    
-    unsigned char hash_table_byte = (unsigned char)hash_table_type;
-    if (hash_table_byte != 0xFB) {
-        error("Invalid hash table type.");
+    ht_table* ht = select_database(keyspace, context);
+    if (ht == NULL) {
         return;
     }
 
-    uint64_t hash_table_size = parse_size_encoding(context);
-    if (hash_table_size < 0) {
-        error("Failed to parse hash table size.");
-        return;
-    }
-    
-    uint64_t expires_size = parse_size_encoding(context);
-    if (expires_size < 0) {
-        error("Failed to parse expires size.");
-        return;
-    }
-    
-    printf("DB Index: %d, Hash Table Size: %lu, Expires Size: %lu\n", db_index, hash_table_size, expires_size);
-
     while (1 && !context->eof_segment) {
         key_type = read_byte_from_buffer(context);
         if (key_type < 0) {
@@ -196,14 +187,14 @@ void parse_database_section(ht_table* ht, rdb_buffer_context* context) {
                 }
                 
                 printf("Key: %s, Value: %s\n", key, value);
-                if(ht_set(ht, key, value, 0) == NULL) {
+                if(ht_set(ht, key, sdslen(key), value, sdslen(value), 0) == NULL) {
                     error("Failed to set key-value pair in hash table.");
                     goto cleanup_loop;
                 }
                 
                 // Free resources before continuing to next iteration
-                free(key);
-                free(value);
+                sdsfree(key);
+                sdsfree(value);
                 key = NULL;
                 value = NULL;
                 continue;
@@ -252,14 +243,14 @@ void parse_database_section(ht_table* ht, rdb_buffer_context* context) {
                 }
                 
                 printf("Key: %s, Value: %s, Expire Time: %lu\n", key, value, expire_time);
-                if (ht_set(ht, key, value, expire_time) == NULL) {
+                if (ht_set(ht, key, sdslen(key), value, sdslen(value), expire_time) == NULL) {
                     error("Failed to set key-value pair with expiry in hash table.");
                     goto cleanup_loop;
                 }
                 
                 // Free resources before continuing to next iteration
-                free(key);
-                free(value);
+                sdsfree(key);
+                sdsfree(value);
                 key = NULL;
                 value = NULL;
                 continue;
@@ -306,18 +297,30 @@ void parse_database_section(ht_table* ht, rdb_buffer_context* context) {
                 expire_time *= 1000;
                 
                 printf("Key: %s, Value: %s, Expire Time(in seconds): %lu\n", key, value, expire_time);
-                if (ht_set(ht, key, value, expire_time) == NULL) {
+                if (ht_set(ht, key, sdslen(key), value, sdslen(value), expire_time) == NULL) {
                     error("Failed to set key-value pair with expiry in hash table.");
                     goto cleanup_loop;
                 }
                 
                 // Free resources before continuing to next iteration
-                free(key);
-                free(value);
+                sdsfree(key);
+                sdsfree(value);
                 key = NULL;
                 value = NULL;
                 continue;
                 
+            case 0xFB:
+                parse_resizedb(context);
+                continue;
+
+            case 0xFE:
+                // The next database starts right after the last key of this one
+                ht = select_database(keyspace, context);
+                if (ht == NULL) {
+                    goto cleanup_loop;
+                }
+                continue;
+
             case 0xFF:
                 printf("End of file segment.\n");
                 context->eof_segment = 1;
@@ -332,10 +335,10 @@ void parse_database_section(ht_table* ht, rdb_buffer_context* context) {
 cleanup_loop:
     // Free any remaining resources
     if (key != NULL) {
-        free(key);
+        sdsfree(key);
     }
     if (value != NULL) {
-        free(value);
+        sdsfree(value);
     }
 }
 
@@ -394,7 +397,7 @@ uint64_t parse_size_encoding(rdb_buffer_context* context) {
     return 0;
 }
 
-unsigned char* parse_string_encoding(rdb_buffer_context* context, size_t* size) {
+sds parse_string_encoding(rdb_buffer_context* context, size_t* size) {
     int byte = read_byte_from_buffer(context);
     if (byte < 0) {
         error("Failed to read byte from buffer.");
@@ -428,14 +431,12 @@ unsigned char* parse_string_encoding(rdb_buffer_context* context, size_t* size)
     if (bytes_to_read == 0) return NULL;
 
     check_and_fill_buffer(context, bytes_to_read);
-    unsigned char* result = malloc(bytes_to_read + 1);
+    sds result = sdsnewlen(context->buffer + context->pos, bytes_to_read);
     if (result == NULL) {
         error("Failed to allocate memory for string.");
         return NULL;
     }
-    memcpy(result, context->buffer + context->pos, bytes_to_read);
     context->pos += bytes_to_read;
-    result[bytes_to_read] = '\0';
 
     if (size != NULL) {
         *size = bytes_to_read;  // Store the actual string length
@@ -448,7 +449,7 @@ unsigned char* parse_string_encoding(rdb_buffer_context* context, size_t* size)
 // -------------------------------------------------------------------------
 
 // Main API for Loading from RDB file
-void load_from_rdb_file(ht_table* ht, const char* file_path) {
+void load_from_rdb_file(Keyspace* keyspace, const char* file_path) {
     rdb_buffer_context *context = NULL;
     
     // Read the rest of file into a buffer
@@ -494,7 +495,7 @@ void load_from_rdb_file(ht_table* ht, const char* file_path) {
                 continue;
             case 0xFE:
                 // Database section
-                parse_database_section(ht, context);
+                parse_database_section(keyspace, context);
                 continue;
             case 0xFF:
                 // End of file
@@ -1,6 +1,9 @@
 #ifndef RDB_H
 #define RDB_H
 
+#include "keyspace.h"
+#include "sds.h"
+
 #define RDB_READ_BUFFER_SIZE 1024
 
 typedef struct {
@@ -21,9 +24,9 @@ void parse_metadata_section(rdb_buffer_context* context);
 
 // RDB encoding parsers
 uint64_t parse_size_encoding(rdb_buffer_context* context);
-unsigned char* parse_string_encoding(rdb_buffer_context* context, size_t* size);
+sds parse_string_encoding(rdb_buffer_context* context, size_t* size);
 
 // Main API
-void load_from_rdb_file(ht_table* ht, const char* filename);
+void load_from_rdb_file(Keyspace* keyspace, const char* filename);
 
 #endif // RDB_H
\ No newline at end of file
@@ -6,9 +6,12 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "client.h"
 #include "helper.h"
+#include "resp.h"
 #include "state.h"
 #include "dlist.h"
+#include "timer.h"
 
 int connect_to_master(uint32_t host, uint16_t port) {
   printf("Connecting to master at %d:%d\n", host, port);
@@ -32,16 +35,14 @@ int connect_to_master(uint32_t host, uint16_t port) {
   return fd;
 }
 
-void send_rdb_file_to_slave(int connection_id, RedisStats *stats) {
+void send_rdb_file_to_slave(ReplyBuffer *reply, RedisStats *stats) {
   // Send the RDB file to the slave
   char empty_rdb[] = {0x52, 0x45, 0x44, 0x49, 0x53,
                       0x30, 0x30, 0x30, 0x37, 0xFF};
   size_t rdb_size = sizeof(empty_rdb);
   // Send the RESP formatted RDB file
-  char resp_header[64];
-  snprintf(resp_header, sizeof(resp_header), "$%zu\r\n", rdb_size);
-  say(connection_id, resp_header);
-  say_with_size(connection_id, empty_rdb, sizeof(empty_rdb));
+  reply_add_format(reply, "$%zu\r\n", rdb_size);
+  reply_add_raw(reply, empty_rdb, rdb_size);
 }
 
 void read_rdb_file_from_master(int master_fd) {
@@ -86,7 +87,8 @@ void handle_handshake_step(RedisStats *stats) {
   switch(stats->replication.handshake_state) {
     case HANDSHAKE_NOT_STARTED:
       printf("Starting handshake with master: sending PING...\n");
-      say(master_fd, "*1\r\n$4\r\nPING\r\n");
+      snprintf(write_buffer, sizeof(write_buffer), "*1\r\n$4\r\nPING\r\n");
+      client_queue_output(master_fd, write_buffer, strlen(write_buffer));
       stats->replication.handshake_state = HANDSHAKE_PING_SENT;
       break;
       
@@ -95,7 +97,7 @@ void handle_handshake_step(RedisStats *stats) {
       snprintf(write_buffer, sizeof(write_buffer),
                "*3\r\n$8\r\nREPLCONF\r\n$14\r\nlistening-port\r\n$4\r\n%d\r\n",
                stats->server.tcp_port);
-      say(master_fd, write_buffer);
+      client_queue_output(master_fd, write_buffer, strlen(write_buffer));
       stats->replication.handshake_state = HANDSHAKE_PORT_SENT;
       break;
       
@@ -103,7 +105,7 @@ void handle_handshake_step(RedisStats *stats) {
       printf("Handshake step 3: sending REPLCONF capa psync2...\n");
       snprintf(write_buffer, sizeof(write_buffer),
                "*3\r\n$8\r\nREPLCONF\r\n$4\r\ncapa\r\n$6\r\npsync2\r\n");
-      say(master_fd, write_buffer);
+      client_queue_output(master_fd, write_buffer, strlen(write_buffer));
       stats->replication.handshake_state = HANDSHAKE_CAPA_SENT;
       break;
       
@@ -111,7 +113,7 @@ void handle_handshake_step(RedisStats *stats) {
       printf("Handshake step 4: sending PSYNC...\n");
       snprintf(write_buffer, sizeof(write_buffer),
                "*3\r\n$5\r\nPSYNC\r\n$1\r\n?\r\n$2\r\n-1\r\n");
-      say(master_fd, write_buffer);
+      client_queue_output(master_fd, write_buffer, strlen(write_buffer));
       stats->replication.handshake_state = HANDSHAKE_PSYNC_SENT;
       break;
       
@@ -218,7 +220,7 @@ int process_rdb_data(RedisStats *stats, char *buf, int bytes_read) {
   // Handle RDB data starting with '$' (RESP bulk string format)
   else if (stats->replication.handshake_state == HANDSHAKE_COMPLETED && 
           strncmp(buf, "$", 1) == 0) {
-    char *end_ptr = strchr(buf, '\r');
+    const char *end_ptr = resp_find_crlf(buf, buf + bytes_read);
     if (!end_ptr) {
       printf("Incomplete RDB header, waiting for more data\n");
       return -1; 
@@ -310,7 +312,7 @@ int handle_handshake_response(RedisStats *stats, char *buf, int bytes_read) {
     stats->replication.handshake_state = HANDSHAKE_COMPLETED;
     
     // Check for additional data after FULLRESYNC response
-    char *fullresync_end = strstr(buf, "\r\n");
+    const char *fullresync_end = resp_find_crlf(buf, buf + bytes_read);
     if (fullresync_end) {
       int fullresync_len = (fullresync_end - buf) + 2;
       
@@ -344,6 +346,96 @@ uint64_t check_replica_acknowledgments(RedisStats *stats, uint64_t required_offs
 // Helper function to respond to waiting client with replication status
 void respond_to_waiting_client(int connection_fd, uint64_t replica_ok_count) {
   char response[64] = {0};
-  snprintf(response, sizeof(response), ":%d\r\n", (int)replica_ok_count);
-  say(connection_fd, response);
+  int len = snprintf(response, sizeof(response), ":%d\r\n", (int)replica_ok_count);
+  client_queue_output(connection_fd, response, len);
+}
+
+// Answer a waiting client and drop its entry. Its timer, if any, has to be
+// cancelled or have fired already.
+static void finish_waiting_client(RedisStats *stats, WaitingClientInfo *info,
+                                  uint64_t replica_ok_count) {
+  respond_to_waiting_client(info->connection_fd, replica_ok_count);
+  Client *c = client_lookup(info->connection_fd);
+  if (c != NULL)
+    c->waiting_acks--;
+  stats->clients.blocked_clients--;
+  delete_node(stats->others.waiting_clients, info->node);
+  free(info);
+}
+
+// The WAIT timeout ran out, answer with however many replicas made it
+static long waiting_client_timeout(RedisStats *stats, void *privdata) {
+  WaitingClientInfo *info = privdata;
+  info->timer = NULL;
+  finish_waiting_client(stats, info, check_replica_acknowledgments(stats, info->master_offset));
+  return TIMER_DONE;
+}
+
+// A timeout of 0 waits for as long as it takes, like Redis
+int replication_add_waiting_client(RedisStats *stats, int connection_fd, uint64_t offset,
+                                   uint64_t minimum_replica_count, uint64_t timeout_ms) {
+  WaitingClientInfo *info = create_waiting_client_info(connection_fd, offset, minimum_replica_count);
+  if (info == NULL)
+    return -1;
+  if (add_to_list_tail(stats->others.waiting_clients, info) == NULL) {
+    free(info);
+    return -1;
+  }
+  info->node = stats->others.waiting_clients->tail;
+
+  if (timeout_ms > 0) {
+    info->timer = timer_add(timeout_ms, waiting_client_timeout, info);
+    if (info->timer == NULL) {
+      delete_node(stats->others.waiting_clients, info->node);
+      free(info);
+      return -1;
+    }
+  }
+
+  Client *c = client_lookup(connection_fd);
+  if (c != NULL)
+    c->waiting_acks++;
+  stats->clients.blocked_clients++;
+  return 0;
+}
+
+// Called once per event loop iteration after ACKs came in. Waiters are in
+// the order they arrived, so their offsets only grow and the count for one
+// offset serves every waiter after it on the same one.
+void replication_unblock_waiting_clients(RedisStats *stats) {
+  uint64_t counted_offset = 0;
+  uint64_t replica_ok_count = 0;
+  int counted = 0;
+
+  Node *node = stats->others.waiting_clients->head;
+  while (node != NULL) {
+    Node *next = node->next;
+    WaitingClientInfo *info = node->data;
+    if (!counted || info->master_offset != counted_offset) {
+      counted_offset = info->master_offset;
+      replica_ok_count = check_replica_acknowledgments(stats, counted_offset);
+      counted = 1;
+    }
+    if (replica_ok_count >= info->minimum_replica_count) {
+      timer_cancel(info->timer);
+      finish_waiting_client(stats, info, replica_ok_count);
+    }
+    node = next;
+  }
+}
+
+// The client went away, nobody is left to answer
+void replication_forget_waiting_client(RedisStats *stats, int connection_fd) {
+  Node *node = stats->others.waiting_clients->head;
+  while (node != NULL) {
+    Node *next = node->next;
+    WaitingClientInfo *info = node->data;
+    if (info->connection_fd == connection_fd) {
+      timer_cancel(info->timer);
+      stats->clients.blocked_clients--;
+      delete_node(stats->others.waiting_clients, node);
+      free(info);
+    }
+    node = next;
+  }
 }
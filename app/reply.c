@@ -0,0 +1,234 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "reply.h"
+
+// A deferred length is at most "*" + 20 digits + "\r\n"
+#define REPLY_DEFERRED_LEN_SIZE 32
+// Same for any header, the sign of an integer included
+#define REPLY_HEADER_SIZE 32
+
+#define SHARED(str) {str, sizeof(str) - 1}
+
+const SharedReplies shared = {
+    .ok = SHARED("+OK\r\n"),
+    .pong = SHARED("+PONG\r\n"),
+    .czero = SHARED(":0\r\n"),
+    .cone = SHARED(":1\r\n"),
+    .cnegone = SHARED(":-1\r\n"),
+    .cnegtwo = SHARED(":-2\r\n"),
+    .nullbulk = SHARED("$-1\r\n"),
+    .emptyarray = SHARED("*0\r\n"),
+    .none = SHARED("+none\r\n"),
+    .string = SHARED("+string\r\n"),
+    .syntaxerr = SHARED("-ERR syntax error\r\n"),
+    .notinteger = SHARED("-ERR value is not an integer or out of range\r\n"),
+    .outofrangedb = SHARED("-ERR DB index is out of range\r\n"),
+    .unknowncmd = SHARED("-ERR unknown command\r\n"),
+};
+
+// Each entry is at most 7 bytes, like ":9999\r\n", its length in the 8th.
+// Only written before any thread starts, read-only after.
+static char shared_integers[REPLY_SHARED_INTEGERS][8];
+static char shared_bulk_headers[REPLY_SHARED_HEADERS][8];
+static char shared_array_headers[REPLY_SHARED_HEADERS][8];
+
+// Write prefix, value and \r\n to buf, which needs REPLY_HEADER_SIZE
+// bytes, and return the length
+static size_t encode_header(char *buf, char prefix, long long value) {
+    char digits[24];
+    size_t n = 0;
+    unsigned long long v = value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v != 0);
+
+    size_t len = 0;
+    buf[len++] = prefix;
+    if (value < 0) {
+        buf[len++] = '-';
+    }
+    while (n > 0) {
+        buf[len++] = digits[--n];
+    }
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    return len;
+}
+
+static void encode_shared(char (*table)[8], size_t count, char prefix) {
+    char buf[REPLY_HEADER_SIZE];
+    for (size_t i = 0; i < count; i++) {
+        size_t len = encode_header(buf, prefix, i);
+        memcpy(table[i], buf, len);
+        table[i][7] = len;
+    }
+}
+
+void reply_shared_init() {
+    encode_shared(shared_integers, REPLY_SHARED_INTEGERS, ':');
+    encode_shared(shared_bulk_headers, REPLY_SHARED_HEADERS, '$');
+    encode_shared(shared_array_headers, REPLY_SHARED_HEADERS, '*');
+}
+
+void reply_init(ReplyBuffer *reply, char *buf, size_t size) {
+    reply->buf = buf;
+    reply->size = size;
+    reply->used = 0;
+    reply->head = NULL;
+    reply->tail = NULL;
+    reply->length = 0;
+    reply->oom = 0;
+}
+
+void reply_free(ReplyBuffer *reply) {
+    ReplyBlock *block = reply->head;
+    while (block != NULL) {
+        ReplyBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    reply->head = NULL;
+    reply->tail = NULL;
+}
+
+// Drop whatever was added, keeping the caller's buffer for the next reply
+void reply_reset(ReplyBuffer *reply) {
+    reply_free(reply);
+    reply_init(reply, reply->buf, reply->size);
+}
+
+static ReplyBlock *reply_new_block(ReplyBuffer *reply, size_t size) {
+    ReplyBlock *block = malloc(sizeof(ReplyBlock) + size);
+    if (block == NULL) {
+        reply->oom = 1;
+        return NULL;
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+
+    if (reply->tail != NULL) {
+        reply->tail->next = block;
+    } else {
+        reply->head = block;
+    }
+    reply->tail = block;
+    return block;
+}
+
+void reply_add_raw(ReplyBuffer *reply, const void *data, size_t len) {
+    const char *p = data;
+    reply->length += len;
+
+    // Only fill the caller's buffer while nothing went to the blocks yet,
+    // so the bytes stay in order
+    if (reply->head == NULL) {
+        size_t avail = reply->size - reply->used;
+        size_t n = len < avail ? len : avail;
+        memcpy(reply->buf + reply->used, p, n);
+        reply->used += n;
+        p += n;
+        len -= n;
+    }
+
+    while (len > 0) {
+        ReplyBlock *block = reply->tail;
+        if (block == NULL || block->used == block->size) {
+            block = reply_new_block(reply, len > REPLY_BLOCK_SIZE ? len : REPLY_BLOCK_SIZE);
+            if (block == NULL) {
+                reply->length -= len;
+                return;
+            }
+        }
+
+        size_t avail = block->size - block->used;
+        size_t n = len < avail ? len : avail;
+        memcpy(block->buf + block->used, p, n);
+        block->used += n;
+        p += n;
+        len -= n;
+    }
+}
+
+void reply_add_format(ReplyBuffer *reply, const char *fmt, ...) {
+    char small[256];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int len = vsnprintf(small, sizeof(small), fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+        return;
+    }
+    if ((size_t)len < sizeof(small)) {
+        reply_add_raw(reply, small, len);
+        return;
+    }
+
+    char *large = malloc(len + 1);
+    if (large == NULL) {
+        reply->oom = 1;
+        return;
+    }
+    va_start(ap, fmt);
+    vsnprintf(large, len + 1, fmt, ap);
+    va_end(ap);
+    reply_add_raw(reply, large, len);
+    free(large);
+}
+
+void reply_add_bulk_string(ReplyBuffer *reply, const char *str, size_t len) {
+    if (len < REPLY_SHARED_HEADERS) {
+        reply_add_raw(reply, shared_bulk_headers[len], shared_bulk_headers[len][7]);
+    } else {
+        char header[REPLY_HEADER_SIZE];
+        reply_add_raw(reply, header, encode_header(header, '$', len));
+    }
+    reply_add_raw(reply, str, len);
+    reply_add_raw(reply, "\r\n", 2);
+}
+
+void reply_add_shared(ReplyBuffer *reply, const SharedReply *shared_reply) {
+    reply_add_raw(reply, shared_reply->buf, shared_reply->len);
+}
+
+void reply_add_integer(ReplyBuffer *reply, long long value) {
+    if (value >= 0 && value < REPLY_SHARED_INTEGERS) {
+        reply_add_raw(reply, shared_integers[value], shared_integers[value][7]);
+        return;
+    }
+    char buf[REPLY_HEADER_SIZE];
+    reply_add_raw(reply, buf, encode_header(buf, ':', value));
+}
+
+void reply_add_array_len(ReplyBuffer *reply, size_t count) {
+    if (count < REPLY_SHARED_HEADERS) {
+        reply_add_raw(reply, shared_array_headers[count], shared_array_headers[count][7]);
+        return;
+    }
+    char buf[REPLY_HEADER_SIZE];
+    reply_add_raw(reply, buf, encode_header(buf, '*', count));
+}
+
+// Reserve a block for an array header to be filled in later. Its size stays
+// 0 until then so nothing else gets appended into it.
+ReplyBlock *reply_add_deferred_len(ReplyBuffer *reply) {
+    ReplyBlock *block = reply_new_block(reply, REPLY_DEFERRED_LEN_SIZE);
+    if (block != NULL) {
+        block->size = 0;
+    }
+    return block;
+}
+
+void reply_set_deferred_array_len(ReplyBuffer *reply, ReplyBlock *deferred, size_t count) {
+    if (deferred == NULL) {
+        return;
+    }
+    deferred->used = encode_header(deferred->buf, '*', count);
+    deferred->size = deferred->used;
+    reply->length += deferred->used;
+}
@@ -0,0 +1,66 @@
+#ifndef REPLY_H
+#define REPLY_H
+
+#include <stddef.h>
+
+// Replies overflow from the caller's buffer into a chain of blocks of this
+// size, so a reply of any length never needs one big allocation.
+#define REPLY_BLOCK_SIZE (16 * 1024)
+
+// Integer replies below this, and bulk string and array headers for
+// lengths below REPLY_SHARED_HEADERS, are encoded once by reply_shared_init
+#define REPLY_SHARED_INTEGERS 10000
+#define REPLY_SHARED_HEADERS 1024
+
+typedef struct ReplyBlock {
+    struct ReplyBlock *next;
+    size_t size; // Capacity of buf, 0 for a deferred length not yet set
+    size_t used;
+    char buf[];
+} ReplyBlock;
+
+// A reply being built. It starts out in a buffer owned by the caller, which
+// covers almost every reply without touching the heap.
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t used;
+    ReplyBlock *head;
+    ReplyBlock *tail;
+    size_t length; // Bytes in the whole reply
+    int oom;       // Set once an append had to be dropped
+} ReplyBuffer;
+
+// A reply that never changes, encoded once and appended as is
+typedef struct {
+    const char *buf;
+    size_t len;
+} SharedReply;
+
+typedef struct {
+    SharedReply ok, pong, czero, cone, cnegone, cnegtwo, nullbulk, emptyarray;
+    SharedReply none, string;
+    SharedReply syntaxerr, notinteger, outofrangedb, unknowncmd;
+} SharedReplies;
+
+extern const SharedReplies shared;
+
+void reply_shared_init();
+
+void reply_init(ReplyBuffer *reply, char *buf, size_t size);
+void reply_free(ReplyBuffer *reply);
+void reply_reset(ReplyBuffer *reply);
+
+void reply_add_raw(ReplyBuffer *reply, const void *data, size_t len);
+void reply_add_format(ReplyBuffer *reply, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void reply_add_bulk_string(ReplyBuffer *reply, const char *str, size_t len);
+void reply_add_shared(ReplyBuffer *reply, const SharedReply *shared_reply);
+void reply_add_integer(ReplyBuffer *reply, long long value);
+void reply_add_array_len(ReplyBuffer *reply, size_t count);
+
+// For arrays whose length is only known after their elements were added
+ReplyBlock *reply_add_deferred_len(ReplyBuffer *reply);
+void reply_set_deferred_array_len(ReplyBuffer *reply, ReplyBlock *deferred, size_t count);
+
+#endif // REPLY_H
@@ -1,126 +1,348 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+// Build with -DRESP_SCALAR to leave the SIMD paths out, to compare
+#if defined(__AVX2__) && !defined(RESP_SCALAR)
+#include <immintrin.h>
+#elif defined(__SSE2__) && !defined(RESP_SCALAR)
+#include <emmintrin.h>
+#endif
 #include "resp.h"
 
-void free_resp_data(RESPData *data) {
-    if (data == NULL) return;
-    
-    switch (data->type) {
-        case RESP_SIMPLE_STRING:
-        case RESP_ERROR:
-        case RESP_BULK_STRING:
-            free(data->data.str);
-            break;
-        case RESP_ARRAY:
-            for (size_t i = 0; i < data->data.array.count; i++) {
-                free_resp_data(data->data.array.elements[i]);
-                free(data->data.array.elements[i]);
-            }
-            free(data->data.array.elements);
-            break;
-        default:
-            break;
-    }
+void resp_parser_init(RESPParser *parser) {
+    parser->pos = 0;
+    parser->multibulk_len = 0;
+    parser->bulk_len = -1;
+    parser->argc = 0;
+    parser->base = 0;
+    parser->error = NULL;
 }
 
-RESPData* parse_bulk_string(char **buf) {
-    // Example: $3\r\nfoo\r\n
-    // "foo"
-    char *start = *buf;
-    char *end = strchr(start, '\r');
-    RESPData *data = malloc(sizeof(RESPData));
-    data->type = RESP_BULK_STRING;
+// Find the first \r\n in [p, end), bounded by end rather than a NUL so it
+// is safe on binary data. Returns a pointer to its \r, or NULL. Looks at
+// 32 or 16 bytes at a time where the CPU allows: one load for the \r and
+// one a byte further on for the \n, so a lone \r is never a match.
+const char *resp_find_crlf(const char *p, const char *end) {
+#if defined(__AVX2__) && !defined(RESP_SCALAR)
+    const __m256i cr32 = _mm256_set1_epi8('\r');
+    const __m256i lf32 = _mm256_set1_epi8('\n');
+    while (end - p > 32) {
+        __m256i here = _mm256_loadu_si256((const __m256i *)p);
+        __m256i next = _mm256_loadu_si256((const __m256i *)(p + 1));
+        unsigned mask = _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(here, cr32), _mm256_cmpeq_epi8(next, lf32)));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+#endif
+#if defined(__SSE2__) && !defined(RESP_SCALAR)
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    while (end - p > 16) {
+        __m128i here = _mm_loadu_si128((const __m128i *)p);
+        __m128i next = _mm_loadu_si128((const __m128i *)(p + 1));
+        unsigned mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(here, cr), _mm_cmpeq_epi8(next, lf)));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    for (; end - p >= 2; p++) {
+        if (p[0] == '\r' && p[1] == '\n') {
+            return p;
+        }
+    }
+    return NULL;
+}
 
-    long length = strtol(start + 1, NULL, 10);
+// Read the number on the *<n>\r\n or $<n>\r\n header at pos. Returns a
+// pointer past the header, or NULL if it isn't all there yet or, with
+// *error set, isn't valid. The digits are decoded on the way to the \r\n,
+// so the line is never searched on its own, and a header is given up on
+// after 18 digits however much garbage follows.
+static const char *parse_header(const char *pos, const char *end, long long *value,
+                                const char **error, const char *invalid) {
+    // Most lengths and counts have one or two digits
+    if (end - pos >= 5) {
+        unsigned d1 = (unsigned char)(pos[1] - '0');
+        unsigned d2 = (unsigned char)(pos[2] - '0');
+        if (d1 <= 9 && pos[2] == '\r' && pos[3] == '\n') {
+            *value = d1;
+            return pos + 4;
+        }
+        if (d1 <= 9 && d2 <= 9 && pos[3] == '\r' && pos[4] == '\n') {
+            *value = d1 * 10 + d2;
+            return pos + 5;
+        }
+    }
 
-    if (length < 0) {
-        data->type = RESP_NULL;
-        data->data.str = NULL;
-        *buf = end + 2;
-        return data;
+    const char *p = pos + 1;
+    int negative = p < end && *p == '-';
+    p += negative;
+    const char *digits = p;
+    // 18 digits can't overflow, and are more than any limit here
+    const char *stop = end - digits > 19 ? digits + 19 : end;
+    long long n = 0;
+    while (p < stop && (unsigned char)(*p - '0') <= 9) {
+        n = n * 10 + (*p - '0');
+        p++;
     }
 
-    *buf = end + 2; // Skip the "$3\r\n" part
-    data->data.str = strndup(*buf, length); // Copy happens here.
-    if (data->data.str == NULL) {
-        printf("Error copying bulk string\n");
-        free(data);
+    if (p - digits > 18) {
+        *error = invalid;
+        return NULL;
+    }
+    if (p == end) {
+        return NULL;
+    }
+    if (p == digits || *p != '\r') {
+        *error = invalid;
+        return NULL;
+    }
+    if (p + 1 == end) {
+        return NULL;
+    }
+    if (p[1] != '\n') {
+        *error = invalid;
         return NULL;
     }
+    *value = negative ? -n : n;
+    return p + 2;
+}
 
-    *buf += length + 2; // Skip the "foo\r\n" part
-    
-    return data;
+static int reserve_arg(RESPArgs *args) {
+    if (args->count < args->capacity) {
+        return 0;
+    }
+    size_t capacity = args->capacity ? args->capacity * 2 : 16;
+    RESPArg *grown = realloc(args->args, capacity * sizeof(RESPArg));
+    if (grown == NULL) {
+        return -1;
+    }
+    args->args = grown;
+    args->capacity = capacity;
+    return 0;
 }
 
-RESPData* parse_resp_buffer(char **buf) {
-    if (!buf || !(*buf) || **buf == '\0') {
-        return NULL;
+// Parse an inline command, the way telnet or a bare redis-cli sends one:
+// a line of arguments separated by spaces or tabs. Only taken once the
+// whole line is in. A blank line takes its bytes but adds no arguments.
+static long parse_inline(RESPParser *parser, const char *buf, const char *end, RESPArgs *args) {
+    size_t avail = end - buf;
+    const char *newline = memchr(buf, '\n', avail < RESP_MAX_HEADER_LEN ? avail : RESP_MAX_HEADER_LEN);
+    if (newline == NULL) {
+        if (avail >= RESP_MAX_HEADER_LEN) {
+            parser->error = "too big inline request";
+            return RESP_PARSE_ERROR;
+        }
+        return RESP_PARSE_INCOMPLETE;
     }
 
-    switch (**buf) {
-        case '+':
-            return NULL;
-        case '-':
-            return NULL;
-        case ':':
-            return NULL;
-        case '$':
-            // Bulk string
-            return parse_bulk_string(buf);
-        case '*':
-            // Array
-            return parse_array(buf);
-        default:
-            // Skip any invalid characters and try to find the next valid command
-            // This helps with robustness when processing multi-command buffers
-            (*buf)++;
-            return NULL;
+    const char *line_end = newline > buf && newline[-1] == '\r' ? newline - 1 : newline;
+    const char *p = buf;
+    while (1) {
+        while (p < line_end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if (p == line_end) {
+            break;
+        }
+        const char *arg = p;
+        while (p < line_end && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        if (reserve_arg(args) != 0) {
+            return RESP_PARSE_OOM;
+        }
+        args->args[args->count++] = (RESPArg){arg, p - arg};
     }
+    return newline + 1 - buf;
 }
 
-RESPData* parse_array(char **buf) {
-    // Example: *3\r\n$3\r\nfoo\r\n$3\r\nbar\r\n$5\r\nHello\r\n
-    // ["foo", "bar", "Hello"]
-    char *start = *buf;
-    char *end = strchr(start, '\r');
-    RESPData *data = malloc(sizeof(RESPData));
-    data->type = RESP_ARRAY;
+// Parse the command at buf, an array of bulk strings such as
+// *2\r\n$3\r\nGET\r\n$3\r\nfoo\r\n, appending a view of each bulk string to
+// args. Returns how many bytes the command took, and the parser is ready
+// for the next one. Returns RESP_PARSE_INCOMPLETE if the input ran out
+// first: call again with the same command at buf once there is more,
+// leaving its arguments so far at the end of args. buf may have moved
+// meanwhile. RESP_PARSE_ERROR means a protocol error, see parser->error.
+// A null or empty array takes its bytes but adds no arguments. A command
+// that doesn't start with * is parsed as an inline one, except that a bulk
+// string can only ever be part of an array.
+long resp_parse_command(RESPParser *parser, const char *buf, const char *end, RESPArgs *args) {
+    if (parser->error != NULL) {
+        return RESP_PARSE_ERROR;
+    }
 
-    long count = strtol(start + 1, NULL, 10);
+    // The arguments so far point into where the buffer used to be
+    if (parser->argc > 0 && parser->base != (uintptr_t)buf) {
+        RESPArg *arg = args->args + args->count - parser->argc;
+        for (size_t i = 0; i < parser->argc; i++) {
+            arg[i].ptr = (const char *)((uintptr_t)arg[i].ptr - parser->base + (uintptr_t)buf);
+        }
+    }
+    parser->base = (uintptr_t)buf;
 
-    if (count < 0) {
-        data->type = RESP_NULL;
-        data->data.array.elements = NULL;
-        data->data.array.count = 0;
-        *buf = end + 2;
-        return data;
+    const char *pos = buf + parser->pos;
+    if (parser->multibulk_len == 0 && pos < end && *pos != '*') {
+        if (*pos != '$') {
+            return parse_inline(parser, pos, end, args);
+        }
+        long long len;
+        if (parse_header(pos, end, &len, &parser->error, "invalid bulk length") == NULL &&
+            parser->error == NULL) {
+            return RESP_PARSE_INCOMPLETE;
+        }
+        if (parser->error == NULL) {
+            parser->error = "expected '*'";
+        }
+        return RESP_PARSE_ERROR;
+    }
+    if (parser->multibulk_len == 0) {
+        long long count;
+        pos = parse_header(pos, end, &count, &parser->error, "invalid multibulk length");
+        if (pos == NULL) {
+            return parser->error != NULL ? RESP_PARSE_ERROR : RESP_PARSE_INCOMPLETE;
+        }
+        if (count > RESP_MAX_MULTIBULK_LEN) {
+            parser->error = "invalid multibulk length";
+            return RESP_PARSE_ERROR;
+        }
+        if (count <= 0) {
+            return pos - buf;
+        }
+        parser->multibulk_len = count;
     }
-    // TODO: Need more handling of cases such as -1, Needing to send actual null
 
-    *buf = end + 2; // Skip the "*3\r\n" part
-    
-    data->data.array.count = count;
-    data->data.array.elements = malloc(count * sizeof(RESPData*));
-    
-    for (int i = 0; i < count; i++) {
-        data->data.array.elements[i] = parse_resp_buffer(buf);
-
-        if (data->data.array.elements[i] == NULL) {
-            printf("Error parsing array element %d\n", i);
-            // Free the previously allocated elements
-            for (int j = 0; j < i; j++) {
-                free_resp_data(data->data.array.elements[j]);
-                free(data->data.array.elements[j]);
+    while (parser->multibulk_len > 0) {
+        if (parser->bulk_len < 0) {
+            if (pos >= end) {
+                break;
+            }
+            if (*pos != '$') {
+                parser->error = "expected '$'";
+                return RESP_PARSE_ERROR;
+            }
+            long long len;
+            const char *payload =
+                parse_header(pos, end, &len, &parser->error, "invalid bulk length");
+            if (payload == NULL) {
+                if (parser->error != NULL) {
+                    return RESP_PARSE_ERROR;
+                }
+                break;
             }
-            free(data->data.array.elements);
-            free(data);
-            return NULL;
+            if (len < 0 || len > RESP_MAX_BULK_LEN) {
+                parser->error = "invalid bulk length";
+                return RESP_PARSE_ERROR;
+            }
+            parser->bulk_len = len;
+            pos = payload;
         }
+
+        // The payload is taken by length, not by scanning, so it may hold
+        // any byte including NUL
+        if ((size_t)(end - pos) < (size_t)parser->bulk_len + 2) {
+            break;
+        }
+        if (pos[parser->bulk_len] != '\r' || pos[parser->bulk_len + 1] != '\n') {
+            parser->error = "expected CRLF after bulk string";
+            return RESP_PARSE_ERROR;
+        }
+        if (reserve_arg(args) != 0) {
+            return RESP_PARSE_OOM;
+        }
+        args->args[args->count++] = (RESPArg){pos, parser->bulk_len};
+        parser->argc++;
+        pos += parser->bulk_len + 2;
+        parser->bulk_len = -1;
+        parser->multibulk_len--;
+    }
+
+    if (parser->multibulk_len > 0) {
+        parser->pos = pos - buf;
+        return RESP_PARSE_INCOMPLETE;
+    }
+    parser->pos = 0;
+    parser->argc = 0;
+    return pos - buf;
+}
+
+// Copy command into a single allocation, for when it has to outlive the
+// buffer it was parsed from. Each argument gets a NUL after it. Free the
+// result with free().
+RESPCommand *resp_command_dup(const RESPCommand *command) {
+    size_t size = sizeof(RESPCommand) + command->argc * sizeof(RESPArg);
+    for (size_t i = 0; i < command->argc; i++) {
+        size += command->argv[i].len + 1;
+    }
+
+    RESPCommand *copy = malloc(size);
+    if (copy == NULL) {
+        return NULL;
+    }
+    copy->argv = (RESPArg *)(copy + 1);
+    copy->argc = command->argc;
+
+    char *data = (char *)(copy->argv + command->argc);
+    for (size_t i = 0; i < command->argc; i++) {
+        const RESPArg *arg = &command->argv[i];
+        memcpy(data, arg->ptr, arg->len);
+        data[arg->len] = '\0';
+        copy->argv[i].ptr = data;
+        copy->argv[i].len = arg->len;
+        data += arg->len + 1;
     }
+    return copy;
+}
 
-    return data;
+// Case-insensitive comparison against a NUL-terminated name or option
+int resp_arg_equals(const RESPArg *arg, const char *str) {
+    return strlen(str) == arg->len &&
+           strncasecmp(arg->ptr, str, arg->len) == 0;
+}
+
+// The argument must be a whole number and nothing else. Returns -1 if it
+// isn't one or doesn't fit.
+int resp_arg_to_ll(const RESPArg *arg, long long *value) {
+    char digits[32];
+    if (arg->len == 0 || arg->len >= sizeof(digits)) {
+        return -1;
+    }
+    memcpy(digits, arg->ptr, arg->len);
+    digits[arg->len] = '\0';
+
+    char *end;
+    errno = 0;
+    *value = strtoll(digits, &end, 10);
+    if (errno == ERANGE || end != digits + arg->len) {
+        return -1;
+    }
+    return 0;
+}
+
+int resp_arg_to_ul(const RESPArg *arg, unsigned long *value) {
+    char digits[32];
+    if (arg->len == 0 || arg->len >= sizeof(digits) ||
+        arg->ptr[0] == '-') {
+        return -1;
+    }
+    memcpy(digits, arg->ptr, arg->len);
+    digits[arg->len] = '\0';
+
+    char *end;
+    errno = 0;
+    *value = strtoul(digits, &end, 10);
+    if (errno == ERANGE || end != digits + arg->len) {
+        return -1;
+    }
+    return 0;
 }
 
 size_t convert_to_resp_array(char *buffer, size_t buffer_size, int count, const char *strings[]) {
@@ -210,4 +432,21 @@ char* convert_to_resp_string(const char *str) {
 
     snprintf(result, length + 20, "$%d\r\n%s\r\n", length, str);
     return result;
-}
\ No newline at end of file
+}
+
+// Write $<len>\r\n<data>\r\n into buffer. Like snprintf, returns the size
+// the encoding needs; nothing is written if that doesn't fit.
+size_t write_resp_bulk_string(char *buffer, size_t buffer_size, const char *str, size_t len) {
+    char header[32];
+    int header_len = snprintf(header, sizeof(header), "$%zu\r\n", len);
+    size_t needed = header_len + len + 2;
+
+    if (needed > buffer_size) {
+        return needed;
+    }
+
+    memcpy(buffer, header, header_len);
+    memcpy(buffer + header_len, str, len);
+    memcpy(buffer + header_len + len, "\r\n", 2);
+    return needed;
+}
@@ -1,37 +1,69 @@
 #ifndef RESP_H
 #define RESP_H
 
-typedef enum {
-    RESP_INVALID,
-    RESP_SIMPLE_STRING,
-    RESP_ERROR,
-    RESP_INTEGER,
-    RESP_BULK_STRING,
-    RESP_ARRAY,
-    RESP_NULL
-} RESPType;
-
-typedef struct RESPData {
-    RESPType type;
-    union {
-        char *str;
-        char *error;
-        long long integer;
-        struct {
-            struct RESPData **elements;
-            size_t count;
-        } array;
-    } data;
-} RESPData;
-
-// Parser functions
-RESPData* parse_resp_buffer(char** buf);
-RESPData* parse_bulk_string(char** buf);
-RESPData* parse_array(char** buf);
-void free_resp_data(RESPData* data);
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sds.h"
+
+// A command argument: a slice of the buffer the command was parsed from,
+// so nothing is copied. It isn't NUL-terminated, and is only good for as
+// long as that buffer is left alone.
+typedef struct {
+    const char *ptr;
+    size_t len;
+} RESPArg;
+
+// A parsed command, argv[0] being its name
+typedef struct {
+    RESPArg *argv;
+    size_t argc;
+} RESPCommand;
+
+// The arguments of a batch of commands, back to back. Kept from one batch
+// to the next, so parsing allocates nothing once it has grown big enough.
+typedef struct {
+    RESPArg *args;
+    size_t count;
+    size_t capacity;
+} RESPArgs;
+
+// Same limits as Redis. Input that breaks them is a protocol error. An
+// inline command is given up on past RESP_MAX_HEADER_LEN.
+#define RESP_MAX_MULTIBULK_LEN (1024 * 1024)
+#define RESP_MAX_BULK_LEN (512LL * 1024 * 1024)
+#define RESP_MAX_HEADER_LEN (64 * 1024)
+
+// resp_parse_command results besides the bytes of a complete command
+#define RESP_PARSE_INCOMPLETE 0
+#define RESP_PARSE_OOM -1
+#define RESP_PARSE_ERROR -2
+
+// Where parsing stopped inside a command when the input ran out, so the
+// next call goes on from there instead of starting over
+typedef struct {
+    size_t pos;         // Bytes of the command parsed so far
+    long multibulk_len; // Elements still to come, 0 before the array header
+    long long bulk_len; // Length of the element being read, -1 before its header
+    size_t argc;        // Its arguments so far, the last ones in args
+    uintptr_t base;     // Where the command was when they were recorded
+    const char *error;  // Why the input was rejected, once it was
+} RESPParser;
+
+// Parser functions, end points one past the last byte available in buf
+void resp_parser_init(RESPParser *parser);
+long resp_parse_command(RESPParser *parser, const char *buf, const char *end, RESPArgs *args);
+RESPCommand *resp_command_dup(const RESPCommand *command);
+const char *resp_find_crlf(const char *p, const char *end);
+
+// Argument helpers
+int resp_arg_equals(const RESPArg *arg, const char *str);
+int resp_arg_to_ll(const RESPArg *arg, long long *value);
+int resp_arg_to_ul(const RESPArg *arg, unsigned long *value);
 
 // Encoder functions
 size_t convert_to_resp_array(char *buffer, size_t buffer_size, int count, const char *strings[]);
 char* convert_to_resp_string(const char *str);
+size_t write_resp_bulk_string(char *buffer, size_t buffer_size, const char *str, size_t len);
 
 #endif // RESP_H
\ No newline at end of file
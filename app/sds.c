@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sds.h"
+
+sds sdsnewlen(const void *init, size_t len) {
+    void *mem = malloc(sdsmemsize(len));
+    if (mem == NULL) {
+        return NULL;
+    }
+    return sdsinitlen(mem, init, len);
+}
+
+// Build a string inside memory owned by someone else, e.g. a larger struct
+// that embeds it. mem must hold sdsmemsize(len) bytes and the result must
+// not be passed to sdsfree.
+sds sdsinitlen(void *mem, const void *init, size_t len) {
+    struct sdshdr *sh = mem;
+
+    sh->len = len;
+    sh->alloc = len;
+    if (init != NULL && len > 0) {
+        memcpy(sh->buf, init, len);
+    } else if (len > 0) {
+        memset(sh->buf, 0, len);
+    }
+    sh->buf[len] = '\0';
+    return sh->buf;
+}
+
+sds sdsnew(const char *init) {
+    return sdsnewlen(init, init == NULL ? 0 : strlen(init));
+}
+
+sds sdsdup(const sds s) {
+    return sdsnewlen(s, sdslen(s));
+}
+
+void sdsfree(sds s) {
+    if (s == NULL) return;
+    free(SDS_HDR(s));
+}
+
+int sdsequal(const sds a, const sds b) {
+    return sdslen(a) == sdslen(b) && memcmp(a, b, sdslen(a)) == 0;
+}
+
+// Make sure there is room for addlen more bytes after the current length.
+// Small strings double, large ones grow by SDS_MAX_PREALLOC at a time, so
+// appending in a loop stays amortised O(1) without overshooting by much.
+// Returns NULL, leaving s untouched, if the memory can't be had.
+sds sdsmakeroomfor(sds s, size_t addlen) {
+    struct sdshdr *sh = SDS_HDR(s);
+    if (sh->alloc - sh->len >= addlen) {
+        return s;
+    }
+
+    size_t newlen = (size_t)sh->len + addlen;
+    if (newlen > UINT32_MAX) {
+        return NULL;
+    }
+    if (newlen < SDS_MAX_PREALLOC) {
+        newlen *= 2;
+    } else {
+        newlen += SDS_MAX_PREALLOC;
+    }
+    if (newlen > UINT32_MAX) {
+        newlen = UINT32_MAX;
+    }
+
+    sh = realloc(sh, sdsmemsize(newlen));
+    if (sh == NULL) {
+        return NULL;
+    }
+    sh->alloc = newlen;
+    return sh->buf;
+}
+
+// Account for bytes written straight into the free space after the string,
+// e.g. by read(2) after sdsmakeroomfor.
+void sdsincrlen(sds s, size_t incr) {
+    struct sdshdr *sh = SDS_HDR(s);
+    sh->len += incr;
+    sh->buf[sh->len] = '\0';
+}
+
+void sdsclear(sds s) {
+    SDS_HDR(s)->len = 0;
+    s[0] = '\0';
+}
+
+// Drop the first n bytes, moving the rest to the front.
+void sdsconsume(sds s, size_t n) {
+    struct sdshdr *sh = SDS_HDR(s);
+    if (n >= sh->len) {
+        sdsclear(s);
+        return;
+    }
+    memmove(sh->buf, sh->buf + n, sh->len - n);
+    sh->len -= n;
+    sh->buf[sh->len] = '\0';
+}
+
+// Shrink the allocation to size bytes, or to the length if that is larger.
+sds sdsresize(sds s, size_t size) {
+    struct sdshdr *sh = SDS_HDR(s);
+    if (size < sh->len) {
+        size = sh->len;
+    }
+    if (size == sh->alloc) {
+        return s;
+    }
+
+    struct sdshdr *resized = realloc(sh, sdsmemsize(size));
+    if (resized == NULL) {
+        return s;
+    }
+    resized->alloc = size;
+    return resized->buf;
+}
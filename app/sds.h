@@ -0,0 +1,46 @@
+#ifndef SDS_H
+#define SDS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Length-prefixed, binary safe strings. An sds points at the string bytes
+// and can be passed to anything expecting a NUL-terminated char*, while the
+// header right before it keeps the length so it never has to be scanned.
+typedef char *sds;
+
+// 32-bit lengths keep the header at 8 bytes; no value we store comes close
+// to 4GB.
+struct sdshdr {
+    uint32_t len;   // Bytes used, not counting the trailing NUL
+    uint32_t alloc; // Bytes available for the string, not counting the NUL
+    char buf[];
+};
+
+#define SDS_HDR(s) ((struct sdshdr *)((s) - sizeof(struct sdshdr)))
+
+// Growth switches from doubling to steps of this size
+#define SDS_MAX_PREALLOC (1024 * 1024)
+
+static inline size_t sdslen(const sds s) { return SDS_HDR(s)->len; }
+static inline size_t sdsalloc(const sds s) { return SDS_HDR(s)->alloc; }
+static inline size_t sdsavail(const sds s) { return SDS_HDR(s)->alloc - SDS_HDR(s)->len; }
+
+// Bytes needed to hold a string of len bytes, header and NUL included.
+static inline size_t sdsmemsize(size_t len) { return sizeof(struct sdshdr) + len + 1; }
+
+sds sdsnewlen(const void *init, size_t len);
+sds sdsinitlen(void *mem, const void *init, size_t len);
+sds sdsnew(const char *init);
+sds sdsdup(const sds s);
+void sdsfree(sds s);
+int sdsequal(const sds a, const sds b);
+
+// Growable use
+sds sdsmakeroomfor(sds s, size_t addlen);
+void sdsincrlen(sds s, size_t incr);
+void sdsclear(sds s);
+void sdsconsume(sds s, size_t n);
+sds sdsresize(sds s, size_t size);
+
+#endif // SDS_H
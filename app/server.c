@@ -1,35 +1,75 @@
+// For accept4
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <errno.h>
 #include <getopt.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/epoll.h>
+#include <strings.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "client.h"
 #include "commands.h"
+#include "eventloop.h"
+#include "expire.h"
+#include "hash.h"
 #include "hashtable.h"
+#include "keyspace.h"
 #include "helper.h"
+#include "iothreads.h"
 #include "rdb.h"
 #include "replication.h"
 #include "resp.h"
+#include "shard.h"
 #include "state.h"
+#include "timer.h"
+
+// What each shard's thread is started with
+typedef struct {
+  int id;
+  int unix_fd; // Shared by every shard, -1 for none
+  RedisStats *stats;
+  Keyspace *keyspace;
+} ShardArgs;
 
 // Function declarations for server operation
+Keyspace *load_keyspace(RedisStats *stats);
 void run_server(RedisStats *stats);
+void run_shards(RedisStats *stats);
+void *run_shard(void *arg);
 void run_replica(RedisStats *stats);
-void run_main_loop(RedisStats *stats, int epoll_fd, int server_fd,
-                   ht_table *ht);
-void run_replica_main_loop(RedisStats *stats, int epoll_fd, int server_fd,
-                           ht_table *ht);
+void run_main_loop(RedisStats *stats, EventLoop *loop, int server_fd, int unix_fd,
+                   Keyspace *keyspace);
+void run_replica_main_loop(RedisStats *stats, EventLoop *loop, int server_fd, int unix_fd,
+                           Keyspace *keyspace);
+long server_cron(RedisStats *stats, void *privdata);
+void adjust_open_files_limit(RedisStats *stats);
 int setup_server_socket(RedisStats *stats);
+int setup_unix_socket(RedisStats *stats);
+EventLoop *setup_event_loop(int server_fd, int unix_fd);
 
-void handle_new_client_connection(int server_fd, int epoll_fd);
-void handle_master_data(int connection_fd, ht_table *ht, RedisStats *stats);
-void handle_client_request(int connection_fd, ht_table *ht, RedisStats *stats);
+void handle_new_client_connection(EventLoop *loop, int server_fd, int tcp, FiredEvent *event,
+                                  RedisStats *stats);
+void accept_client(EventLoop *loop, int connection_fd, int tcp, RedisStats *stats);
+long close_idle_clients(RedisStats *stats, void *privdata);
+void handle_client_event(EventLoop *loop, FiredEvent *event, Client **read_clients,
+                         size_t *read_count, RedisStats *stats);
+void handle_master_data(Client *c, Keyspace *keyspace, RedisStats *stats);
+void handle_readable_clients(Client **clients, size_t count, EventLoop *loop,
+                             Keyspace *keyspace, RedisStats *stats);
+void handle_unblocked_clients(EventLoop *loop, Keyspace *keyspace, RedisStats *stats);
+void close_client_connection(Client *c, EventLoop *loop, RedisStats *stats);
+void handle_pending_writes(EventLoop *loop, RedisStats *stats);
+void write_clients(EventLoop *loop, Client **clients, size_t count);
 
 //----------------------------------------------------------------
 // MAIN FUNCTION
@@ -39,6 +79,9 @@ int main(int argc, char *argv[]) {
   setbuf(stdout, NULL);
   setbuf(stderr, NULL);
 
+  // A peer that goes away mid-write is handled where the write fails
+  signal(SIGPIPE, SIG_IGN);
+
   // Initialize Redis configuration
   RedisStats *stats = init_redis_stats();
 
@@ -46,10 +89,27 @@ int main(int argc, char *argv[]) {
                                   {"dbfilename", required_argument, 0, 'f'},
                                   {"port", required_argument, 0, 'p'},
                                   {"replicaof", required_argument, 0, 'r'},
+                                  {"hash-function", required_argument, 0, 'h'},
+                                  {"client-output-buffer-limit", required_argument, 0, 'o'},
+                                  {"io-threads", required_argument, 0, 't'},
+                                  {"shards", required_argument, 0, 's'},
+                                  {"event-loop", required_argument, 0, 'e'},
+                                  {"tcp-backlog", required_argument, 0, 'b'},
+                                  {"tcp-keepalive", required_argument, 0, 'k'},
+                                  {"tcp-nodelay", required_argument, 0, 'n'},
+                                  {"unixsocket", required_argument, 0, 'u'},
+                                  {"unixsocketperm", required_argument, 0, 'm'},
+                                  {"hz", required_argument, 0, 'z'},
+                                  {"timeout", required_argument, 0, 'i'},
+                                  {"maxclients", required_argument, 0, 'c'},
                                   {0, 0, 0, 0}};
 
   int opt;
   int option_index = 0;
+  HashFunction hash_function = HASH_WYHASH;
+  int io_threads = 1;
+  int shards = 1;
+  EventLoopBackend event_loop = EVENT_LOOP_EPOLL;
 
   // Loop to process options
   while ((opt = getopt_long(argc, argv, "d:f:", long_options, &option_index)) !=
@@ -87,13 +147,135 @@ int main(int argc, char *argv[]) {
       }
       break;
     }
+    case 'h':
+      if (hash_function_from_name(optarg, &hash_function) != 0) {
+        exit_with_error("Invalid hash-function, expected wyhash, siphash or fnv1a");
+      }
+      break;
+    case 'o':
+      if (client_set_output_buffer_limit(optarg) != 0) {
+        exit_with_error("Invalid client-output-buffer-limit, expected "
+                        "<normal|replica> <hard> <soft> <seconds>");
+      }
+      break;
+    case 't':
+      io_threads = atoi(optarg);
+      if (io_threads < 1 || io_threads > IO_THREADS_MAX) {
+        exit_with_error("Invalid io-threads, expected 1 to 64");
+      }
+      break;
+    case 's':
+      shards = atoi(optarg);
+      if (shards < 1 || shards > SHARDS_MAX) {
+        exit_with_error("Invalid shards, expected 1 to 64");
+      }
+      break;
+    case 'b':
+      stats->server.tcp_backlog = atoi(optarg);
+      if (stats->server.tcp_backlog < 1) {
+        exit_with_error("Invalid tcp-backlog, expected a positive number");
+      }
+      break;
+    case 'k':
+      stats->server.tcp_keepalive = atoi(optarg);
+      if (stats->server.tcp_keepalive < 0) {
+        exit_with_error("Invalid tcp-keepalive, expected seconds or 0 to disable");
+      }
+      break;
+    case 'n':
+      if (strcasecmp(optarg, "yes") == 0) {
+        stats->server.tcp_nodelay = 1;
+      } else if (strcasecmp(optarg, "no") == 0) {
+        stats->server.tcp_nodelay = 0;
+      } else {
+        exit_with_error("Invalid tcp-nodelay, expected yes or no");
+      }
+      break;
+    case 'u':
+      if (strlen(optarg) >= sizeof(stats->server.unixsocket)) {
+        exit_with_error("Invalid unixsocket, the path is too long");
+      }
+      strcpy(stats->server.unixsocket, optarg);
+      break;
+    case 'm': {
+      // Octal, like chmod and the Redis option
+      char *end;
+      long perm = strtol(optarg, &end, 8);
+      if (*optarg == '\0' || *end != '\0' || perm < 0 || perm > 0777) {
+        exit_with_error("Invalid unixsocketperm, expected an octal mode such as 700");
+      }
+      stats->server.unixsocketperm = (int)perm;
+      break;
+    }
+    case 'z':
+      stats->server.hz = atoi(optarg);
+      if (stats->server.hz < 1 || stats->server.hz > TIMER_MAX_HZ) {
+        exit_with_error("Invalid hz, expected 1 to 500");
+      }
+      break;
+    case 'i':
+      stats->server.client_timeout = atoi(optarg);
+      if (stats->server.client_timeout < 0) {
+        exit_with_error("Invalid timeout, expected seconds or 0 to disable");
+      }
+      break;
+    case 'c': {
+      long maxclients = atol(optarg);
+      if (maxclients < 1) {
+        exit_with_error("Invalid maxclients, expected a positive number");
+      }
+      stats->clients.maxclients = maxclients;
+      break;
+    }
+    case 'e':
+      if (event_loop_backend_from_name(optarg, &event_loop) != 0) {
+        exit_with_error("Invalid event-loop, expected epoll or io_uring");
+      }
+      break;
     default:
       break;
     }
   }
 
+  // Each shard does its own I/O, and replication works on one keyspace
+  if (shards > 1 && io_threads > 1) {
+    exit_with_error("shards and io-threads can't be combined");
+  }
+  if (shards > 1 && stats->replication.role == ROLE_SLAVE) {
+    exit_with_error("shards can't be used on a replica");
+  }
+  // io_uring does the reads and writes itself, and the replica's handshake
+  // reads the master socket directly
+  if (event_loop == EVENT_LOOP_IO_URING && io_threads > 1) {
+    exit_with_error("io_uring and io-threads can't be combined");
+  }
+  if (event_loop == EVENT_LOOP_IO_URING && stats->replication.role == ROLE_SLAVE) {
+    exit_with_error("io_uring can't be used on a replica");
+  }
+  adjust_open_files_limit(stats);
+  reply_shared_init();
+  if (commands_init() != 0) {
+    exit_with_error("Failed to build the command table");
+  }
+  if (event_loop_init(event_loop) != 0) {
+    printf("io_uring is not available, falling back to epoll\n");
+  }
+  if (io_threads_init(io_threads) != 0) {
+    exit_with_error("Failed to start the I/O threads");
+  }
+  if (shards_init(shards) != 0) {
+    exit_with_error("Failed to set up the shards");
+  }
+
+  // Has to happen before anything is hashed, the RDB load included
+  if (hash_init(hash_function) != 0) {
+    printf("No random seed available, falling back to a weaker hash seed\n");
+  }
+
   if (stats->replication.role == ROLE_SLAVE) {
     run_replica(stats);
+  } else if (shard_count() > 1) {
+    run_shards(stats);
   } else {
     run_server(stats);
   }
@@ -101,21 +283,88 @@ int main(int argc, char *argv[]) {
   return 0;
 }
 
+// Every client takes an fd. Like Redis, raise the open files limit to fit
+// maxclients, or lower maxclients to what the system lets us have.
+void adjust_open_files_limit(RedisStats *stats) {
+  rlim_t wanted = stats->clients.maxclients + RESERVED_FDS;
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur >= wanted)
+    return;
+
+  limit.rlim_cur = limit.rlim_max != RLIM_INFINITY && limit.rlim_max < wanted ? limit.rlim_max
+                                                                               : wanted;
+  if (setrlimit(RLIMIT_NOFILE, &limit) != 0 && getrlimit(RLIMIT_NOFILE, &limit) != 0)
+    return;
+  if (limit.rlim_cur >= wanted)
+    return;
+
+  if (limit.rlim_cur <= RESERVED_FDS) {
+    exit_with_error("The open files limit is too low to serve any client");
+  }
+  printf("WARNING: maxclients lowered from %lu to %lu to fit the open files limit of %lu\n",
+         stats->clients.maxclients, (uint64_t)(limit.rlim_cur - RESERVED_FDS),
+         (uint64_t)limit.rlim_cur);
+  stats->clients.maxclients = limit.rlim_cur - RESERVED_FDS;
+}
+
 int setup_server_socket(RedisStats *stats) {
   int server_fd = create_server_socket();
   int reuse = 1;
+  // Every shard binds the port, and the kernel balances between them
+  if (shard_count() > 1 &&
+      setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+    exit_with_error("SO_REUSEPORT failed");
+  }
   bind_to_port(server_fd, INADDR_ANY, stats->server.tcp_port, reuse);
   if (set_non_blocking(server_fd, 0) < 0) {
     exit_with_error("Failed to set non-blocking mode");
   }
-  if (listen(server_fd, 10) != 0) {
+  // The kernel silently caps the backlog at somaxconn
+  FILE *somaxconn = fopen("/proc/sys/net/core/somaxconn", "r");
+  int max_backlog;
+  if (somaxconn != NULL) {
+    if (fscanf(somaxconn, "%d", &max_backlog) == 1 && max_backlog < stats->server.tcp_backlog) {
+      printf("WARNING: tcp-backlog %d is above net.core.somaxconn %d, which caps it\n",
+             stats->server.tcp_backlog, max_backlog);
+    }
+    fclose(somaxconn);
+  }
+  if (listen(server_fd, stats->server.tcp_backlog) != 0) {
     exit_with_error("Listen failed");
   }
   return server_fd;
 }
 
-void run_server(RedisStats *stats) {
-  ht_table *ht = ht_create();
+// Served alongside TCP by the same event loop, for clients on this host
+// that can skip the TCP stack. Returns -1 if no unixsocket is configured.
+int setup_unix_socket(RedisStats *stats) {
+  if (stats->server.unixsocket[0] == '\0')
+    return -1;
+
+  int unix_fd = create_unix_server_socket();
+  if (unix_fd < 0) {
+    exit_with_error("Failed to create the unix socket");
+  }
+  bind_to_unix_path(unix_fd, stats->server.unixsocket);
+  if (stats->server.unixsocketperm != 0 &&
+      chmod(stats->server.unixsocket, stats->server.unixsocketperm) != 0) {
+    exit_with_error("Failed to set the unix socket permissions");
+  }
+  if (set_non_blocking(unix_fd, 0) < 0) {
+    exit_with_error("Failed to set non-blocking mode");
+  }
+  if (listen(unix_fd, stats->server.tcp_backlog) != 0) {
+    exit_with_error("Listen failed");
+  }
+  printf("Listening on unix socket %s\n", stats->server.unixsocket);
+  return unix_fd;
+}
+
+Keyspace *load_keyspace(RedisStats *stats) {
+  Keyspace *keyspace = keyspace_create();
+  if (keyspace == NULL) {
+    exit_with_error("Failed to create keyspace");
+  }
 
   if (stats->others.rdb_filename[0] != '\0' &&
       stats->others.rdb_dir[0] != '\0') {
@@ -124,40 +373,111 @@ void run_server(RedisStats *stats) {
     sprintf(rdb_path, "%s/%s", stats->others.rdb_dir,
             stats->others.rdb_filename);
     printf("Loading RDB file from path: %s\n", rdb_path);
-    load_from_rdb_file(ht, rdb_path);
+    load_from_rdb_file(keyspace, rdb_path);
     free(rdb_path);
   }
+  return keyspace;
+}
+
+void run_server(RedisStats *stats) {
+  Keyspace *keyspace = load_keyspace(stats);
 
   int server_fd = setup_server_socket(stats);
   if (server_fd < 0) {
     exit_with_error("Failed to create server socket");
   }
-  int epoll_fd = epoll_create(1);
+  int unix_fd = setup_unix_socket(stats);
+  EventLoop *loop = setup_event_loop(server_fd, unix_fd);
+
+  printf("Event loop: %s\n", event_loop_backend_name());
+  run_main_loop(stats, loop, server_fd, unix_fd, keyspace);
+  keyspace_destroy(keyspace);
+};
 
-  if (epoll_fd < 0) {
-    exit_with_error("Failed to create epoll instance");
+EventLoop *setup_event_loop(int server_fd, int unix_fd) {
+  EventLoop *loop = event_loop_create();
+  if (loop == NULL) {
+    exit_with_error("Failed to create the event loop");
+  }
+  if (event_loop_add(loop, server_fd, EVENT_READABLE | EVENT_ACCEPT) != 0) {
+    exit_with_error("Failed to watch the server socket");
   }
+  if (unix_fd >= 0 && event_loop_add(loop, unix_fd, EVENT_READABLE | EVENT_ACCEPT) != 0) {
+    exit_with_error("Failed to watch the unix socket");
+  }
+  return loop;
+}
 
-  epoll_ctl_add(epoll_fd, server_fd, EPOLLIN | EPOLLET | EPOLLOUT);
+// Every shard is a server of its own: its own thread, listening socket,
+// event loop and part of the keyspace. The kernel spreads connections over
+// the listening sockets, and commands go to the shard owning their key.
+// Unix sockets can't be balanced with SO_REUSEPORT, so there is one that
+// every shard accepts from, whichever gets to a connection first.
+void run_shards(RedisStats *stats) {
+  int count = shard_count();
+  ShardArgs args[SHARDS_MAX];
 
-  run_main_loop(stats, epoll_fd, server_fd, ht);
-  ht_destroy(ht);
-};
+  Keyspace *loaded = load_keyspace(stats);
+  int unix_fd = setup_unix_socket(stats);
+  for (int i = 0; i < count; i++) {
+    args[i].id = i;
+    args[i].unix_fd = unix_fd;
+    args[i].keyspace = keyspace_create();
+    // Stats are per shard, only the configuration is shared
+    args[i].stats = i == 0 ? stats : init_redis_stats();
+    if (args[i].keyspace == NULL || args[i].stats == NULL) {
+      exit_with_error("Failed to create a shard");
+    }
+    args[i].stats->server = stats->server;
+    args[i].stats->clients.maxclients = stats->clients.maxclients;
+    memcpy(args[i].stats->others.rdb_dir, stats->others.rdb_dir, sizeof(stats->others.rdb_dir));
+    memcpy(args[i].stats->others.rdb_filename, stats->others.rdb_filename,
+           sizeof(stats->others.rdb_filename));
+  }
+  Keyspace *keyspaces[SHARDS_MAX];
+  for (int i = 0; i < count; i++)
+    keyspaces[i] = args[i].keyspace;
+  if (shard_split_keyspace(loaded, keyspaces) != 0) {
+    exit_with_error("Failed to split the keyspace over the shards");
+  }
+  keyspace_destroy(loaded);
+
+  for (int i = 1; i < count; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_shard, &args[i]) != 0) {
+      exit_with_error("Failed to start a shard");
+    }
+  }
+  printf("Serving with %d shards, event loop: %s\n", count, event_loop_backend_name());
+  run_shard(&args[0]);
+}
+
+void *run_shard(void *arg) {
+  ShardArgs *shard = arg;
+  shard_attach(shard->id);
+
+  int server_fd = setup_server_socket(shard->stats);
+  EventLoop *loop = setup_event_loop(server_fd, shard->unix_fd);
+  if (event_loop_add(loop, shard_wakeup_fd(), EVENT_READABLE) != 0) {
+    exit_with_error("Failed to watch the shard wakeup fd");
+  }
+
+  run_main_loop(shard->stats, loop, server_fd, shard->unix_fd, shard->keyspace);
+  return NULL;
+}
 
 void run_replica(RedisStats *stats) {
-  ht_table *ht = ht_create();
+  Keyspace *keyspace = keyspace_create();
+  if (keyspace == NULL) {
+    exit_with_error("Failed to create keyspace");
+  }
   int server_fd = setup_server_socket(stats);
   if (server_fd < 0) {
     exit_with_error("Failed to create server socket");
   }
+  int unix_fd = setup_unix_socket(stats);
 
-  int epoll_fd = epoll_create(1);
-
-  if (epoll_fd < 0) {
-    exit_with_error("Failed to create epoll instance");
-  }
-
-  epoll_ctl_add(epoll_fd, server_fd, EPOLLIN | EPOLLET | EPOLLOUT);
+  EventLoop *loop = setup_event_loop(server_fd, unix_fd);
 
   int master_fd = connect_to_master(stats->replication.master_host,
                                     stats->replication.master_port);
@@ -166,197 +486,545 @@ void run_replica(RedisStats *stats) {
   }
   
   // Set non-blocking mode from the start
-  set_non_blocking(master_fd, 1);
+  set_non_blocking(master_fd, 0);
   stats->replication.master_fd = master_fd;
+
+  Client *master = client_create(master_fd);
+  if (master == NULL) {
+    exit_with_error("Failed to allocate the master client");
+  }
+  master->flags |= CLIENT_MASTER;
   
-  // Add master to epoll for event-driven handling before starting handshake
-  epoll_ctl_add(epoll_fd, stats->replication.master_fd,
-                EPOLLIN | EPOLLET | EPOLLRDHUP | EPOLLHUP);
+  // Watch the master for event-driven handling before starting handshake
+  if (event_loop_add(loop, stats->replication.master_fd, EVENT_READABLE) != 0) {
+    exit_with_error("Failed to watch the master connection");
+  }
 
   printf("Connected to master. Handshake will be handled in event loop...\n");
   
   // Initiate the first step of the handshake
   handle_handshake_step(stats);
 
-  run_replica_main_loop(stats, epoll_fd, server_fd, ht);
-  ht_destroy(ht);
-  close(master_fd);
+  run_replica_main_loop(stats, loop, server_fd, unix_fd, keyspace);
+  keyspace_destroy(keyspace);
 };
 
-void run_main_loop(RedisStats *stats, int epoll_fd, int server_fd,
-                   ht_table *ht) {
-  int readable = 0;
-  char buf[MAX_BUFFER_SIZE];
-  const int MAX_EVENTS = 10;
-  struct epoll_event events[MAX_EVENTS];
-  int connection_fd;
-  struct sockaddr_in client_addr;
-  int client_addr_len = sizeof(client_addr);
-  int epoll_timeout;
+void run_main_loop(RedisStats *stats, EventLoop *loop, int server_fd, int unix_fd,
+                   Keyspace *keyspace) {
+  int fired = 0;
+  const int MAX_EVENTS = 1024;
+  FiredEvent events[MAX_EVENTS];
+  int timeout_ms;
+
+  if (timer_add(0, server_cron, keyspace) == NULL) {
+    exit_with_error("Failed to schedule serverCron");
+  }
+  if (stats->server.client_timeout > 0 &&
+      timer_add(stats->server.client_timeout * 1000ULL, close_idle_clients, NULL) == NULL) {
+    exit_with_error("Failed to schedule the idle client check");
+  }
 
   while (1) {
-    epoll_timeout = -1;
-    if (stats->others.waiting_clients->len > 0) {
-      epoll_timeout = 100;
-      // Process the number of slaves that have sent their offset
-      WaitingClientInfo* waiting_client;
-      Node *current_waiting_client = stats->others.waiting_clients->head;
-      Node *next_waiting_client;
-
-      while (current_waiting_client != NULL && stats->others.waiting_clients->len > 0) {
-        waiting_client = (WaitingClientInfo *)(current_waiting_client->data);
-        // Save next node before potential deletion
-        next_waiting_client = current_waiting_client->next;
-        
-        // Check how many replicas have acknowledged the required offset
-        uint64_t replica_ok_count = check_replica_acknowledgments(stats, stats->server.offset);
-        
-        if (waiting_client->expiry <= get_current_epoch_ms() || replica_ok_count >= waiting_client->minimum_replica_count) {
-          respond_to_waiting_client(waiting_client->connection_fd, replica_ok_count);
-          delete_node(stats->others.waiting_clients, current_waiting_client);
-        } 
-        current_waiting_client = next_waiting_client;
-      }
+    timer_run_due(stats);
+
+    // The ACKs read last iteration may be enough for some WAITs
+    if (stats->others.replicas_acked) {
+      stats->others.replicas_acked = 0;
+      replication_unblock_waiting_clients(stats);
     }
 
-    readable = epoll_wait(epoll_fd, events, MAX_EVENTS, epoll_timeout);
+    // Sleep until the next timer at most
+    timeout_ms = timer_next_timeout();
+
+    // Keep migrating a resizing table in the background so the cost isn't
+    // only paid by the commands that happen to touch it.
+    if (keyspace_is_rehashing(keyspace)) {
+      keyspace_rehash_milliseconds(keyspace, 1);
+      if (keyspace_is_rehashing(keyspace))
+        timeout_ms = 0;
+    }
 
-    for (int i = 0; i < readable; i++) {
+    // Everything this iteration replied or propagated goes out now, one
+    // writev per client
+    handle_pending_writes(loop, stats);
+
+    // Same for what is on its way to other shards
+    if (shard_count() > 1 && shard_flush_outbox() != 0)
+      timeout_ms = 0;
+
+    fired = event_loop_wait(loop, events, MAX_EVENTS, timeout_ms);
+    if (fired < 0) {
+      exit_with_error("Event loop failed");
+    }
+
+    // Readable clients are collected first so their reads and parsing can
+    // be spread over the I/O threads
+    Client *read_clients[MAX_EVENTS];
+    size_t read_count = 0;
+
+    for (int i = 0; i < fired; i++) {
       // For main server connection
-      if (events[i].data.fd == server_fd) {
-        handle_new_client_connection(server_fd, epoll_fd);
-      } else if (events[i].events & EPOLLIN) {
-        connection_fd = events[i].data.fd;
-        memset(buf, 0, sizeof(buf));
-
-        // This currently makes the assumption that the buffer is large enough
-        // to hold the entire message and all the message can be read in one go.
-        // You would want to handle partial reads and
-        // buffer the data accordingly.
-        int bytes_read = read_in(connection_fd, buf, sizeof(buf));
-        if (bytes_read < 0)
-          continue;
-
-        char *raw_buffer = buf;
-        RESPData *parsed_buffer = parse_resp_buffer(&raw_buffer);
-        // process_command(connection_fd, parsed_buffer, buf, ht, stats);
-        process_commands_in_buffer(connection_fd, ht, stats, buf, bytes_read);
-        free_resp_data(parsed_buffer);
-        free(parsed_buffer);
-      } else {
-        printf("Unknown event: %d\n", events[i].events);
+      if (events[i].fd == server_fd || events[i].fd == unix_fd) {
+        handle_new_client_connection(loop, events[i].fd, events[i].fd == server_fd, &events[i],
+                                     stats);
+        continue;
       }
-
-      if (events[i].events & (EPOLLRDHUP | EPOLLHUP)) {
-        // For now, just close the connection
-        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
-        close(events[i].data.fd);
-        printf("Connection kill timestamp: %llu\n", get_current_epoch_ms());
+      if (events[i].fd == shard_wakeup_fd()) {
+        shard_process_inbox(keyspace, stats);
         continue;
       }
+      handle_client_event(loop, &events[i], read_clients, &read_count, stats);
     }
+
+    handle_readable_clients(read_clients, read_count, loop, keyspace, stats);
+    handle_unblocked_clients(loop, keyspace, stats);
   }
 }
 
-void run_replica_main_loop(RedisStats *stats, int epoll_fd, int server_fd,
-                           ht_table *ht) {
-  int readable = 0;
-  const int MAX_EVENTS = 32;
-  struct epoll_event events[MAX_EVENTS];
+void run_replica_main_loop(RedisStats *stats, EventLoop *loop, int server_fd, int unix_fd,
+                           Keyspace *keyspace) {
+  int fired = 0;
+  const int MAX_EVENTS = 1024;
+  FiredEvent events[MAX_EVENTS];
+
+  if (stats->server.client_timeout > 0 &&
+      timer_add(stats->server.client_timeout * 1000ULL, close_idle_clients, NULL) == NULL) {
+    exit_with_error("Failed to schedule the idle client check");
+  }
 
   while (1) {
-    readable = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
-
-    for (int i = 0; i < readable; i++) {
-      if (events[i].data.fd == server_fd) {
-        handle_new_client_connection(server_fd, epoll_fd);
-      } 
-      else if (events[i].data.fd == stats->replication.master_fd && 
-               (events[i].events & EPOLLIN)) {
-        handle_master_data(events[i].data.fd, ht, stats);
-      } 
-      else if (events[i].events & EPOLLIN) {
-        handle_client_request(events[i].data.fd, ht, stats);
+    timer_run_due(stats);
+    int timeout_ms = timer_next_timeout();
+    if (keyspace_is_rehashing(keyspace)) {
+      keyspace_rehash_milliseconds(keyspace, 1);
+      if (keyspace_is_rehashing(keyspace))
+        timeout_ms = 0;
+    }
+
+    // Everything this iteration replied or propagated goes out now, one
+    // writev per client
+    handle_pending_writes(loop, stats);
+
+    fired = event_loop_wait(loop, events, MAX_EVENTS, timeout_ms);
+    if (fired < 0) {
+      exit_with_error("Event loop failed");
+    }
+
+    Client *read_clients[MAX_EVENTS];
+    size_t read_count = 0;
+
+    for (int i = 0; i < fired; i++) {
+      if (events[i].fd == server_fd || events[i].fd == unix_fd) {
+        handle_new_client_connection(loop, events[i].fd, events[i].fd == server_fd, &events[i],
+                                     stats);
+        continue;
       }
-      else {
-        printf("Unknown event type: %d\n", events[i].events);
+
+      // The master stream goes through the handshake and RDB stages, so it
+      // is always handled here on the main thread
+      Client *c = client_lookup(events[i].fd);
+      if (c == NULL || !(c->flags & CLIENT_MASTER)) {
+        handle_client_event(loop, &events[i], read_clients, &read_count, stats);
+        continue;
       }
 
-      if (events[i].events & (EPOLLRDHUP | EPOLLHUP)) {
-        if (events[i].data.fd == stats->replication.master_fd) {
-          printf("Master connection lost\n");
-        }
-        
-        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
-        close(events[i].data.fd);
+      if (events[i].mask & EVENT_WRITABLE) {
+        client_mark_pending_write(c);
+      }
+      if (events[i].mask & EVENT_HANGUP) {
+        c->flags |= CLIENT_CLOSE_ASAP;
+      }
+      if (events[i].mask & EVENT_READABLE) {
+        handle_master_data(c, keyspace, stats);
+      }
+      if (c->flags & CLIENT_CLOSE_ASAP) {
+        printf("Master connection lost\n");
+        close_client_connection(c, loop, stats);
       }
     }
+
+    handle_readable_clients(read_clients, read_count, loop, keyspace, stats);
   }
 }
 
+// Background work run hz times a second on every thread with a keyspace.
+// Replicas leave expiring keys to their master.
+long server_cron(RedisStats *stats, void *privdata) {
+  Keyspace *keyspace = privdata;
+  long period_ms = 1000 / stats->server.hz;
+
+  // Reclaim keys with a TTL that nobody reads anymore
+  if (stats->replication.role != ROLE_SLAVE && keyspace_expires_count(keyspace) > 0)
+    active_expire_cycle(keyspace, stats, period_ms);
+
+  return period_ms;
+}
+
 // Helper functions for replica main loop
-void handle_new_client_connection(int server_fd, int epoll_fd) {
-  struct sockaddr_in client_addr;
-  int client_addr_len = sizeof(client_addr);
-  
-  int connection_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_addr_len);
-  if (connection_fd < 0) {
-    exit_with_error("Failed to accept connection");
+// The listening socket is edge triggered, so one event can stand for any
+// number of queued connections and all of them are taken until EAGAIN.
+// Anything left behind would wait for the next connection to raise an edge.
+// tcp is 0 for the unix socket.
+void handle_new_client_connection(EventLoop *loop, int server_fd, int tcp, FiredEvent *event,
+                                  RedisStats *stats) {
+  uint64_t accepted = 0;
+
+  if (event->mask & EVENT_ACCEPT) {
+    // The event loop already accepted it
+    accept_client(loop, event->accepted, tcp, stats);
+    accepted = 1;
+  } else {
+    while (1) {
+      int connection_fd = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (connection_fd >= 0) {
+        accept_client(loop, connection_fd, tcp, stats);
+        accepted++;
+        continue;
+      }
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        // Out of fds or memory. What is still queued gets another go on
+        // the next connection's edge.
+        error("Failed to accept connection");
+        stats->stats.rejected_connections++;
+      }
+      break;
+    }
+  }
+
+  if (accepted > stats->stats.max_accepts_per_event)
+    stats->stats.max_accepts_per_event = accepted;
+
+  // Counted per wall clock second, INFO reports the last full one
+  uint64_t second = get_current_epoch_ms() / 1000;
+  if (second != stats->stats.accept_second) {
+    stats->stats.accepts_last_second =
+        second == stats->stats.accept_second + 1 ? stats->stats.accepts_this_second : 0;
+    stats->stats.accepts_this_second = 0;
+    stats->stats.accept_second = second;
+  }
+  stats->stats.accepts_this_second += accepted;
+}
+
+// Set up a freshly accepted, non-blocking connection
+void accept_client(EventLoop *loop, int connection_fd, int tcp, RedisStats *stats) {
+  // Like Redis, the client is told why before it is dropped. The socket
+  // is new, so the error fits in it.
+  if (client_count() >= stats->clients.maxclients) {
+    static const char err[] = "-ERR max number of clients reached\r\n";
+    send(connection_fd, err, sizeof(err) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+    stats->stats.rejected_connections++;
+    close(connection_fd);
+    return;
+  }
+
+  if (client_create(connection_fd) == NULL) {
+    printf("Failed to allocate a client, dropping the connection\n");
+    stats->stats.rejected_connections++;
+    close(connection_fd);
+    return;
+  }
+  stats->clients.total_connections_received++;
+
+  // Replies can leave in more than one write, e.g. when a shard answers
+  // after the local commands did. Nagle would hold the later ones until the
+  // client ACKs, and clients delay their ACKs.
+  if (tcp && stats->server.tcp_nodelay)
+    set_tcp_nodelay(connection_fd);
+  if (tcp && stats->server.tcp_keepalive > 0)
+    set_tcp_keepalive(connection_fd, stats->server.tcp_keepalive);
+
+  if (event_loop_add(loop, connection_fd, EVENT_READABLE | EVENT_DATA) != 0) {
+    printf("Failed to watch the connection, dropping it\n");
+    stats->stats.rejected_connections++;
+    client_free(client_lookup(connection_fd));
+    return;
   }
-  
-  set_non_blocking(connection_fd, 1);
-  epoll_ctl_add(epoll_fd, connection_fd, EPOLLIN | EPOLLET | EPOLLRDHUP | EPOLLHUP);
   printf("Accepted new client connection\n");
 }
 
-void handle_master_data(int connection_fd, ht_table *ht, RedisStats *stats) {
-  char buf[MAX_BUFFER_SIZE] = {0};
+// Close clients that sent and received nothing for client_timeout seconds.
+// The idle list is ordered by last interaction, so only the clients that
+// are due get looked at, and the timer comes back when the next one is.
+// Replicas, the master and clients waiting on WAIT or another shard are
+// never idle; they go to the back as if they had just been active.
+long close_idle_clients(RedisStats *stats, void *privdata) {
+  (void)privdata;
+  uint64_t limit_ms = stats->server.client_timeout * 1000ULL;
+  uint64_t now = timer_now_ms();
+  Client *c;
+
+  while ((c = client_most_idle()) != NULL) {
+    uint64_t idle_ms = now - c->last_interaction;
+    if (idle_ms < limit_ms)
+      return limit_ms - idle_ms;
 
-  const int bytes_read = read_in_non_blocking(connection_fd, buf, sizeof(buf));
-  int remaining_buffer_size = bytes_read;
-  if (bytes_read <= 0) {
-    if (bytes_read < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-      perror("Error reading from master");
+    if (!(c->flags & (CLIENT_MASTER | CLIENT_REPLICA | CLIENT_CLOSE_ASAP)) &&
+        c->waiting_acks == 0 && c->shard_calls_count == 0) {
+      // Closed by the next flush, like any other client marked CLOSE_ASAP
+      printf("Closing idle client %d\n", c->fd);
+      c->flags |= CLIENT_CLOSE_ASAP;
+      client_mark_pending_write(c);
     }
+    client_touch(c, now);
+  }
+  return limit_ms;
+}
+
+// What happened on a normal client's connection. Clients with something
+// to read are queued once per iteration, even when io_uring hands over
+// their input in more than one piece.
+void handle_client_event(EventLoop *loop, FiredEvent *event, Client **read_clients,
+                         size_t *read_count, RedisStats *stats) {
+  Client *c = client_lookup(event->fd);
+  if (c == NULL) {
+    printf("Event for unknown connection %d\n", event->fd);
     return;
   }
-  
-  int handshake_offset = 0;
-  if (stats->replication.handshake_state != HANDSHAKE_COMPLETED && 
-      !stats->others.is_replication_completed) {
-    // handshake_offset = initiative_handshake(stats, buf, bytes_read);
-    handshake_offset = handle_handshake_response(stats, buf, bytes_read);
+
+  if (event->mask & EVENT_WRITABLE) {
+    // Room in the socket again, the rest goes with the next flush
+    client_mark_pending_write(c);
+  }
+  if (event->mask & EVENT_HANGUP) {
+    c->flags |= CLIENT_CLOSE_ASAP;
+  }
+  if ((event->mask & EVENT_DATA) && event->len > 0 &&
+      client_append_input(c, event->data, event->len) != 0) {
+    c->flags |= CLIENT_CLOSE_ASAP;
+  }
+
+  if ((event->mask & EVENT_READABLE) && !(c->flags & CLIENT_PENDING_READ)) {
+    c->flags |= CLIENT_PENDING_READ;
+    read_clients[(*read_count)++] = c;
+  } else if ((c->flags & CLIENT_CLOSE_ASAP) && !(c->flags & CLIENT_PENDING_READ)) {
+    close_client_connection(c, loop, stats);
+  }
+}
+
+// The master stream is the handshake replies, then the RDB payload, then
+// the commands to apply. Each stage consumes what it understood from the
+// query buffer and leaves the rest for the next stage or the next read.
+void handle_master_data(Client *c, Keyspace *keyspace, RedisStats *stats) {
+  if (client_read(c) < 0) {
+    c->flags |= CLIENT_CLOSE_ASAP;
+  }
+
+  if (stats->replication.handshake_state != HANDSHAKE_COMPLETED &&
+      !stats->others.is_replication_completed && c->qb_pos < sdslen(c->querybuf)) {
+    int handshake_offset = handle_handshake_response(stats, c->querybuf + c->qb_pos,
+                                                     sdslen(c->querybuf) - c->qb_pos);
     printf("Handshake offset: %d\n", handshake_offset);
     if (handshake_offset < 0) {
+      // Nothing but the reply to the current handshake step
+      c->qb_pos = sdslen(c->querybuf);
+      client_trim_query_buffer(c);
       return;
     }
+    c->qb_pos += handshake_offset;
   }
 
-  char* remaining_buffer = buf + handshake_offset;
-  printf("Remaining RDB buffer: %s\n", remaining_buffer);
-  remaining_buffer_size = bytes_read - handshake_offset;
-  int rdb_offset = 0;
-  if (!stats->others.is_replication_completed) {
-    rdb_offset = process_rdb_data(stats, remaining_buffer, remaining_buffer_size);
+  if (!stats->others.is_replication_completed && c->qb_pos < sdslen(c->querybuf)) {
+    int rdb_offset = process_rdb_data(stats, c->querybuf + c->qb_pos,
+                                      sdslen(c->querybuf) - c->qb_pos);
     if (rdb_offset < 0) {
-      // offset >= 0 means there are commands to process after the RDB data
-      // Process commands starting from the specified offset
+      // Either the whole buffer was the RDB payload, or only part of it has
+      // arrived and the buffer is kept until the rest does
+      if (stats->others.is_replication_completed)
+        c->qb_pos = sdslen(c->querybuf);
+      client_trim_query_buffer(c);
       return;
     }
+    c->qb_pos += rdb_offset;
   }
 
-  char *command_buf = remaining_buffer + rdb_offset;
-  remaining_buffer_size = remaining_buffer_size - rdb_offset;
-  process_commands_in_buffer(connection_fd, ht, stats, command_buf, remaining_buffer_size);
+  process_commands_in_buffer(c, keyspace, stats);
+  client_trim_query_buffer(c);
 }
 
-void handle_client_request(int connection_fd, ht_table *ht, RedisStats *stats) {
-  char buf[MAX_BUFFER_SIZE] = {0};
+// Read and parse every client of the batch, on the I/O threads when there
+// are enough of them, then execute what was parsed here on the main thread.
+// A client that failed to read still gets to run whatever arrived before
+// the error or EOF.
+void handle_readable_clients(Client **clients, size_t count, EventLoop *loop,
+                             Keyspace *keyspace, RedisStats *stats) {
+  if (event_loop_backend(loop) == EVENT_LOOP_IO_URING) {
+    // The input is already in the query buffers
+    for (size_t i = 0; i < count; i++)
+      parse_commands_in_buffer(clients[i]);
+  } else {
+    io_threads_read(clients, count);
+  }
 
-  const int bytes_read = read_in_non_blocking(connection_fd, buf, sizeof(buf));
-  if (bytes_read <= 0) {
-    return;
+  uint64_t now = timer_now_ms();
+  for (size_t i = 0; i < count; i++) {
+    Client *c = clients[i];
+    c->flags &= ~CLIENT_PENDING_READ;
+    client_touch(c, now);
+    execute_parsed_commands(c, keyspace, stats);
+    client_trim_query_buffer(c);
+    if (c->flags & CLIENT_CLOSE_ASAP) {
+      close_client_connection(c, loop, stats);
+    }
   }
+}
 
-  process_commands_in_buffer(connection_fd, ht, stats, buf, bytes_read);
+// Clients that had too many commands out on other shards, and got enough
+// replies back to go on with the ones they sent after them
+void handle_unblocked_clients(EventLoop *loop, Keyspace *keyspace, RedisStats *stats) {
+  Client *c;
+  while ((c = shard_next_unblocked()) != NULL) {
+    process_commands_in_buffer(c, keyspace, stats);
+    client_trim_query_buffer(c);
+    if (c->flags & CLIENT_CLOSE_ASAP) {
+      close_client_connection(c, loop, stats);
+    }
+  }
+}
+
+void close_client_connection(Client *c, EventLoop *loop, RedisStats *stats) {
+  event_loop_delete(loop, c->fd);
+  shard_forget_client(c);
+  if (c->waiting_acks > 0)
+    replication_forget_waiting_client(stats, c->fd);
+
+  // A replica that goes away must not be written to again
+  if (c->flags & CLIENT_REPLICA) {
+    Node *node = stats->others.connected_slaves->head;
+    while (node != NULL) {
+      ReplicaInfo *replica = (ReplicaInfo *)(node->data);
+      if (replica->connection_fd == c->fd) {
+        delete_node(stats->others.connected_slaves, node);
+        free(replica);
+        break;
+      }
+      node = node->next;
+    }
+  }
+
+  client_free(c);
+}
+
+void handle_pending_writes(EventLoop *loop, RedisStats *stats) {
+  // One batch per shard thread
+  static _Thread_local Client **clients = NULL;
+  static _Thread_local size_t capacity = 0;
+  size_t count = 0;
+  uint64_t now = get_current_epoch_ms();
+  uint64_t interaction = timer_now_ms();
+  Client *c;
+
+  while ((c = client_next_pending_write()) != NULL) {
+    if (count == capacity) {
+      size_t new_capacity = capacity ? capacity * 2 : 64;
+      Client **grown = realloc(clients, new_capacity * sizeof(Client *));
+      if (grown == NULL) {
+        // Same as failing to mark it pending, it could never be flushed
+        close_client_connection(c, loop, stats);
+        continue;
+      }
+      clients = grown;
+      capacity = new_capacity;
+    }
+    clients[count++] = c;
+  }
+
+  if (event_loop_backend(loop) == EVENT_LOOP_IO_URING)
+    write_clients(loop, clients, count);
+  else
+    io_threads_write(clients, count);
+
+  for (size_t i = 0; i < count; i++) {
+    c = clients[i];
+    if ((c->flags & CLIENT_CLOSE_ASAP) ||
+        ((c->flags & CLIENT_CLOSE_AFTER_REPLY) && c->reply.length == 0 &&
+         c->shard_calls == NULL)) {
+      close_client_connection(c, loop, stats);
+      continue;
+    }
+    client_touch(c, interaction);
+    if (client_output_buffer_limit_reached(c, now)) {
+      printf("Client %d exceeded its output buffer limit, closing\n", c->fd);
+      stats->stats.client_output_buffer_limit_disconnections++;
+      close_client_connection(c, loop, stats);
+      continue;
+    }
+
+    // Only ask for writability while the socket is full, a writable socket
+    // would otherwise wake the loop for nothing
+    int mask = EVENT_READABLE;
+    if (!(c->flags & CLIENT_MASTER))
+      mask |= EVENT_DATA;
+    if (c->reply.length > 0 && !(c->flags & CLIENT_WRITE_HANDLER)) {
+      event_loop_modify(loop, c->fd, mask | EVENT_WRITABLE);
+      c->flags |= CLIENT_WRITE_HANDLER;
+    } else if (c->reply.length == 0 && (c->flags & CLIENT_WRITE_HANDLER)) {
+      event_loop_modify(loop, c->fd, mask);
+      c->flags &= ~CLIENT_WRITE_HANDLER;
+    }
+  }
+}
+
+// The whole batch goes to the event loop at once, which io_uring submits
+// with a single system call. Clients that filled their CLIENT_WRITE_IOV
+// chunks and still have more go again, until every socket is either done
+// or full.
+void write_clients(EventLoop *loop, Client **clients, size_t count) {
+  static _Thread_local EventWrite *writes = NULL;
+  static _Thread_local struct iovec (*iovs)[CLIENT_WRITE_IOV] = NULL;
+  static _Thread_local Client **writing = NULL;
+  static _Thread_local size_t capacity = 0;
+
+  if (count > capacity) {
+    EventWrite *grown_writes = realloc(writes, count * sizeof(EventWrite));
+    if (grown_writes != NULL)
+      writes = grown_writes;
+    struct iovec (*grown_iovs)[CLIENT_WRITE_IOV] = realloc(iovs, count * sizeof(*iovs));
+    if (grown_iovs != NULL)
+      iovs = grown_iovs;
+    Client **grown_writing = realloc(writing, count * sizeof(Client *));
+    if (grown_writing != NULL)
+      writing = grown_writing;
+    if (grown_writes == NULL || grown_iovs == NULL || grown_writing == NULL) {
+      // Fall back to a write per client
+      io_threads_write(clients, count);
+      return;
+    }
+    capacity = count;
+  }
+
+  size_t left = 0;
+  for (size_t i = 0; i < count; i++)
+    writing[left++] = clients[i];
+
+  while (left > 0) {
+    size_t n = 0;
+    for (size_t i = 0; i < left; i++) {
+      Client *c = writing[i];
+      int iovcnt = client_output_iov(c, iovs[n], CLIENT_WRITE_IOV);
+      if (iovcnt < 0) {
+        c->flags |= CLIENT_CLOSE_ASAP;
+        continue;
+      }
+      if (iovcnt == 0) {
+        client_output_written(c, 0);
+        continue;
+      }
+      writes[n] = (EventWrite){c->fd, iovs[n], iovcnt, 0};
+      writing[n++] = c;
+    }
+
+    event_loop_writev(loop, writes, n);
+
+    left = 0;
+    for (size_t i = 0; i < n; i++) {
+      Client *c = writing[i];
+      int status = client_output_written(c, writes[i].result);
+      if (status < 0)
+        c->flags |= CLIENT_CLOSE_ASAP;
+      else if (status == 0 && writes[i].result > 0)
+        writing[left++] = c;
+    }
+  }
 }
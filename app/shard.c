@@ -0,0 +1,542 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "commands.h"
+#include "hash.h"
+#include "reply.h"
+#include "shard.h"
+
+#define SHARD_QUEUE_MASK (SHARD_QUEUE_SIZE - 1)
+
+// A command sent to other shards on behalf of one client. It stays with the
+// shard the client is on, and only the messages travel. A client's calls
+// are chained oldest first, together with the replies of whatever it ran
+// locally meanwhile, so replies go out in the order of the requests.
+typedef struct ShardCall {
+  Client *client; // NULL once the client is gone
+  struct ShardCall *next;
+  ShardRoute route;
+  RESPCommand *request; // Copy the messages share, made on the first send
+  int pending;      // Replies still to come
+  int scan_shard;   // Shard a SCAN was sent to
+  sds reply;        // The reply, or what was gathered of it so far
+  sds error;        // First error a gathering shard replied
+  size_t array_len; // Elements gathered so far
+} ShardCall;
+
+// One leg of a ShardCall. The same message goes to the shard running the
+// command and comes back to the sender with the reply filled in.
+typedef struct {
+  ShardCall *call;
+  int from;
+  int db;
+  RESPCommand *request;
+  sds reply;
+} ShardMessage;
+
+// Single producer, single consumer ring. Only the producer moves tail and
+// only the consumer moves head, each on its own cache line.
+typedef struct {
+  _Atomic size_t head;
+  char pad[64 - sizeof(size_t)];
+  _Atomic size_t tail;
+  ShardMessage *slots[SHARD_QUEUE_SIZE];
+} ShardQueue;
+
+typedef struct {
+  ShardQueue *inbox; // inbox[from] is only ever written by shard from
+  int wakeup_fd;     // Bumped by a sender once it queued something
+} Shard;
+
+// Messages the sending shard still has to hand over
+typedef struct {
+  ShardMessage **items;
+  size_t count;
+  size_t capacity;
+} ShardOutbox;
+
+static Shard *shards = NULL;
+static int shards_num = 1;
+
+static _Thread_local int self = 0;
+static _Thread_local ShardOutbox outbox[SHARDS_MAX];
+
+// Fds of clients whose call completed since the loop last looked
+static _Thread_local int *unblocked = NULL;
+static _Thread_local size_t unblocked_count = 0;
+static _Thread_local size_t unblocked_capacity = 0;
+
+int shards_init(int count) {
+  if (count < 1 || count > SHARDS_MAX)
+    return -1;
+
+  shards_num = count;
+  if (count == 1)
+    return 0;
+
+  shards = calloc(count, sizeof(Shard));
+  if (shards == NULL)
+    return -1;
+  for (int i = 0; i < count; i++) {
+    shards[i].inbox = calloc(count, sizeof(ShardQueue));
+    shards[i].wakeup_fd = eventfd(0, EFD_NONBLOCK);
+    if (shards[i].inbox == NULL || shards[i].wakeup_fd < 0)
+      return -1;
+  }
+  return 0;
+}
+
+int shard_count() { return shards_num; }
+
+void shard_attach(int id) { self = id; }
+
+int shard_self() { return self; }
+
+int shard_wakeup_fd() { return shards_num > 1 ? shards[self].wakeup_fd : -1; }
+
+// The tables inside a shard index by the low bits of the same hash, so the
+// shard is taken from the high ones. Otherwise every key of a shard would
+// land in the same 1/n of its table's groups.
+int shard_for_key(const char *key, size_t len) {
+  uint64_t hash = hash_bytes(key, len);
+  return (int)(((hash >> 32) * (uint64_t)shards_num) >> 32);
+}
+
+typedef struct {
+  sds *keys;
+  size_t count;
+  size_t capacity;
+  int failed;
+} SplitKeys;
+
+// Only collects: looking keys up from inside a scan could move the table
+// along its rehash under the scan's feet
+static void split_collect_key(void *privdata, const sds key, const sds value) {
+  SplitKeys *keys = privdata;
+  (void)value;
+  if (keys->count == keys->capacity) {
+    size_t capacity = keys->capacity ? keys->capacity * 2 : 64;
+    sds *grown = realloc(keys->keys, capacity * sizeof(sds));
+    if (grown == NULL) {
+      keys->failed = 1;
+      return;
+    }
+    keys->keys = grown;
+    keys->capacity = capacity;
+  }
+  keys->keys[keys->count] = sdsdup(key);
+  if (keys->keys[keys->count] == NULL)
+    keys->failed = 1;
+  else
+    keys->count++;
+}
+
+// Hand every key of src, the RDB loaded at startup, to the shard owning it
+int shard_split_keyspace(Keyspace *src, Keyspace **dst) {
+  for (int db = 0; db < KEYSPACE_DB_COUNT; db++) {
+    SplitKeys keys = {NULL, 0, 0, 0};
+    unsigned long cursor = 0;
+    do {
+      cursor = ht_scan(src->db[db], cursor, split_collect_key, &keys);
+    } while (cursor != 0);
+
+    for (size_t i = 0; i < keys.count; i++) {
+      uint64_t expiry = 0;
+      sds key = keys.keys[i];
+      sds value = ht_get(src->db[db], key, sdslen(key));
+      // A key that expired since the load is simply left behind
+      if (value != NULL && ht_get_expiry(src->db[db], key, sdslen(key), &expiry) &&
+          ht_set(dst[shard_for_key(key, sdslen(key))]->db[db], key, sdslen(key), value,
+                 sdslen(value), expiry) == NULL)
+        keys.failed = 1;
+      sdsfree(keys.keys[i]);
+    }
+    free(keys.keys);
+    if (keys.failed)
+      return -1;
+  }
+  return 0;
+}
+
+// ------------------------------- Messaging -------------------------------
+
+static void shard_send(int to, ShardMessage *msg) {
+  ShardOutbox *ob = &outbox[to];
+  if (ob->count == ob->capacity) {
+    size_t capacity = ob->capacity ? ob->capacity * 2 : 64;
+    ShardMessage **items = realloc(ob->items, capacity * sizeof(ShardMessage *));
+    if (items == NULL) {
+      // Nothing sensible is left to do, a client would wait forever
+      fprintf(stderr, "Out of memory queueing a message to shard %d\n", to);
+      abort();
+    }
+    ob->items = items;
+    ob->capacity = capacity;
+  }
+  ob->items[ob->count++] = msg;
+}
+
+// Hand over what fits in each receiver's queue and wake it up once per
+// iteration, however many messages went its way
+int shard_flush_outbox() {
+  int backlog = 0;
+
+  for (int to = 0; to < shards_num; to++) {
+    ShardOutbox *ob = &outbox[to];
+    if (ob->count == 0)
+      continue;
+
+    ShardQueue *q = &shards[to].inbox[self];
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t sent = 0;
+    while (sent < ob->count && tail - head < SHARD_QUEUE_SIZE)
+      q->slots[tail++ & SHARD_QUEUE_MASK] = ob->items[sent++];
+    atomic_store_explicit(&q->tail, tail, memory_order_release);
+
+    if (sent > 0) {
+      uint64_t one = 1;
+      if (write(shards[to].wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("Failed to wake up a shard");
+      memmove(ob->items, ob->items + sent, (ob->count - sent) * sizeof(ShardMessage *));
+      ob->count -= sent;
+    }
+    if (ob->count > 0)
+      backlog = 1;
+  }
+  return backlog;
+}
+
+static void shard_mark_unblocked(int fd) {
+  if (unblocked_count == unblocked_capacity) {
+    size_t capacity = unblocked_capacity ? unblocked_capacity * 2 : 64;
+    int *fds = realloc(unblocked, capacity * sizeof(int));
+    if (fds == NULL) {
+      fprintf(stderr, "Out of memory resuming client %d\n", fd);
+      abort();
+    }
+    unblocked = fds;
+    unblocked_capacity = capacity;
+  }
+  unblocked[unblocked_count++] = fd;
+}
+
+Client *shard_next_unblocked() {
+  while (unblocked_count > 0) {
+    Client *c = client_lookup(unblocked[--unblocked_count]);
+    if (c != NULL && !(c->flags & CLIENT_SHARD_WAIT))
+      return c;
+  }
+  return NULL;
+}
+
+// --------------------------------- Calls ---------------------------------
+
+static sds reply_to_sds(ReplyBuffer *reply) {
+  sds s = sdsnewlen(NULL, reply->length);
+  if (s == NULL)
+    return NULL;
+
+  size_t len = reply->used;
+  memcpy(s, reply->buf, reply->used);
+  for (ReplyBlock *block = reply->head; block != NULL; block = block->next) {
+    memcpy(s + len, block->buf, block->used);
+    len += block->used;
+  }
+  return s;
+}
+
+// Run a command for any shard, this one included, and keep its reply
+static sds shard_run(RESPCommand *request, int db, Keyspace *keyspace, RedisStats *stats) {
+  char buf[4096];
+  ReplyBuffer reply;
+  reply_init(&reply, buf, sizeof(buf));
+  call_command(&reply, request, db, keyspace, stats);
+  sds s = reply.oom ? NULL : reply_to_sds(&reply);
+  reply_free(&reply);
+  return s;
+}
+
+// SCAN cursors carry the shard in their low digits: cursor = local * n +
+// shard. Once a shard is done the cursor moves on to the next one.
+static sds scan_rewrite_cursor(sds reply, int shard) {
+  if (reply == NULL || strncmp(reply, "*2\r\n$", 5) != 0)
+    return reply;
+
+  const char *reply_end = reply + sdslen(reply);
+  const char *cursor = resp_find_crlf(reply + 4, reply_end) + 2;
+  const char *rest = resp_find_crlf(cursor, reply_end) + 2;
+  unsigned long local = strtoul(cursor, NULL, 10);
+  unsigned long next;
+  if (local != 0)
+    next = local * shards_num + shard;
+  else
+    next = shard + 1 < shards_num ? (unsigned long)shard + 1 : 0;
+
+  char header[64];
+  int cursor_len = snprintf(NULL, 0, "%lu", next);
+  int header_len = snprintf(header, sizeof(header), "*2\r\n$%d\r\n%lu\r\n", cursor_len, next);
+  sds rewritten = sdsnewlen(NULL, header_len + sdslen(reply) - (rest - reply));
+  if (rewritten != NULL) {
+    memcpy(rewritten, header, header_len);
+    memcpy(rewritten + header_len, rest, sdslen(reply) - (rest - reply));
+  }
+  sdsfree(reply);
+  return rewritten;
+}
+
+// Fold one shard's reply into the call. local is set for the reply of the
+// shard the client is on.
+static void shard_call_add_reply(ShardCall *call, sds reply, int local) {
+  if (reply == NULL) {
+    if (call->error == NULL)
+      call->error = sdsnew("-ERR out of memory\r\n");
+    return;
+  }
+
+  switch (call->route) {
+  case SHARD_ROUTE_KEY:
+    call->reply = reply;
+    return;
+  case SHARD_ROUTE_SCAN:
+    call->reply = scan_rewrite_cursor(reply, call->scan_shard);
+    return;
+  case SHARD_ROUTE_ALL:
+    // Every shard ran the same checks, so the local reply speaks for all
+    // unless some shard failed where the others didn't
+    if (reply[0] == '-' && call->error == NULL)
+      call->error = reply;
+    else if (local && call->reply == NULL)
+      call->reply = reply;
+    else
+      sdsfree(reply);
+    return;
+  default:
+    break;
+  }
+
+  // Gathering: keep the elements of each *<n>\r\n array, the header is
+  // written once all of them are in
+  const char *body = reply[0] == '*' ? resp_find_crlf(reply, reply + sdslen(reply)) : NULL;
+  if (body == NULL) {
+    if (call->error == NULL)
+      call->error = reply;
+    else
+      sdsfree(reply);
+    return;
+  }
+  call->array_len += strtoul(reply + 1, NULL, 10);
+  body += 2;
+  size_t body_len = sdslen(reply) - (body - reply);
+  sds joined = call->reply == NULL ? sdsnewlen(NULL, 0) : call->reply;
+  if (joined != NULL)
+    joined = sdsmakeroomfor(joined, body_len);
+  if (joined == NULL) {
+    if (call->error == NULL)
+      call->error = sdsnew("-ERR out of memory\r\n");
+  } else {
+    memcpy(joined + sdslen(joined), body, body_len);
+    sdsincrlen(joined, body_len);
+    call->reply = joined;
+  }
+  sdsfree(reply);
+}
+
+static void shard_call_free(ShardCall *call) {
+  free(call->request);
+  if (call->reply != NULL)
+    sdsfree(call->reply);
+  if (call->error != NULL)
+    sdsfree(call->error);
+  free(call);
+}
+
+static ShardCall *shard_call_create(Client *c, ShardRoute route) {
+  ShardCall *call = calloc(1, sizeof(ShardCall));
+  if (call == NULL)
+    return NULL;
+  call->client = c;
+  call->route = route;
+  if (c->shard_calls_tail != NULL)
+    c->shard_calls_tail->next = call;
+  else
+    c->shard_calls = call;
+  c->shard_calls_tail = call;
+  c->shard_calls_count++;
+  return call;
+}
+
+static void shard_call_write_reply(ShardCall *call, ReplyBuffer *reply) {
+  if (call->error != NULL) {
+    reply_add_raw(reply, call->error, sdslen(call->error));
+  } else if (call->route == SHARD_ROUTE_GATHER) {
+    reply_add_array_len(reply, call->array_len);
+    if (call->reply != NULL)
+      reply_add_raw(reply, call->reply, sdslen(call->reply));
+  } else if (call->reply != NULL) {
+    reply_add_raw(reply, call->reply, sdslen(call->reply));
+  }
+}
+
+// Send out the replies of the client's oldest calls that are complete, and
+// let it run more commands once it is back under its limit of calls
+static void shard_client_flush(Client *c) {
+  while (c->shard_calls != NULL && c->shard_calls->pending == 0) {
+    ShardCall *call = c->shard_calls;
+    shard_call_write_reply(call, client_reply(c));
+    c->shard_calls = call->next;
+    if (c->shard_calls == NULL)
+      c->shard_calls_tail = NULL;
+    c->shard_calls_count--;
+    shard_call_free(call);
+  }
+
+  if ((c->flags & CLIENT_SHARD_WAIT) && c->shard_calls_count < SHARD_CLIENT_MAX_CALLS) {
+    c->flags &= ~CLIENT_SHARD_WAIT;
+    shard_mark_unblocked(c->fd);
+  }
+}
+
+void shard_queue_reply(Client *c, ReplyBuffer *reply) {
+  ShardCall *call = shard_call_create(c, SHARD_ROUTE_LOCAL);
+  if (call == NULL) {
+    // Can't be put in its place anymore, so the stream is broken
+    c->flags |= CLIENT_CLOSE_ASAP;
+    return;
+  }
+  call->reply = reply->oom ? NULL : reply_to_sds(reply);
+  if (call->reply == NULL)
+    call->error = sdsnew("-ERR out of memory\r\n");
+  shard_client_flush(c);
+}
+
+// The client is being closed. Calls still out are left to finish on their
+// own, nobody will hear their replies.
+void shard_forget_client(Client *c) {
+  ShardCall *call = c->shard_calls;
+  while (call != NULL) {
+    ShardCall *next = call->next;
+    if (call->pending == 0) {
+      shard_call_free(call);
+    } else {
+      call->client = NULL;
+      call->next = NULL;
+    }
+    call = next;
+  }
+  c->shard_calls = NULL;
+  c->shard_calls_tail = NULL;
+  c->shard_calls_count = 0;
+}
+
+// The request's arguments point into the client's query buffer, which
+// won't wait for the other shard. The first send copies them for the call.
+static int shard_call_send(ShardCall *call, RESPCommand *request, int to, int db) {
+  if (call->request == NULL) {
+    call->request = resp_command_dup(request);
+    if (call->request == NULL)
+      return -1;
+  }
+
+  ShardMessage *msg = malloc(sizeof(ShardMessage));
+  if (msg == NULL)
+    return -1;
+  msg->call = call;
+  msg->from = self;
+  msg->db = db;
+  msg->request = call->request;
+  msg->reply = NULL;
+  shard_send(to, msg);
+  call->pending++;
+  return 0;
+}
+
+void shard_dispatch(Client *c, ShardRoute route, RESPCommand *request, Keyspace *keyspace,
+                    RedisStats *stats) {
+  ShardCall *call = shard_call_create(c, route);
+  if (call == NULL) {
+    c->flags |= CLIENT_CLOSE_ASAP;
+    return;
+  }
+
+  RESPArg scan_argv[8];
+  RESPCommand scan_request;
+  char local_str[32];
+  int target = self;
+  if (route == SHARD_ROUTE_KEY) {
+    target = shard_for_key(request->argv[1].ptr, request->argv[1].len);
+  } else if (route == SHARD_ROUTE_SCAN) {
+    // A cursor that doesn't parse gets its error from the local shard
+    unsigned long cursor;
+    if (resp_arg_to_ul(&request->argv[1], &cursor) == 0 &&
+        request->argc <= sizeof(scan_argv) / sizeof(scan_argv[0])) {
+      target = cursor % shards_num;
+      memcpy(scan_argv, request->argv, request->argc * sizeof(RESPArg));
+      scan_argv[1].ptr = local_str;
+      scan_argv[1].len = snprintf(local_str, sizeof(local_str), "%lu", cursor / shards_num);
+      scan_request = (RESPCommand){scan_argv, request->argc};
+      request = &scan_request;
+    }
+    call->scan_shard = target;
+  }
+
+  if (route == SHARD_ROUTE_KEY || route == SHARD_ROUTE_SCAN) {
+    if (target == self)
+      shard_call_add_reply(call, shard_run(request, c->db, keyspace, stats), 1);
+    else if (shard_call_send(call, request, target, c->db) != 0)
+      shard_call_add_reply(call, NULL, 0);
+  } else {
+    shard_call_add_reply(call, shard_run(request, c->db, keyspace, stats), 1);
+    for (int to = 0; to < shards_num; to++) {
+      if (to != self && shard_call_send(call, request, to, c->db) != 0)
+        shard_call_add_reply(call, NULL, 0);
+    }
+  }
+
+  if (c->shard_calls_count >= SHARD_CLIENT_MAX_CALLS)
+    c->flags |= CLIENT_SHARD_WAIT;
+
+  // Answered without leaving this shard
+  if (call->pending == 0)
+    shard_client_flush(c);
+}
+
+// Run what other shards sent us and collect the replies to what we sent them
+void shard_process_inbox(Keyspace *keyspace, RedisStats *stats) {
+  uint64_t wakeups;
+  // Reset before draining, so a message queued meanwhile wakes us again
+  if (read(shards[self].wakeup_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN)
+    perror("Failed to read the shard wakeup");
+
+  for (int from = 0; from < shards_num; from++) {
+    ShardQueue *q = &shards[self].inbox[from];
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    while (head != tail) {
+      ShardMessage *msg = q->slots[head++ & SHARD_QUEUE_MASK];
+      if (msg->from != self) {
+        msg->reply = shard_run(msg->request, msg->db, keyspace, stats);
+        shard_send(msg->from, msg);
+        continue;
+      }
+
+      ShardCall *call = msg->call;
+      shard_call_add_reply(call, msg->reply, 0);
+      free(msg);
+      if (--call->pending > 0)
+        continue;
+      if (call->client != NULL)
+        shard_client_flush(call->client);
+      else
+        shard_call_free(call);
+    }
+    atomic_store_explicit(&q->head, head, memory_order_release);
+  }
+}
@@ -0,0 +1,66 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stddef.h>
+
+#include "client.h"
+#include "reply.h"
+#include "keyspace.h"
+#include "resp.h"
+#include "sds.h"
+#include "state.h"
+
+#define SHARDS_MAX 64
+
+// Messages each shard can have in flight to any one other shard. Anything
+// beyond waits on the sender's side for the next event loop iteration.
+#define SHARD_QUEUE_SIZE 1024
+
+// Calls a client can have waiting for a reply before it stops running the
+// commands it pipelined after them
+#define SHARD_CLIENT_MAX_CALLS 1024
+
+// Where a command runs when the keyspace is split over shards
+typedef enum {
+  SHARD_ROUTE_LOCAL,  // On the shard the client is connected to
+  SHARD_ROUTE_KEY,    // On the shard owning its first key
+  SHARD_ROUTE_ALL,    // On every shard, the local reply or else an error is sent
+  SHARD_ROUTE_GATHER, // On every shard, the arrays they reply are joined
+  SHARD_ROUTE_SCAN,   // On the shard the cursor points into
+  SHARD_ROUTE_NONE    // Not available with shards
+} ShardRoute;
+
+// Set up count shards. 1, the default, runs the server as a single loop
+// and every other function here is then never needed.
+//
+// Commands that touch every shard, FLUSHDB, FLUSHALL, SWAPDB and KEYS,
+// are not atomic across them: each shard runs its part when the message
+// gets there. Meanwhile other clients can see some shards flushed or
+// swapped and others not yet.
+int shards_init(int count);
+int shard_count();
+
+// Called by each shard's thread before it touches anything else
+void shard_attach(int id);
+int shard_self();
+int shard_wakeup_fd();
+
+int shard_for_key(const char *key, size_t len);
+int shard_split_keyspace(Keyspace *src, Keyspace **shards);
+
+// Send a command to the shards that have to run it, or run it here when
+// none other has to. The request is copied if it has to leave this shard.
+void shard_dispatch(Client *c, ShardRoute route, RESPCommand *request, Keyspace *keyspace,
+                    RedisStats *stats);
+// The reply to a command run here while earlier ones are still out, to be
+// sent once theirs are
+void shard_queue_reply(Client *c, ReplyBuffer *reply);
+void shard_forget_client(Client *c);
+
+// Event loop hooks. shard_flush_outbox returns 1 when some messages could
+// not be handed over yet and the loop shouldn't sleep.
+void shard_process_inbox(Keyspace *keyspace, RedisStats *stats);
+int shard_flush_outbox();
+Client *shard_next_unblocked();
+
+#endif // SHARD_H
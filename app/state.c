@@ -5,6 +5,7 @@
 #include "dlist.h"
 #include "helper.h"
 #include "state.h"
+#include "timer.h"
 
 // Helper function to convert a RedisRole enum to string
 const char *get_role_str(RedisRole role) {
@@ -29,7 +30,7 @@ ReplicaInfo* create_replica_info(int connection_fd) {
   return info;
 }
 
-WaitingClientInfo* create_waiting_client_info(int connection_fd, uint64_t master_offset, uint64_t minimum_replica_count, uint64_t expiry) { 
+WaitingClientInfo* create_waiting_client_info(int connection_fd, uint64_t master_offset, uint64_t minimum_replica_count) {
   WaitingClientInfo* info = malloc(sizeof(WaitingClientInfo));
   if (!info) {
     return NULL;
@@ -37,8 +38,8 @@ WaitingClientInfo* create_waiting_client_info(int connection_fd, uint64_t master
   info->connection_fd = connection_fd;
   info->master_offset = master_offset;
   info->minimum_replica_count = minimum_replica_count;
-  info->expiry = expiry;
-  printf("Expiry set as : %llu\n",info->expiry);
+  info->timer = NULL;
+  info->node = NULL;
   return info;
 }
 
@@ -51,12 +52,28 @@ RedisStats *init_redis_stats() {
   get_os_info(stats->server.os, sizeof(stats->server.os));
 
   stats->server.tcp_port = DEFAULT_REDIS_PORT;
+  stats->server.tcp_backlog = DEFAULT_TCP_BACKLOG;
+  stats->server.tcp_keepalive = DEFAULT_TCP_KEEPALIVE;
+  stats->server.tcp_nodelay = 1;
+  stats->server.unixsocket[0] = '\0';
+  stats->server.unixsocketperm = 0;
+  stats->server.hz = TIMER_DEFAULT_HZ;
+  stats->server.client_timeout = 0;
 
   // Initialize clients section
-  stats->clients.connected_clients = 0;
   stats->clients.total_connections_received = 0;
   stats->clients.blocked_clients = 0;
-  stats->clients.maxclients = 10000; // Default value
+  stats->clients.maxclients = DEFAULT_MAXCLIENTS;
+
+  // Initialize stats section
+  stats->stats.expired_time_cap_reached_count = 0;
+  stats->stats.expire_cycle_cpu_usec = 0;
+  stats->stats.client_output_buffer_limit_disconnections = 0;
+  stats->stats.rejected_connections = 0;
+  stats->stats.max_accepts_per_event = 0;
+  stats->stats.accept_second = 0;
+  stats->stats.accepts_this_second = 0;
+  stats->stats.accepts_last_second = 0;
 
   // Initialize replication section
   stats->replication.role = ROLE_MASTER;
@@ -81,10 +98,11 @@ RedisStats *init_redis_stats() {
            "8371b4fb1155b71f4a04d3e1bc3e18c4a990aeeb");
   stats->replication.master_repl_offset = 0;
   stats->replication.master_fd = -1; // Default value
+  stats->replication.replicas_selected_db = -1;
 
-  stats->others.connected_clients = create_list();
   stats->others.connected_slaves = create_list(); // For storing ReplicaInfo
   stats->others.waiting_clients = create_list();
+  stats->others.replicas_acked = 0;
   stats->others.is_replication_completed = 0;
 
   return stats;
@@ -31,11 +31,15 @@ typedef struct {
     uint64_t last_ack_offset;
 } ReplicaInfo;
 
+// A client in WAIT, answered once enough replicas acked master_offset or
+// its timer fires. Either way it is unlinked from waiting_clients through
+// node.
 typedef struct {
   int connection_fd;
   uint64_t master_offset;
   uint64_t minimum_replica_count;
-  uint64_t expiry;
+  struct Timer *timer; // NULL when it waits without a timeout
+  Node *node;
 } WaitingClientInfo;
 
 typedef struct {
@@ -44,17 +48,35 @@ typedef struct {
     char redis_version[16];
     char os[64];
     uint16_t tcp_port;
+    int tcp_backlog;   // Connections the kernel queues for us to accept
+    int tcp_keepalive; // Seconds before probing an idle connection, 0 for never
+    int tcp_nodelay;
+    char unixsocket[108]; // Path of the unix socket to listen on, empty for none
+    int unixsocketperm;   // Mode for the socket file, 0 leaves it to the umask
+    int hz;             // How many times a second serverCron runs
+    int client_timeout; // Seconds a client may stay idle, 0 for forever
     uint64_t offset;
   } server;
 
   // Clients section
   struct {
-    uint64_t connected_clients;
     uint64_t total_connections_received;
     uint64_t blocked_clients;
     uint64_t maxclients;
   } clients;
 
+  // Stats section
+  struct {
+    uint64_t expired_time_cap_reached_count; // Expire cycles cut short
+    uint64_t expire_cycle_cpu_usec;
+    uint64_t client_output_buffer_limit_disconnections;
+    uint64_t rejected_connections; // Accepts that failed, or connections we couldn't set up
+    uint64_t max_accepts_per_event; // Largest burst drained from the backlog at once
+    uint64_t accept_second;        // Unix second the counter below is for
+    uint64_t accepts_this_second;
+    uint64_t accepts_last_second;
+  } stats;
+
   struct {
     RedisRole role;   // Using enum instead of string
     char role_str[8]; // Keep string version for INFO command output
@@ -65,15 +87,16 @@ typedef struct {
     uint64_t master_repl_offset;
     HandshakeState handshake_state; // Track handshake progress
     BytesRead* bytes_read; // Track bytes read during replication
+    int replicas_selected_db; // Last db SELECTed in the replication stream, -1 for none
   } replication;
 
   // Some custom stats
   struct {
     char rdb_dir[124];      // Maybe exceed
     char rdb_filename[124]; // Maybe exceed
-    Llist *connected_clients;
     Llist *connected_slaves;
     Llist *waiting_clients;
+    int replicas_acked; // An ACK came in, waiting clients are due a look
     int is_replication_completed;
   } others;
 
@@ -82,6 +105,6 @@ typedef struct {
 RedisStats *init_redis_stats();
 const char *get_role_str(RedisRole role);
 ReplicaInfo* create_replica_info(int connection_fd);
-WaitingClientInfo* create_waiting_client_info(int connection_fd, uint64_t master_offset, uint64_t minimum_replica_count, uint64_t expiry);
+WaitingClientInfo* create_waiting_client_info(int connection_fd, uint64_t master_offset, uint64_t minimum_replica_count);
 
 #endif /* STATE_H */
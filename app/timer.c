@@ -0,0 +1,142 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "helper.h"
+#include "timer.h"
+
+// A binary min-heap on when. Each timer knows its index, so cancelling one
+// is O(log n) like adding one.
+static _Thread_local Timer **heap = NULL;
+static _Thread_local size_t heap_count = 0;
+static _Thread_local size_t heap_capacity = 0;
+
+uint64_t timer_now_ms() { return get_monotonic_us() / 1000; }
+
+static void heap_set(size_t index, Timer *timer) {
+  heap[index] = timer;
+  timer->index = index;
+}
+
+static void heap_sift_up(size_t index) {
+  Timer *timer = heap[index];
+  while (index > 0) {
+    size_t parent = (index - 1) / 2;
+    if (heap[parent]->when <= timer->when)
+      break;
+    heap_set(index, heap[parent]);
+    index = parent;
+  }
+  heap_set(index, timer);
+}
+
+static void heap_sift_down(size_t index) {
+  Timer *timer = heap[index];
+  while (1) {
+    size_t child = index * 2 + 1;
+    if (child >= heap_count)
+      break;
+    if (child + 1 < heap_count && heap[child + 1]->when < heap[child]->when)
+      child++;
+    if (timer->when <= heap[child]->when)
+      break;
+    heap_set(index, heap[child]);
+    index = child;
+  }
+  heap_set(index, timer);
+}
+
+static int heap_push(Timer *timer) {
+  if (heap_count == heap_capacity) {
+    size_t capacity = heap_capacity ? heap_capacity * 2 : 64;
+    Timer **grown = realloc(heap, capacity * sizeof(Timer *));
+    if (grown == NULL)
+      return -1;
+    heap = grown;
+    heap_capacity = capacity;
+  }
+  heap_set(heap_count++, timer);
+  heap_sift_up(timer->index);
+  return 0;
+}
+
+static void heap_remove(Timer *timer) {
+  size_t index = timer->index;
+  Timer *last = heap[--heap_count];
+  if (last == timer)
+    return;
+  heap_set(index, last);
+  if (index > 0 && heap[(index - 1) / 2]->when > last->when)
+    heap_sift_up(index);
+  else
+    heap_sift_down(index);
+}
+
+// Returns NULL if out of memory
+Timer *timer_add(uint64_t delay_ms, TimerProc proc, void *privdata) {
+  Timer *timer = malloc(sizeof(Timer));
+  if (timer == NULL)
+    return NULL;
+
+  timer->when = timer_now_ms() + delay_ms;
+  timer->proc = proc;
+  timer->privdata = privdata;
+  timer->next = NULL;
+  if (heap_push(timer) != 0) {
+    free(timer);
+    return NULL;
+  }
+  return timer;
+}
+
+void timer_cancel(Timer *timer) {
+  if (timer == NULL)
+    return;
+  heap_remove(timer);
+  free(timer);
+}
+
+// Milliseconds until the next timer is due, for the event loop to sleep at
+// most that long. -1 if there is none.
+int timer_next_timeout() {
+  if (heap_count == 0)
+    return -1;
+
+  uint64_t now = timer_now_ms();
+  if (heap[0]->when <= now)
+    return 0;
+  uint64_t wait = heap[0]->when - now;
+  return wait > INT_MAX ? INT_MAX : (int)wait;
+}
+
+// Run everything that is due. Timers that ask to run again go back in only
+// once the rest are done, so one that keeps asking for 0ms can't hold the
+// loop here.
+void timer_run_due(RedisStats *stats) {
+  uint64_t now = timer_now_ms();
+  Timer *rearmed = NULL;
+
+  while (heap_count > 0 && heap[0]->when <= now) {
+    Timer *timer = heap[0];
+    heap_remove(timer);
+
+    long next = timer->proc(stats, timer->privdata);
+    if (next == TIMER_DONE) {
+      free(timer);
+      continue;
+    }
+    timer->when = now + (uint64_t)next;
+    timer->next = rearmed;
+    rearmed = timer;
+  }
+
+  while (rearmed != NULL) {
+    Timer *timer = rearmed;
+    rearmed = timer->next;
+    timer->next = NULL;
+    if (heap_push(timer) != 0) {
+      fprintf(stderr, "Out of memory re-arming a timer\n");
+      abort();
+    }
+  }
+}
@@ -0,0 +1,36 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "state.h"
+
+// Returned by a timer proc that shouldn't run again
+#define TIMER_DONE -1
+
+// Same defaults and bounds as Redis
+#define TIMER_DEFAULT_HZ 10
+#define TIMER_MAX_HZ 500
+
+// Runs once the timer is due. Returns the milliseconds until it should run
+// again, or TIMER_DONE to have it freed. Procs must not cancel timers, their
+// own included; those due in the same round may already be out of the heap.
+typedef long (*TimerProc)(RedisStats *stats, void *privdata);
+
+typedef struct Timer {
+  uint64_t when; // Monotonic milliseconds
+  size_t index;  // Position in the heap
+  TimerProc proc;
+  void *privdata;
+  struct Timer *next; // Re-armed while the due timers run
+} Timer;
+
+// Timers live in a heap per thread, run by that thread's event loop
+uint64_t timer_now_ms();
+Timer *timer_add(uint64_t delay_ms, TimerProc proc, void *privdata);
+void timer_cancel(Timer *timer);
+int timer_next_timeout();
+void timer_run_due(RedisStats *stats);
+
+#endif // TIMER_H
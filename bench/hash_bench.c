@@ -0,0 +1,174 @@
+// Cost of the key hash functions in hash.c: wyhash, SipHash-1-3 and the
+// FNV-1a they replaced. First per length, then over a mix of key shapes
+// like a cache's: 60% "user:<n>", 30% "session:<32 hex>" and 10% URL-like
+// keys of about 100 bytes.
+//
+// Build and run from the repository root:
+//   gcc -O2 -Iapp -o hash_bench bench/hash_bench.c app/hash.c
+//   ./hash_bench [keys]
+//
+// The mix is hashed twice: the first keys-in-cache pass repeats a small
+// working set, the second walks all the keys so their bytes come from
+// memory as on a large keyspace. Figures are the best of three rounds.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+#define ROUNDS 3
+#define HOT_KEYS 10000
+#define MAX_KEY_LEN 128
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static const uint8_t seed[16] = {0x0f, 0x1e, 0x2d, 0x3c, 0x4b, 0x5a, 0x69, 0x78,
+                                 0x87, 0x96, 0xa5, 0xb4, 0xc3, 0xd2, 0xe1, 0xf0};
+
+static uint64_t run_wyhash(const void *data, size_t len) {
+  return hash_wyhash(data, len, 0x78695a4b3c2d1e0fULL);
+}
+static uint64_t run_siphash(const void *data, size_t len) { return hash_siphash(data, len, seed); }
+static uint64_t run_fnv1a(const void *data, size_t len) { return hash_fnv1a(data, len); }
+
+typedef struct {
+  const char *name;
+  uint64_t (*fn)(const void *data, size_t len);
+} Hash;
+
+static const Hash hashes[] = {
+    {"wyhash", run_wyhash},
+    {"siphash", run_siphash},
+    {"fnv1a", run_fnv1a},
+};
+
+typedef struct {
+  char (*data)[MAX_KEY_LEN];
+  size_t *len;
+  size_t count;
+  size_t bytes;
+} Keys;
+
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static int keys_init(Keys *keys, size_t count) {
+  keys->data = malloc(count * sizeof(*keys->data));
+  keys->len = malloc(count * sizeof(size_t));
+  if (keys->data == NULL || keys->len == NULL)
+    return -1;
+  keys->count = count;
+  keys->bytes = 0;
+
+  uint64_t state = 0x9e3779b97f4a7c15ULL;
+  for (size_t i = 0; i < count; i++) {
+    uint64_t r = next_random(&state);
+    int len;
+    if (r % 10 < 6) {
+      len = snprintf(keys->data[i], MAX_KEY_LEN, "user:%llu",
+                     (unsigned long long)(r >> 8) % 100000000);
+    } else if (r % 10 < 9) {
+      len = snprintf(keys->data[i], MAX_KEY_LEN, "session:%016llx%016llx",
+                     (unsigned long long)next_random(&state),
+                     (unsigned long long)next_random(&state));
+    } else {
+      len = snprintf(keys->data[i], MAX_KEY_LEN,
+                     "cache:page:/articles/%08llx/comments?sort=newest&page=%llu&lang=en-US"
+                     "&fmt=json&v=%08llx",
+                     (unsigned long long)(r >> 32), (unsigned long long)(r >> 8) % 100,
+                     (unsigned long long)next_random(&state) >> 32);
+    }
+    keys->len[i] = len;
+    keys->bytes += len;
+  }
+  return 0;
+}
+
+// ns per hash of iterations inputs of len bytes. The first byte changes
+// every time, so nothing can be hoisted out of the loop.
+static double time_length(const Hash *hash, size_t len, uint64_t *sink) {
+  static char buf[1024];
+  memset(buf, 'x', sizeof(buf));
+  size_t iterations = 20000000 / (1 + len / 16);
+  double best = 0;
+  for (int round = 0; round < ROUNDS; round++) {
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < iterations; i++) {
+      buf[0] = (char)i;
+      *sink += hash->fn(buf, len);
+    }
+    double ns = (double)(now_ns() - start) / iterations;
+    if (best == 0 || ns < best)
+      best = ns;
+  }
+  return best;
+}
+
+static double time_keys(const Hash *hash, const Keys *keys, size_t count, size_t passes,
+                        uint64_t *sink) {
+  double best = 0;
+  for (int round = 0; round < ROUNDS; round++) {
+    uint64_t start = now_ns();
+    for (size_t pass = 0; pass < passes; pass++) {
+      for (size_t i = 0; i < count; i++)
+        *sink += hash->fn(keys->data[i], keys->len[i]);
+    }
+    double ns = (double)(now_ns() - start) / (count * passes);
+    if (best == 0 || ns < best)
+      best = ns;
+  }
+  return best;
+}
+
+int main(int argc, char *argv[]) {
+  size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  if (count < HOT_KEYS) {
+    fprintf(stderr, "Usage: %s [keys], at least %d\n", argv[0], HOT_KEYS);
+    return 1;
+  }
+
+  Keys keys;
+  if (keys_init(&keys, count) != 0) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  static const size_t lengths[] = {8, 16, 40, 100, 1000};
+  size_t nlengths = sizeof(lengths) / sizeof(lengths[0]);
+  size_t nhashes = sizeof(hashes) / sizeof(hashes[0]);
+  uint64_t sink = 0;
+
+  printf("ns per hash by key length\n%-8s", "");
+  for (size_t l = 0; l < nlengths; l++)
+    printf(" %8zu", lengths[l]);
+  printf("\n");
+  for (size_t h = 0; h < nhashes; h++) {
+    printf("%-8s", hashes[h].name);
+    for (size_t l = 0; l < nlengths; l++)
+      printf(" %8.1f", time_length(&hashes[h], lengths[l], &sink));
+    printf("\n");
+  }
+
+  printf("\nns per hash over the key mix, %.1f bytes on average\n",
+         (double)keys.bytes / keys.count);
+  printf("%-8s %10s %10s\n", "", "in cache", "all keys");
+  for (size_t h = 0; h < nhashes; h++) {
+    double hot = time_keys(&hashes[h], &keys, HOT_KEYS, count / HOT_KEYS, &sink);
+    double all = time_keys(&hashes[h], &keys, count, 1, &sink);
+    printf("%-8s %10.1f %10.1f\n", hashes[h].name, hot, all);
+  }
+
+  // Keeps the compiler from dropping the hashing
+  return sink == 42 ? 2 : 0;
+}
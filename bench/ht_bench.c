@@ -0,0 +1,261 @@
+// GET and SET latency of ht_table against the layout it replaced: one
+// array of {key, value, expiry} slots probed linearly, with the key and
+// the value each in an allocation of their own and strcmp on every slot
+// passed. Both tables hash with FNV-1a by default, so only the layout
+// differs; pass a hash name to run ht_table with another one.
+//
+// Build and run from the repository root:
+//   gcc -O2 -Iapp -o ht_bench bench/ht_bench.c app/hashtable.c app/hash.c app/sds.c app/helper.c
+//   ./ht_bench [keys] [wyhash|siphash|fnv1a]
+//
+// Keys are 34 bytes and values 49, GETs go in random order and read the
+// value they find, as a reply would. Each figure is the best of three
+// rounds, in ns per operation.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+#include "hashtable.h"
+
+#define KEY_LEN 34
+#define VALUE_LEN 49
+#define ROUNDS 3
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// ----------------- The previous layout -------------------------------
+// ---------------------------------------------------------------------
+typedef struct {
+  const char *key;
+  void *value;
+  uint64_t expiry;
+} linear_entry;
+
+typedef struct {
+  linear_entry *entries;
+  size_t capacity;
+  size_t used;
+} linear_table;
+
+static uint64_t linear_hash(const char *key) {
+  uint64_t hash = 14695981039346656037UL;
+  for (const char *p = key; *p; p++) {
+    hash ^= (uint64_t)(unsigned char)*p;
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+static linear_entry *linear_slot(linear_entry *entries, size_t capacity, const char *key) {
+  size_t mask = capacity - 1;
+  size_t index = linear_hash(key) & mask;
+  while (entries[index].key != NULL && strcmp(entries[index].key, key) != 0)
+    index = (index + 1) & mask;
+  return &entries[index];
+}
+
+// The old table grew incrementally; the whole array is moved at once here,
+// which only the SET figure sees
+static int linear_grow(linear_table *table) {
+  size_t capacity = table->capacity * 2;
+  linear_entry *entries = calloc(capacity, sizeof(linear_entry));
+  if (entries == NULL)
+    return -1;
+  for (size_t i = 0; i < table->capacity; i++) {
+    if (table->entries[i].key != NULL)
+      *linear_slot(entries, capacity, table->entries[i].key) = table->entries[i];
+  }
+  free(table->entries);
+  table->entries = entries;
+  table->capacity = capacity;
+  return 0;
+}
+
+static int linear_set(linear_table *table, const char *key, const char *value) {
+  if ((table->used + 1) * 4 > table->capacity * 3 && linear_grow(table) != 0)
+    return -1;
+  linear_entry *entry = linear_slot(table->entries, table->capacity, key);
+  if (entry->key != NULL) {
+    free(entry->value);
+  } else {
+    entry->key = strdup(key);
+    table->used++;
+  }
+  entry->value = strdup(value);
+  return entry->key != NULL && entry->value != NULL ? 0 : -1;
+}
+
+static void *linear_get(linear_table *table, const char *key) {
+  return linear_slot(table->entries, table->capacity, key)->value;
+}
+
+static void linear_free(linear_table *table) {
+  for (size_t i = 0; i < table->capacity; i++) {
+    free((void *)table->entries[i].key);
+    free(table->entries[i].value);
+  }
+  free(table->entries);
+}
+
+// ----------------- Benchmark -----------------------------------------
+// ---------------------------------------------------------------------
+typedef struct {
+  size_t count;
+  char (*keys)[KEY_LEN + 1];
+  char (*misses)[KEY_LEN + 1];
+  size_t *order; // Random permutation of 0..count-1
+  char value[VALUE_LEN + 1];
+} Workload;
+
+typedef struct {
+  double set_ns;
+  double get_hit_ns;
+  double get_miss_ns;
+} Result;
+
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static int workload_init(Workload *w, size_t count) {
+  w->count = count;
+  w->keys = malloc(count * sizeof(*w->keys));
+  w->misses = malloc(count * sizeof(*w->misses));
+  w->order = malloc(count * sizeof(size_t));
+  if (w->keys == NULL || w->misses == NULL || w->order == NULL)
+    return -1;
+
+  uint64_t state = 0x9e3779b97f4a7c15ULL;
+  for (size_t i = 0; i < count; i++) {
+    snprintf(w->keys[i], KEY_LEN + 1, "object:%027llu", (unsigned long long)i * 2654435761u);
+    snprintf(w->misses[i], KEY_LEN + 1, "absent:%027llu", (unsigned long long)i * 2654435761u);
+    w->order[i] = i;
+  }
+  for (size_t i = count - 1; i > 0; i--) {
+    size_t j = next_random(&state) % (i + 1);
+    size_t tmp = w->order[i];
+    w->order[i] = w->order[j];
+    w->order[j] = tmp;
+  }
+  memset(w->value, 'v', VALUE_LEN);
+  w->value[VALUE_LEN] = '\0';
+  return 0;
+}
+
+static double best(double a, double b) { return a == 0 || b < a ? b : a; }
+
+// Counts a hit, and reads the value so its cache miss is paid like on the
+// server
+static size_t touch(const char *value) { return value != NULL && value[VALUE_LEN - 1] == 'v'; }
+
+static int run_linear(const Workload *w, Result *result) {
+  memset(result, 0, sizeof(*result));
+  for (int round = 0; round < ROUNDS; round++) {
+    linear_table table = {calloc(32, sizeof(linear_entry)), 32, 0};
+    if (table.entries == NULL)
+      return -1;
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < w->count; i++) {
+      if (linear_set(&table, w->keys[i], w->value) != 0)
+        return -1;
+    }
+    result->set_ns = best(result->set_ns, (double)(now_ns() - start) / w->count);
+
+    size_t found = 0;
+    start = now_ns();
+    for (size_t i = 0; i < w->count; i++)
+      found += touch(linear_get(&table, w->keys[w->order[i]]));
+    result->get_hit_ns = best(result->get_hit_ns, (double)(now_ns() - start) / w->count);
+
+    start = now_ns();
+    for (size_t i = 0; i < w->count; i++)
+      found += touch(linear_get(&table, w->misses[w->order[i]]));
+    result->get_miss_ns = best(result->get_miss_ns, (double)(now_ns() - start) / w->count);
+
+    if (found != w->count) {
+      fprintf(stderr, "linear table lost keys: %zu of %zu\n", found, w->count);
+      return -1;
+    }
+    linear_free(&table);
+  }
+  return 0;
+}
+
+static int run_ht(const Workload *w, Result *result) {
+  memset(result, 0, sizeof(*result));
+  for (int round = 0; round < ROUNDS; round++) {
+    ht_table *table = ht_create();
+    if (table == NULL)
+      return -1;
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < w->count; i++) {
+      if (ht_set(table, w->keys[i], KEY_LEN, w->value, VALUE_LEN, 0) == NULL)
+        return -1;
+    }
+    result->set_ns = best(result->set_ns, (double)(now_ns() - start) / w->count);
+
+    // Lookups of a growing table also finish its rehash, as on the server
+    size_t found = 0;
+    start = now_ns();
+    for (size_t i = 0; i < w->count; i++)
+      found += touch(ht_get(table, w->keys[w->order[i]], KEY_LEN));
+    result->get_hit_ns = best(result->get_hit_ns, (double)(now_ns() - start) / w->count);
+
+    start = now_ns();
+    for (size_t i = 0; i < w->count; i++)
+      found += touch(ht_get(table, w->misses[w->order[i]], KEY_LEN));
+    result->get_miss_ns = best(result->get_miss_ns, (double)(now_ns() - start) / w->count);
+
+    if (found != w->count) {
+      fprintf(stderr, "ht_table lost keys: %zu of %zu\n", found, w->count);
+      return -1;
+    }
+    ht_destroy(table);
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  HashFunction function = HASH_FNV1A;
+  if (count < 2 || (argc > 2 && hash_function_from_name(argv[2], &function) != 0)) {
+    fprintf(stderr, "Usage: %s [keys] [wyhash|siphash|fnv1a]\n", argv[0]);
+    return 1;
+  }
+  if (hash_init(function) != 0) {
+    fprintf(stderr, "Failed to set up the hash function\n");
+    return 1;
+  }
+
+  Workload w;
+  if (workload_init(&w, count) != 0) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  Result linear, ht;
+  if (run_linear(&w, &linear) != 0 || run_ht(&w, &ht) != 0) {
+    fprintf(stderr, "Benchmark failed\n");
+    return 1;
+  }
+
+  printf("%zu keys, ht_table hashing with %s, ns/op\n", count, hash_function_name());
+  printf("%-12s %10s %10s %10s\n", "", "SET", "GET hit", "GET miss");
+  printf("%-12s %10.1f %10.1f %10.1f\n", "linear", linear.set_ns, linear.get_hit_ns,
+         linear.get_miss_ns);
+  printf("%-12s %10.1f %10.1f %10.1f\n", "ht_table", ht.set_ns, ht.get_hit_ns, ht.get_miss_ns);
+  return 0;
+}
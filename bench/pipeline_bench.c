@@ -0,0 +1,276 @@
+// Load generator for the server: clients that each keep a pipeline of
+// alternating SETs and GETs in flight, spread over threads so the client
+// side isn't what runs out of CPU. Reports ops/s once every reply is in.
+// Meant for comparing --shards and --io-threads settings, which only
+// scale on a host with the cores to run them and these threads at once.
+//
+// Build from the repository root:
+//   gcc -O2 -o pipeline_bench bench/pipeline_bench.c -lpthread
+//
+//   ./pipeline_bench [-h host] [-p port] [-c clients] [-t threads]
+//                    [-P pipeline] [-n requests per client] [-r keyspace]
+//
+// For example, against --shards 1, 2 and 4 in turn:
+//   ./pipeline_bench -p 6379 -c 50 -t 4 -P 16 -n 20000
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define READ_BUFFER_SIZE (64 * 1024)
+#define MAX_PIPELINE 1024
+
+typedef struct {
+  const char *host;
+  int port;
+  int clients;
+  int threads;
+  int pipeline;
+  long requests;
+  long keyspace;
+} Options;
+
+typedef struct {
+  int fd;
+  long sent;
+  long received;
+  int inflight;
+  uint64_t state; // Picks the keys
+  char rbuf[READ_BUFFER_SIZE];
+  size_t rlen;
+} Conn;
+
+typedef struct {
+  const Options *options;
+  int first_client;
+  int clients;
+  long done;
+  int failed;
+  pthread_t thread;
+} Worker;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static int conn_open(Conn *conn, const Options *options, int id) {
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(options->port)};
+  if (inet_pton(AF_INET, options->host, &addr.sin_addr) != 1) {
+    fprintf(stderr, "Invalid host %s\n", options->host);
+    return -1;
+  }
+  conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (conn->fd < 0 || connect(conn->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    perror("connect");
+    return -1;
+  }
+  int yes = 1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  conn->state = 0x9e3779b97f4a7c15ULL ^ ((uint64_t)id * 0xbf58476d1ce4e5b9ULL);
+  return 0;
+}
+
+// Queue the next batch of the pipeline in one write
+static int conn_send(Conn *conn, const Options *options, char *buf) {
+  size_t len = 0;
+  while (conn->inflight < options->pipeline && conn->sent < options->requests) {
+    char key[32];
+    int key_len = snprintf(key, sizeof(key), "key:%012ld",
+                           (long)(next_random(&conn->state) % options->keyspace));
+    if (conn->sent & 1)
+      len += sprintf(buf + len, "*2\r\n$3\r\nGET\r\n$%d\r\n%s\r\n", key_len, key);
+    else
+      len += sprintf(buf + len, "*3\r\n$3\r\nSET\r\n$%d\r\n%s\r\n$3\r\nxxx\r\n", key_len, key);
+    conn->sent++;
+    conn->inflight++;
+  }
+
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(conn->fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("write");
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Count the complete replies read so far. Only the simple types and bulk
+// strings SET and GET answer with are expected.
+static int conn_receive(Conn *conn) {
+  ssize_t n = read(conn->fd, conn->rbuf + conn->rlen, sizeof(conn->rbuf) - conn->rlen);
+  if (n <= 0) {
+    fprintf(stderr, "Connection closed by the server\n");
+    return -1;
+  }
+  conn->rlen += n;
+
+  char *p = conn->rbuf, *end = conn->rbuf + conn->rlen;
+  while (p < end) {
+    char *line_end = memchr(p, '\n', end - p);
+    if (line_end == NULL)
+      break;
+    if (*p == '-') {
+      fprintf(stderr, "Server error: %.*s\n", (int)(line_end - p), p);
+      return -1;
+    }
+    if (*p == '$') {
+      long len = strtol(p + 1, NULL, 10);
+      if (len >= 0) {
+        if (end - (line_end + 1) < len + 2)
+          break;
+        line_end += len + 2;
+      }
+    }
+    p = line_end + 1;
+    conn->inflight--;
+    conn->received++;
+  }
+  conn->rlen = end - p;
+  memmove(conn->rbuf, p, conn->rlen);
+  return 0;
+}
+
+static void *worker_run(void *arg) {
+  Worker *worker = arg;
+  const Options *options = worker->options;
+  Conn *conns = calloc(worker->clients, sizeof(Conn));
+  struct pollfd *fds = calloc(worker->clients, sizeof(struct pollfd));
+  char *buf = malloc((size_t)options->pipeline * 128);
+  if (conns == NULL || fds == NULL || buf == NULL) {
+    worker->failed = 1;
+    return NULL;
+  }
+
+  for (int i = 0; i < worker->clients; i++) {
+    if (conn_open(&conns[i], options, worker->first_client + i) != 0) {
+      worker->failed = 1;
+      return NULL;
+    }
+    fds[i].fd = conns[i].fd;
+    fds[i].events = POLLIN;
+  }
+
+  long total = (long)worker->clients * options->requests;
+  while (worker->done < total) {
+    for (int i = 0; i < worker->clients; i++) {
+      if (conns[i].inflight == 0 && conns[i].sent < options->requests &&
+          conn_send(&conns[i], options, buf) != 0) {
+        worker->failed = 1;
+        return NULL;
+      }
+    }
+    if (poll(fds, worker->clients, 1000) < 0 && errno != EINTR) {
+      perror("poll");
+      worker->failed = 1;
+      return NULL;
+    }
+    for (int i = 0; i < worker->clients; i++) {
+      if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+      long before = conns[i].received;
+      if (conn_receive(&conns[i]) != 0) {
+        worker->failed = 1;
+        return NULL;
+      }
+      worker->done += conns[i].received - before;
+    }
+  }
+
+  for (int i = 0; i < worker->clients; i++)
+    close(conns[i].fd);
+  free(conns);
+  free(fds);
+  free(buf);
+  return NULL;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-h host] [-p port] [-c clients] [-t threads] [-P pipeline]\n"
+          "          [-n requests per client] [-r keyspace]\n",
+          name);
+}
+
+int main(int argc, char *argv[]) {
+  Options options = {"127.0.0.1", 6379, 50, 1, 1, 10000, 100000};
+  int opt;
+  while ((opt = getopt(argc, argv, "h:p:c:t:P:n:r:")) != -1) {
+    switch (opt) {
+    case 'h': options.host = optarg; break;
+    case 'p': options.port = atoi(optarg); break;
+    case 'c': options.clients = atoi(optarg); break;
+    case 't': options.threads = atoi(optarg); break;
+    case 'P': options.pipeline = atoi(optarg); break;
+    case 'n': options.requests = atol(optarg); break;
+    case 'r': options.keyspace = atol(optarg); break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if (options.clients < 1 || options.threads < 1 || options.threads > options.clients ||
+      options.pipeline < 1 || options.pipeline > MAX_PIPELINE || options.requests < 1 ||
+      options.keyspace < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  Worker *workers = calloc(options.threads, sizeof(Worker));
+  if (workers == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  uint64_t start = now_ns();
+  int first_client = 0;
+  for (int i = 0; i < options.threads; i++) {
+    workers[i].options = &options;
+    workers[i].first_client = first_client;
+    workers[i].clients = options.clients / options.threads + (i < options.clients % options.threads);
+    first_client += workers[i].clients;
+    if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+      fprintf(stderr, "Failed to start a thread\n");
+      return 1;
+    }
+  }
+
+  long done = 0;
+  int failed = 0;
+  for (int i = 0; i < options.threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    done += workers[i].done;
+    failed |= workers[i].failed;
+  }
+  double seconds = (now_ns() - start) / 1e9;
+  if (failed)
+    return 1;
+
+  printf("clients=%d threads=%d pipeline=%d ops=%ld %.0f ops/s\n", options.clients,
+         options.threads, options.pipeline, done, done / seconds);
+  free(workers);
+  return 0;
+}
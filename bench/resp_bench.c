@@ -0,0 +1,189 @@
+// Throughput of the RESP request parser in resp.c, in GB/s of query buffer,
+// on a few command mixes a server sees, and of resp_find_crlf alone on
+// long lines. The \r\n search is picked at compile time, so each path is
+// its own build; run all three from the repository root:
+//   gcc -O2 -mavx2 -Iapp -o resp_bench_avx2 bench/resp_bench.c app/resp.c app/sds.c
+//   gcc -O2 -Iapp -o resp_bench_sse2 bench/resp_bench.c app/resp.c app/sds.c
+//   gcc -O2 -DRESP_SCALAR -Iapp -o resp_bench_scalar bench/resp_bench.c app/resp.c app/sds.c
+//
+// Each mix fills a buffer with back to back commands, the way a pipelining
+// client fills the query buffer, and the figure is the best of five passes
+// over it.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "resp.h"
+
+#define BUFFER_SIZE (16 * 1024 * 1024)
+#define LINE_SIZE (64 * 1024)
+#define ROUNDS 5
+
+#if defined(__AVX2__) && !defined(RESP_SCALAR)
+#define CRLF_PATH "avx2"
+#elif defined(__SSE2__) && !defined(RESP_SCALAR)
+#define CRLF_PATH "sse2"
+#else
+#define CRLF_PATH "scalar"
+#endif
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+// Appends one command of the mix at out, returns its length
+typedef size_t (*CommandWriter)(char *out, uint64_t *state);
+
+// redis-benchmark's GET and SET: short keys, 3 byte values
+static size_t write_small(char *out, uint64_t *state) {
+  unsigned long long key = next_random(state) % 1000000;
+  if (next_random(state) & 1)
+    return sprintf(out, "*2\r\n$3\r\nGET\r\n$16\r\nkey:%012llu\r\n", key);
+  return sprintf(out, "*3\r\n$3\r\nSET\r\n$16\r\nkey:%012llu\r\n$3\r\nxxx\r\n", key);
+}
+
+// SETs of 1KB values, where the \r\n search is what's left of the cost
+static size_t write_large(char *out, uint64_t *state) {
+  size_t len = sprintf(out, "*3\r\n$3\r\nSET\r\n$16\r\nkey:%012llu\r\n$1024\r\n",
+                       (unsigned long long)(next_random(state) % 1000000));
+  memset(out + len, 'v', 1024);
+  memcpy(out + len + 1024, "\r\n", 2);
+  return len + 1026;
+}
+
+// Many short arguments, like an MSET of 16 pairs
+static size_t write_wide(char *out, uint64_t *state) {
+  size_t len = sprintf(out, "*33\r\n$4\r\nMSET\r\n");
+  for (int i = 0; i < 16; i++) {
+    len += sprintf(out + len, "$16\r\nkey:%012llu\r\n$8\r\nval:%04d\r\n",
+                   (unsigned long long)(next_random(state) % 1000000), i);
+  }
+  return len;
+}
+
+// What telnet and bare clients send
+static size_t write_inline(char *out, uint64_t *state) {
+  return sprintf(out, "GET key:%012llu\r\n",
+                 (unsigned long long)(next_random(state) % 1000000));
+}
+
+typedef struct {
+  const char *name;
+  CommandWriter write;
+} Mix;
+
+static const Mix mixes[] = {
+    {"small GET/SET", write_small},
+    {"SET 1KB values", write_large},
+    {"MSET 16 pairs", write_wide},
+    {"inline GET", write_inline},
+};
+
+static size_t fill(char *buf, const Mix *mix, size_t *commands) {
+  uint64_t state = 0x9e3779b97f4a7c15ULL;
+  size_t len = 0;
+  *commands = 0;
+  while (len + 2048 < BUFFER_SIZE) {
+    len += mix->write(buf + len, &state);
+    (*commands)++;
+  }
+  return len;
+}
+
+// Parse every command in buf, as parse_commands_in_buffer does. Returns
+// -1 if the parser didn't see the commands that were written.
+static double time_parse(const char *buf, size_t len, size_t commands, RESPArgs *args) {
+  double best = 0;
+  for (int round = 0; round < ROUNDS; round++) {
+    RESPParser parser;
+    resp_parser_init(&parser);
+    const char *pos = buf, *end = buf + len;
+    size_t parsed = 0;
+
+    uint64_t start = now_ns();
+    while (pos < end) {
+      args->count = 0;
+      long consumed = resp_parse_command(&parser, pos, end, args);
+      if (consumed <= 0)
+        return -1;
+      pos += consumed;
+      parsed++;
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    if (parsed != commands)
+      return -1;
+    double gbps = (double)len / elapsed;
+    if (gbps > best)
+      best = gbps;
+  }
+  return best;
+}
+
+// Scan line, which has its only \r\n at the very end, for it
+static double time_find_crlf(char *line) {
+  memset(line, 'x', LINE_SIZE);
+  memcpy(line + LINE_SIZE - 2, "\r\n", 2);
+  size_t iterations = 20000;
+  double best = 0;
+  for (int round = 0; round < ROUNDS; round++) {
+    size_t found = 0;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < iterations; i++) {
+      line[i % (LINE_SIZE - 2)] ^= 1; // Not the same search every time
+      found += resp_find_crlf(line, line + LINE_SIZE) == line + LINE_SIZE - 2;
+    }
+    uint64_t elapsed = now_ns() - start;
+    if (found != iterations)
+      return -1;
+    double gbps = (double)LINE_SIZE * iterations / elapsed;
+    if (gbps > best)
+      best = gbps;
+  }
+  return best;
+}
+
+int main() {
+  char *buf = malloc(BUFFER_SIZE);
+  RESPArgs args = {NULL, 0, 0};
+  if (buf == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  printf("\\r\\n search: %s\n", CRLF_PATH);
+  printf("%-16s %10s %12s\n", "", "GB/s", "Mcommands/s");
+  for (size_t m = 0; m < sizeof(mixes) / sizeof(mixes[0]); m++) {
+    size_t commands;
+    size_t len = fill(buf, &mixes[m], &commands);
+    double gbps = time_parse(buf, len, commands, &args);
+    if (gbps < 0) {
+      fprintf(stderr, "%s: the parser didn't return the commands written\n", mixes[m].name);
+      return 1;
+    }
+    printf("%-16s %10.2f %12.1f\n", mixes[m].name, gbps, gbps * 1e3 * commands / len);
+  }
+
+  double gbps = time_find_crlf(buf);
+  if (gbps < 0) {
+    fprintf(stderr, "resp_find_crlf missed the \\r\\n\n");
+    return 1;
+  }
+  printf("%-16s %10.2f\n", "64KB line", gbps);
+
+  free(args.args);
+  free(buf);
+  return 0;
+}
@@ -0,0 +1,100 @@
+// Checks that the active expire cycle removes exactly the keys that are
+// past their expiry, and counts each of them once in stat_expired_keys,
+// which INFO reports as expired_keys.
+//
+// Build and run from the repository root:
+//   gcc -O2 -Iapp -o expire_test tests/expire_test.c app/expire.c app/keyspace.c app/hashtable.c app/hash.c app/sds.c app/helper.c
+//   ./expire_test
+//
+// Exits 0 when every check passed.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "expire.h"
+#include "hash.h"
+#include "helper.h"
+#include "keyspace.h"
+
+#define EXPIRED_KEYS 5000
+#define LIVE_KEYS 1000
+#define PERSISTENT_KEYS 1000
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                                                       \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);                     \
+      fprintf(stderr, __VA_ARGS__);                                            \
+      fprintf(stderr, "\n");                                                   \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+static void set_key(ht_table *ht, const char *prefix, int i, uint64_t expiry) {
+  char key[64];
+  int len = snprintf(key, sizeof(key), "%s:%d", prefix, i);
+  if (ht_set(ht, key, len, "value", 5, expiry) == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+}
+
+static uint64_t expired_keys(Keyspace *keyspace) {
+  uint64_t total = 0;
+  for (int db = 0; db < KEYSPACE_DB_COUNT; db++)
+    total += keyspace->db[db]->stat_expired_keys;
+  return total;
+}
+
+int main() {
+  hash_init(HASH_WYHASH);
+  Keyspace *keyspace = keyspace_create();
+  RedisStats *stats = calloc(1, sizeof(RedisStats));
+  if (keyspace == NULL || stats == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  // Spread over two databases, so the cycle has to move between them
+  uint64_t now = get_current_epoch_ms();
+  for (int i = 0; i < EXPIRED_KEYS; i++)
+    set_key(keyspace->db[i % 2], "expired", i, now - 1000);
+  for (int i = 0; i < LIVE_KEYS; i++)
+    set_key(keyspace->db[i % 2], "live", i, now + 3600 * 1000);
+  for (int i = 0; i < PERSISTENT_KEYS; i++)
+    set_key(keyspace->db[i % 2], "persistent", i, 0);
+
+  // Each call may stop early on its time limit or once few samples are
+  // stale, so run it until the expired keys are gone
+  for (int i = 0; i < 10000 && keyspace_expires_count(keyspace) > LIVE_KEYS; i++)
+    active_expire_cycle(keyspace, stats, 1000);
+
+  CHECK(keyspace_expires_count(keyspace) == LIVE_KEYS, "%zu keys left with an expiry, want %d",
+        keyspace_expires_count(keyspace), LIVE_KEYS);
+  CHECK(expired_keys(keyspace) == EXPIRED_KEYS, "expired_keys is %llu, want %d",
+        (unsigned long long)expired_keys(keyspace), EXPIRED_KEYS);
+
+  size_t length = keyspace->db[0]->length + keyspace->db[1]->length;
+  CHECK(length == LIVE_KEYS + PERSISTENT_KEYS, "%zu keys left, want %d", length,
+        LIVE_KEYS + PERSISTENT_KEYS);
+
+  // A lazily expired key is counted once too
+  set_key(keyspace->db[2], "lazy", 0, now - 1000);
+  CHECK(ht_get(keyspace->db[2], "lazy:0", 6) == NULL, "lazy:0 should have expired");
+  CHECK(ht_del(keyspace->db[2], "lazy:0", 6) == 0, "lazy:0 should already be gone");
+  CHECK(expired_keys(keyspace) == EXPIRED_KEYS + 1, "expired_keys is %llu, want %d",
+        (unsigned long long)expired_keys(keyspace), EXPIRED_KEYS + 1);
+
+  keyspace_destroy(keyspace);
+  free(stats);
+  if (failures > 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("expire_test: ok\n");
+  return 0;
+}
@@ -14,7 +14,7 @@ set -e # Exit early if any commands fail
 # - Edit .codecrafters/compile.sh to change how your program compiles remotely
 (
   cd "$(dirname "$0")" # Ensure compile steps are run within the repository directory
-  gcc -o /tmp/codecrafters-build-redis-c app/*.c
+  gcc -o /tmp/codecrafters-build-redis-c app/*.c -lpthread
 )
 
 # Copied from .codecrafters/run.sh